@@ -0,0 +1,581 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Asynchronous client library of HashServer.
+ *
+ * AsyncClient keeps a pool of line mode connections to one server. Every
+ * request is sent over the connection with the fewest pending requests, and
+ * requests are pipelined: a connection does not wait for a response before
+ * it writes the next request. Requests queued while a write is in progress
+ * are batched into one gather write. Every request has a deadline; a request
+ * that gets no response in time fails with timed_out error, and if it was
+ * already written its connection is closed (responses come in order, so
+ * the connection cannot be used after a lost one) and reopened by the next
+ * request.
+ *
+ * The client does not run io_context by itself: callbacks are called and
+ * futures are completed by threads that run the io_context passed to the
+ * constructor. A callback must not block them.
+ */
+namespace hash_client {
+
+using tcp = boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+/// Called with a response line (without '\n') or an error
+using Callback =
+    std::function<void(const boost::system::error_code&, std::string)>;
+
+/** Called with an invalidation pushed by the server in tracking mode: a
+ * table and a key, a table without key if all keys of the table are
+ * invalid, nothing if the whole cache is invalid (a connection was lost).
+ */
+using InvalidationHandler = std::function<void(std::optional<size_t> table,
+                                               std::optional<std::string> key)>;
+
+/**
+ * \class Connection
+ *
+ *
+ * \brief One pipelined line mode connection, used by AsyncClient.
+ *
+ * All members are used in the strand of the connection. Requests wait in
+ * queued_ until they are written and in sent_ until their responses are
+ * read, so the oldest request of sent_ gets the next response line.
+ */
+class Connection : public std::enable_shared_from_this<Connection> {
+ public:
+  /**
+   * A constructor. The connection is opened by the first request.
+   * \param io_context an io_context& argument.
+   * \param endpoint address of the server
+   * \param greeting requests sent first by every new socket, their
+   * responses are ignored
+   * \param on_push called with "invalidate" lines, and with "invalidate"
+   * when the socket is closed; empty if the connection does not track keys
+   */
+  Connection(boost::asio::io_context& io_context, tcp::endpoint endpoint,
+             std::vector<std::string> greeting = {},
+             std::function<void(const std::string&)> on_push = nullptr)
+      : socket_(io_context),
+        strand_(io_context.get_executor()),
+        timer_(io_context),
+        endpoint_(endpoint),
+        greeting_(std::move(greeting)),
+        on_push_(std::move(on_push)) {}
+
+  /** \brief Sends a request line, can be called from any thread.
+   * \param line request without '\n'
+   * \param timeout time to get the response
+   * \param callback called with the response or an error
+   */
+  void request(std::string line, Clock::duration timeout, Callback callback) {
+    pending_++;
+    boost::asio::post(strand_, [self = shared_from_this(),
+                                request = Request{std::move(line) + "\n",
+                                                  Clock::now() + timeout,
+                                                  std::move(callback)}]() {
+      self->queue(std::move(request));
+    });
+  }
+
+  /// Returns number of requests without response
+  size_t pending() const { return pending_; }
+
+  /// Fails all pending requests and closes the connection
+  void close() {
+    boost::asio::post(strand_, [self = shared_from_this()]() {
+      self->fail_all(boost::asio::error::operation_aborted);
+    });
+  }
+
+ private:
+  static const size_t MAX_BATCH = 64;  /// max requests in one write
+
+  struct Request {
+    std::string line;
+    Clock::time_point deadline;
+    Callback callback;
+  };
+
+  tcp::socket socket_;
+  boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+  boost::asio::steady_timer timer_;  /// deadline of the earliest request
+  tcp::endpoint endpoint_;
+  std::vector<std::string> greeting_;
+  std::function<void(const std::string&)> on_push_;
+  boost::asio::streambuf buffer_;
+  std::deque<Request> queued_;  /// not written yet
+  std::deque<Request> sent_;    /// written or being written, in order
+  size_t writing_ = 0;          /// requests of sent_ in the current write
+  size_t generation_ = 0;  /// number of the socket, handlers of old ones quit
+  bool connecting_ = false;
+  bool connected_ = false;
+  std::atomic<size_t> pending_{0};
+
+  void queue(Request request) {
+    if ((queued_.empty() && sent_.empty()) ||
+        request.deadline < timer_.expiry()) {
+      start_timer(request.deadline);
+    }
+    queued_.push_back(std::move(request));
+    if (!connected_ && !connecting_) {
+      connect();
+    } else {
+      start_write();
+    }
+  }
+
+  void connect() {
+    connecting_ = true;
+    socket_.async_connect(
+        endpoint_,
+        boost::asio::bind_executor(
+            strand_, [self = shared_from_this(), generation = generation_](
+                         const boost::system::error_code& err) {
+              if (generation != self->generation_) {
+                return;
+              }
+              self->connecting_ = false;
+              if (err) {
+                self->fail_all(err);
+                return;
+              }
+              self->connected_ = true;
+              const auto& greeting = self->greeting_;
+              for (auto it = greeting.rbegin(); it != greeting.rend(); it++) {
+                self->pending_++;
+                self->queued_.push_front(Request{
+                    *it + "\n", Clock::time_point::max(),
+                    [](const boost::system::error_code&, std::string) {}});
+              }
+              self->start_write();
+              self->start_read();
+            }));
+  }
+
+  /// Writes queued requests in one gather write if no write is in progress
+  void start_write() {
+    if (!connected_ || writing_ || queued_.empty()) {
+      return;
+    }
+    // references to deque elements survive push_back and pop_front
+    std::vector<boost::asio::const_buffer> buffers;
+    while (!queued_.empty() && writing_ < MAX_BATCH) {
+      sent_.push_back(std::move(queued_.front()));
+      queued_.pop_front();
+      buffers.push_back(boost::asio::buffer(sent_.back().line));
+      writing_++;
+    }
+    boost::asio::async_write(
+        socket_, buffers,
+        boost::asio::bind_executor(
+            strand_, [self = shared_from_this(), generation = generation_](
+                         const boost::system::error_code& err, size_t) {
+              if (generation != self->generation_) {
+                return;
+              }
+              self->writing_ = 0;
+              if (err) {
+                self->fail_all(err);
+                return;
+              }
+              self->start_write();
+            }));
+  }
+
+  void start_read() {
+    boost::asio::async_read_until(
+        socket_, buffer_, '\n',
+        boost::asio::bind_executor(
+            strand_, [self = shared_from_this(), generation = generation_](
+                         const boost::system::error_code& err, size_t bytes) {
+              if (generation == self->generation_) {
+                self->handle_read(err, bytes);
+              }
+            }));
+  }
+
+  void handle_read(const boost::system::error_code& err, size_t bytes) {
+    if (err) {
+      fail_all(err);
+      return;
+    }
+    const char* data = static_cast<const char*>(buffer_.data().data());
+    std::string response(data, bytes - 1);
+    buffer_.consume(bytes);
+    if (on_push_ && response.rfind("invalidate", 0) == 0) {
+      on_push_(response);  // not a response to a request
+      start_read();
+      return;
+    }
+    if (sent_.empty()) {
+      fail_all(boost::asio::error::invalid_argument);  // unexpected response
+      return;
+    }
+    Request request = std::move(sent_.front());
+    sent_.pop_front();
+    pending_--;
+    request.callback(boost::system::error_code(), std::move(response));
+    start_read();
+  }
+
+  void start_timer(Clock::time_point deadline) {
+    timer_.expires_at(deadline);
+    timer_.async_wait(boost::asio::bind_executor(
+        strand_,
+        [self = shared_from_this()](const boost::system::error_code& err) {
+          if (!err) {
+            self->check_deadlines();
+          }
+        }));
+  }
+
+  /// Fails expired requests, restarts the timer for the earliest other one
+  void check_deadlines() {
+    Clock::time_point now = Clock::now();
+    for (const auto& request : sent_) {
+      if (request.deadline <= now) {
+        fail_all(boost::asio::error::timed_out);
+        return;
+      }
+    }
+    std::optional<Clock::time_point> earliest;
+    for (auto it = queued_.begin(); it != queued_.end();) {
+      if (it->deadline <= now) {
+        Callback callback = std::move(it->callback);
+        it = queued_.erase(it);
+        pending_--;
+        callback(boost::asio::error::timed_out, std::string());
+      } else {
+        earliest = earliest ? std::min(*earliest, it->deadline) : it->deadline;
+        it++;
+      }
+    }
+    for (const auto& request : sent_) {
+      earliest = earliest ? std::min(*earliest, request.deadline)
+                          : request.deadline;
+    }
+    if (earliest) {
+      start_timer(*earliest);
+    }
+  }
+
+  /// Closes the socket and fails all pending requests with err
+  void fail_all(const boost::system::error_code& err) {
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+    timer_.cancel();
+    generation_++;
+    writing_ = 0;
+    connecting_ = false;
+    if (connected_ && on_push_) {
+      on_push_("invalidate");  // invalidations may be lost with the socket
+    }
+    connected_ = false;
+    buffer_.consume(buffer_.size());
+    std::deque<Request> failed = std::move(sent_);
+    for (auto& request : queued_) {
+      failed.push_back(std::move(request));
+    }
+    sent_.clear();
+    queued_.clear();
+    for (auto& request : failed) {
+      pending_--;
+      request.callback(err, std::string());
+    }
+  }
+};
+
+/// Settings of AsyncClient
+struct Options {
+  size_t connections = 4;                             /// size of the pool
+  Clock::duration timeout = std::chrono::seconds(5);  /// of a request
+  /// turns tracking mode on for all connections if it is not empty
+  InvalidationHandler on_invalidate;
+};
+
+/**
+ * \class AsyncClient
+ *
+ *
+ * \brief Client of one HashServer with a pool of pipelined connections.
+ *
+ * Methods mirror server commands and return futures, a future throws
+ * boost::system::system_error if the request failed (connection error or
+ * timeout) and std::runtime_error if the server returned an error of the
+ * table or the command ("error table=...", "error readonly", "moved ...").
+ * An error of the key is a normal result (nullopt or false).
+ * request() sends any command and has a callback form.
+ *
+ * If Options::on_invalidate is set, every connection sends "tracking on"
+ * and the handler gets invalidations of keys read by get_val and mget_val,
+ * so an application can cache their values. The handler is called by the
+ * io_context threads, possibly by several of them at once.
+ */
+class AsyncClient {
+ public:
+  /**
+   * A constructor. Connections are opened by the first requests.
+   * \param io_context an io_context& argument.
+   * \param address address of the server in "ip:port" format
+   * \param username user that sends the commands
+   * \param options size of the pool and default timeout
+   */
+  AsyncClient(boost::asio::io_context& io_context, const std::string& address,
+              std::string username, Options options = Options())
+      : username_(std::move(username)), options_(options) {
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos) {
+      throw std::invalid_argument("server address must be ip:port");
+    }
+    tcp::endpoint endpoint(
+        boost::asio::ip::address::from_string(address.substr(0, colon)),
+        std::stoi(address.substr(colon + 1)));
+    for (size_t i = 0; i < std::max<size_t>(options_.connections, 1); i++) {
+      if (options_.on_invalidate) {
+        pool_.push_back(std::make_shared<Connection>(
+            io_context, endpoint,
+            std::vector<std::string>{username_ + " tracking on"},
+            [handler = options_.on_invalidate](const std::string& line) {
+              handler(table_of(line), key_of(line));
+            }));
+      } else {
+        pool_.push_back(std::make_shared<Connection>(io_context, endpoint));
+      }
+    }
+  }
+
+  /// A destructor. Fails pending requests with operation_aborted.
+  ~AsyncClient() {
+    for (auto& connection : pool_) {
+      connection->close();
+    }
+  }
+
+  /** \brief Sends a command over the least loaded connection.
+   * \param command command without username, e.g. "getval key=1 table=0"
+   * \param callback called with the response line or an error
+   * \param timeout time to get the response, default one of Options if 0
+   */
+  void request(std::string command, Callback callback,
+               Clock::duration timeout = Clock::duration::zero()) {
+    Connection* least = pool_.front().get();
+    for (auto& connection : pool_) {
+      if (connection->pending() < least->pending()) {
+        least = connection.get();
+      }
+    }
+    least->request(username_ + " " + command,
+                   timeout == Clock::duration::zero() ? options_.timeout
+                                                      : timeout,
+                   std::move(callback));
+  }
+
+  /// Sends a command and returns future of the response line
+  std::future<std::string> request(std::string command) {
+    return call<std::string>(std::move(command),
+                             [](std::string response) { return response; });
+  }
+
+  /// Creates a table, returns its number
+  std::future<size_t> add_table() {
+    return call<size_t>("addtable", [](std::string response) {
+      check_error(response);
+      return size_t(std::stoull(response));
+    });
+  }
+
+  /// Removes a table of the user
+  std::future<void> remove_table(size_t table) {
+    return call<void>("remtable " + std::to_string(table),
+                      [](std::string response) { check_error(response); });
+  }
+
+  /// Gets full copy of a table of the user ("key:value" pairs)
+  std::future<std::vector<std::string>> get_table(size_t table) {
+    return call<std::vector<std::string>>(
+        "gettable " + std::to_string(table), [](std::string response) {
+          check_error(response);
+          return split(response);
+        });
+  }
+
+  /// Sets value by key with ttl, returns false if it does not fit
+  std::future<bool> set_val(size_t table, const std::string& key,
+                            const std::string& val, size_t ttl) {
+    return call<bool>("setval key=" + key + " val=" + val +
+                          " table=" + std::to_string(table) +
+                          " ttl=" + std::to_string(ttl),
+                      [](std::string response) {
+                        return !is_key_error(response);
+                      });
+  }
+
+  /// Gets value by key, nullopt if there is no one
+  std::future<std::optional<std::string>> get_val(size_t table,
+                                                  const std::string& key) {
+    return call<std::optional<std::string>>(
+        "getval key=" + key + " table=" + std::to_string(table),
+        [](std::string response) -> std::optional<std::string> {
+          if (is_key_error(response)) {
+            return std::nullopt;
+          }
+          return value_of(split(response));
+        });
+  }
+
+  /// Gets values of a batch of keys in one request, nullopt for absent ones
+  std::future<std::vector<std::optional<std::string>>> mget_val(
+      size_t table, const std::vector<std::string>& keys) {
+    std::string command = "mgetval table=" + std::to_string(table);
+    for (const auto& key : keys) {
+      command += " key=" + key;
+    }
+    return call<std::vector<std::optional<std::string>>>(
+        std::move(command), [](std::string response) {
+          std::vector<std::optional<std::string>> values;
+          std::vector<std::string> tokens = split(response);
+          // "ok key= value= table=" or "error key=" for every key
+          for (size_t i = 0; i < tokens.size();) {
+            if (tokens[i] == "ok" && i + 4 <= tokens.size()) {
+              values.push_back(value_of({tokens.begin() + i,
+                                         tokens.begin() + i + 4}));
+              i += 4;
+            } else if (tokens[i] == "error" && i + 1 < tokens.size() &&
+                       tokens[i + 1].rfind("key=", 0) == 0) {
+              values.push_back(std::nullopt);
+              i += 2;
+            } else {
+              throw std::runtime_error(response);
+            }
+          }
+          return values;
+        });
+  }
+
+  /// Adds delta to integer value, returns new value, nullopt if not integer
+  std::future<std::optional<int64_t>> incr(size_t table,
+                                           const std::string& key,
+                                           int64_t delta, size_t ttl) {
+    return call<std::optional<int64_t>>(
+        "incr key=" + key + " table=" + std::to_string(table) +
+            " by=" + std::to_string(delta) + " ttl=" + std::to_string(ttl),
+        [](std::string response) -> std::optional<int64_t> {
+          if (is_key_error(response)) {
+            return std::nullopt;
+          }
+          return std::stoll(*value_of(split(response)));
+        });
+  }
+
+  /// Changes expiration time of a value, returns false if it does not exist
+  std::future<bool> touch(size_t table, const std::string& key, size_t ttl) {
+    return call<bool>("touch key=" + key + " table=" + std::to_string(table) +
+                          " ttl=" + std::to_string(ttl),
+                      [](std::string response) {
+                        return !is_key_error(response);
+                      });
+  }
+
+ private:
+  std::string username_;
+  Options options_;
+  std::vector<std::shared_ptr<Connection>> pool_;
+
+  /// Sends a command and completes the future with parse(response)
+  template <typename T, typename Parse>
+  std::future<T> call(std::string command, Parse parse) {
+    auto promise = std::make_shared<std::promise<T>>();
+    std::future<T> future = promise->get_future();
+    request(std::move(command), [promise, parse](
+                                    const boost::system::error_code& err,
+                                    std::string response) {
+      if (err) {
+        promise->set_exception(
+            std::make_exception_ptr(boost::system::system_error(err)));
+        return;
+      }
+      try {
+        if constexpr (std::is_void_v<T>) {
+          parse(std::move(response));
+          promise->set_value();
+        } else {
+          promise->set_value(parse(std::move(response)));
+        }
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    });
+    return future;
+  }
+
+  static std::vector<std::string> split(const std::string& response) {
+    std::vector<std::string> tokens;
+    std::istringstream ss(response);
+    std::string token;
+    while (ss >> token) {
+      tokens.push_back(token);
+    }
+    return tokens;
+  }
+
+  /// Throws std::runtime_error if the response is an error of the command
+  static void check_error(const std::string& response) {
+    if (response.rfind("error", 0) == 0 || response.rfind("moved", 0) == 0) {
+      throw std::runtime_error(response);
+    }
+  }
+
+  /// Checks for "error key=" response, throws on other errors
+  static bool is_key_error(const std::string& response) {
+    if (response.rfind("error key=", 0) == 0) {
+      return true;
+    }
+    check_error(response);
+    return false;
+  }
+
+  /// Returns table of "invalidate table=table key=key" line
+  static std::optional<size_t> table_of(const std::string& line) {
+    size_t at = line.find(" table=");
+    if (at == std::string::npos) {
+      return std::nullopt;
+    }
+    return std::stoull(line.substr(at + 7));
+  }
+
+  /// Returns key of "invalidate table=table key=key" line
+  static std::optional<std::string> key_of(const std::string& line) {
+    size_t at = line.find(" key=");
+    if (at == std::string::npos) {
+      return std::nullopt;
+    }
+    return line.substr(at + 5);
+  }
+
+  /// Returns value of "ok key=key value=value table=table" tokens
+  static std::optional<std::string> value_of(
+      const std::vector<std::string>& tokens) {
+    if (tokens.size() < 3 || tokens[0] != "ok" ||
+        tokens[2].rfind("value=", 0) != 0) {
+      throw std::runtime_error("unexpected response");
+    }
+    return tokens[2].substr(6);
+  }
+};
+
+}  // namespace hash_client
@@ -0,0 +1,189 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * \class ClusterClient
+ *
+ *
+ * \brief Client of a cluster of HashServers that sends commands of a table
+ * directly to the node that owns it.
+ *
+ * The client gets the slot map of the cluster by "cluster" command from the
+ * seed node and caches it: the owner of table number t is node t % nodes.
+ * Connections to nodes are opened once and kept in line mode, so requests
+ * to one node go over one connection. When a node answers with "moved"
+ * redirect (the cluster was changed), the client gets the map from the new
+ * owner and repeats the command there.
+ *
+ * A server without cluster options is a cluster of one node (the seed).
+ * The client is not thread safe, every thread should have its own one.
+ */
+class ClusterClient {
+ public:
+  /**
+   * A constructor. Connects to the seed node and gets the slot map.
+   * \param seed address of any node in "ip:port" format
+   * \param username user that sends the commands
+   */
+  ClusterClient(const std::string& seed, std::string username)
+      : username_(std::move(username)) {
+    refresh(seed);
+  }
+
+  /** \brief Gets the slot map from a node.
+   * \param node address of the node in "ip:port" format
+   */
+  void refresh(const std::string& node) {
+    std::string response = call(node, username_ + " cluster");
+    size_t nodes = response.find("nodes=");
+    if (response.rfind("ok ", 0) != 0 || nodes == std::string::npos) {
+      throw std::runtime_error("unexpected cluster response: " + response);
+    }
+    std::string list =
+        response.substr(nodes + 6, response.find(' ', nodes) - nodes - 6);
+    nodes_.clear();
+    for (size_t begin = 0; begin < list.size();) {
+      size_t end = list.find(',', begin);
+      if (end == std::string::npos) {
+        end = list.size();
+      }
+      nodes_.push_back(list.substr(begin, end - begin));
+      begin = end + 1;
+    }
+    if (nodes_.empty()) {  // cluster mode is off
+      nodes_.push_back(node);
+    }
+  }
+
+  /// Returns addresses of cached cluster nodes
+  const std::vector<std::string>& nodes() const { return nodes_; }
+
+  /// Returns address of the node that owns a table
+  const std::string& owner(size_t table) const {
+    return nodes_[table % nodes_.size()];
+  }
+
+  /** \brief Creates a table, nodes are used in turn.
+   *
+   * \return table number, nullopt if the node cannot create a table.
+   */
+  std::optional<size_t> add_table() {
+    const std::string& node = nodes_[next_node_++ % nodes_.size()];
+    std::string response = call(node, username_ + " addtable");
+    if (response.empty() || response.rfind("error", 0) == 0) {
+      return std::nullopt;
+    }
+    return std::stoull(response);
+  }
+
+  /// Removes a table, returns server response
+  std::string remove_table(size_t table) {
+    return request(table, "remtable " + std::to_string(table));
+  }
+
+  /// Gets full copy of a table, returns server response
+  std::string get_table(size_t table) {
+    return request(table, "gettable " + std::to_string(table));
+  }
+
+  /// Sets value by key with ttl, returns server response
+  std::string set_val(size_t table, const std::string& key,
+                      const std::string& val, size_t ttl) {
+    return request(table, "setval key=" + key + " val=" + val +
+                              " table=" + std::to_string(table) +
+                              " ttl=" + std::to_string(ttl));
+  }
+
+  /// Gets value by key, returns server response
+  std::string get_val(size_t table, const std::string& key) {
+    return request(table,
+                   "getval key=" + key + " table=" + std::to_string(table));
+  }
+
+  /** \brief Sends a command of a table to its owner.
+   * \param table table number the command works with
+   * \param command command without username, e.g. "getval key=1 table=3"
+   *
+   * Follows up to MAX_REDIRECTS "moved" redirects.
+   *
+   * \return server response without '\n'.
+   */
+  std::string request(size_t table, const std::string& command) {
+    std::string node = owner(table);
+    for (size_t i = 0;; i++) {
+      std::string response = call(node, username_ + " " + command);
+      if (response.rfind("moved ", 0) != 0 || i == MAX_REDIRECTS) {
+        return response;
+      }
+      size_t at = response.find("node=");
+      if (at == std::string::npos) {
+        return response;
+      }
+      node = response.substr(at + 5);
+      refresh(node);
+    }
+  }
+
+ private:
+  static const size_t MAX_REDIRECTS = 3;
+
+  /// Line mode connection to a node
+  struct Connection {
+    explicit Connection(boost::asio::io_context& io_context)
+        : socket(io_context) {}
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::streambuf buffer;
+  };
+
+  boost::asio::io_context io_context_;
+  std::string username_;
+  std::vector<std::string> nodes_;
+  std::map<std::string, std::unique_ptr<Connection>> connections_;
+  size_t next_node_ = 0;
+
+  /// Returns connection to a node, connects if there is no one
+  Connection& connection(const std::string& node) {
+    auto& connection = connections_[node];
+    if (!connection) {
+      size_t colon = node.rfind(':');
+      if (colon == std::string::npos) {
+        throw std::invalid_argument("node address must be ip:port");
+      }
+      auto created = std::make_unique<Connection>(io_context_);
+      created->socket.connect(boost::asio::ip::tcp::endpoint(
+          boost::asio::ip::address::from_string(node.substr(0, colon)),
+          std::stoi(node.substr(colon + 1))));
+      connection = std::move(created);
+    }
+    return *connection;
+  }
+
+  /** \brief Sends one request line to a node and reads its response line.
+   *
+   * A broken connection is reopened once, then the error is thrown.
+   */
+  std::string call(const std::string& node, const std::string& line) {
+    for (int attempt = 0;; attempt++) {
+      try {
+        Connection& conn = connection(node);
+        boost::asio::write(conn.socket, boost::asio::buffer(line + "\n"));
+        size_t bytes = boost::asio::read_until(conn.socket, conn.buffer, '\n');
+        const char* data = static_cast<const char*>(conn.buffer.data().data());
+        std::string response(data, bytes - 1);
+        conn.buffer.consume(bytes);
+        return response;
+      } catch (boost::system::system_error&) {
+        connections_.erase(node);  // closed by idle timeout or node restart
+        if (attempt > 0) {
+          throw;
+        }
+      }
+    }
+  }
+};
@@ -7,6 +7,9 @@
 #include <vector>
 #include <windows.h>
 
+#include "AsyncClient.h"
+#include "ClusterClient.h"
+
 using namespace boost::asio;
 using ip::tcp;
 using std::cout;
@@ -44,6 +47,7 @@ void test_user_request_response(
     boost::system::error_code error;
     boost::asio::write(socket, boost::asio::buffer(msg), error);
     if (!error) {
+      socket.shutdown(tcp::socket::shutdown_send, error);  // end of request
       cout << "Client sent message! " << msg << endl;
     } else {
       cout << "send failed: " << error.message() << endl;
@@ -79,6 +83,7 @@ void test_user_request_high_load(const vector<string>& requests) {
     boost::system::error_code error;
     boost::asio::write(socket, boost::asio::buffer(msg), error);
     if (!error) {
+      socket.shutdown(tcp::socket::shutdown_send, error);  // end of request
       cout << "Client sent message! " << msg << endl;
     } else {
       cout << "send failed: " << error.message() << endl;
@@ -98,9 +103,105 @@ void test_user_request_high_load(const vector<string>& requests) {
   }
 }
 
+void test_cluster(const string& seed) {
+  ClusterClient client(seed, "user1");
+  cout << "Cluster of " << client.nodes().size() << " nodes" << endl;
+
+  vector<size_t> tables;
+  for (size_t i = 0; i < client.nodes().size() * 2; i++) {
+    auto table = client.add_table();
+    ASSERT_TRUE(table != std::nullopt);
+    ASSERT_TRUE(client.owner(*table) ==
+                client.nodes()[i % client.nodes().size()]);
+    tables.push_back(*table);
+  }
+  for (size_t table : tables) {
+    string key = std::to_string(table);
+    ASSERT_TRUE(client.set_val(table, key, "aaa", 10000) == "");
+    ASSERT_TRUE(client.get_val(table, key) ==
+                "ok key=" + key + " value=aaa table=" + key);
+  }
+
+  if (client.nodes().size() > 1) {  // other nodes redirect to the owner
+    const string& node = client.nodes()[1];
+    string table = std::to_string(tables[0]);
+    boost::asio::io_context io_context;
+    tcp::socket socket(io_context);
+    socket.connect(tcp::endpoint(
+        boost::asio::ip::address::from_string(node.substr(0, node.rfind(':'))),
+        std::stoi(node.substr(node.rfind(':') + 1))));
+    boost::asio::write(socket, boost::asio::buffer("user1 getval key=" + table +
+                                                   " table=" + table + "\n"));
+    boost::asio::streambuf receive_buffer;
+    size_t bytes = boost::asio::read_until(socket, receive_buffer, '\n');
+    string response(
+        boost::asio::buffer_cast<const char*>(receive_buffer.data()), bytes);
+    cout << response << endl;
+    ASSERT_TRUE(response ==
+                "moved table=" + table + " node=" + client.nodes()[0] + "\n");
+  }
+
+  for (size_t table : tables) {
+    ASSERT_TRUE(client.remove_table(table) == "");
+    ASSERT_TRUE(client.get_table(table) ==
+                "error table=" + std::to_string(table));
+  }
+}
+
+void test_async_client() {
+  boost::asio::io_context io_context;
+  auto work = boost::asio::make_work_guard(io_context);
+  std::thread io_thread([&io_context]() { io_context.run(); });
+  {
+    hash_client::AsyncClient client(io_context, "127.0.0.1:1234", "user1");
+    size_t table = client.add_table().get();
+
+    // requests are pipelined over the pool without waiting for responses
+    const size_t keys_num = 1000;
+    vector<std::future<bool>> stored;
+    for (size_t i = 0; i < keys_num; i++) {
+      stored.push_back(client.set_val(table, std::to_string(i),
+                                      "val" + std::to_string(i), 10000));
+    }
+    for (auto& result : stored) {
+      ASSERT_TRUE(result.get());
+    }
+    ASSERT_TRUE(client.get_val(table, "1").get() == "val1");
+    ASSERT_TRUE(client.get_val(table, "absent").get() == std::nullopt);
+    auto values = client.mget_val(table, {"2", "absent", "3"}).get();
+    ASSERT_TRUE(values.size() == 3 && values[0] == "val2" &&
+                values[1] == std::nullopt && values[2] == "val3");
+    ASSERT_TRUE(client.incr(table, "counter", 5, 10000).get() == 5);
+    ASSERT_TRUE(client.get_table(table).get().size() == keys_num + 1);
+
+    std::promise<string> response;
+    client.request("getval key=4 table=" + std::to_string(table),
+                   [&response](const boost::system::error_code& err,
+                               string line) { response.set_value(line); });
+    ASSERT_TRUE(response.get_future().get() ==
+                "ok key=4 value=val4 table=" + std::to_string(table));
+
+    client.remove_table(table).get();
+    bool failed = false;
+    try {
+      client.get_val(table, "1").get();
+    } catch (std::runtime_error&) {
+      failed = true;  // table error is an exception
+    }
+    ASSERT_TRUE(failed);
+  }
+  work.reset();
+  io_thread.join();
+}
+
 int main(int argc, char** argv) {
   setlocale(LC_ALL, "Russian");
 
+  if (argc > 1) {  // cluster test, the argument is address of any node
+    test_cluster(argv[1]);
+    return 0;
+  }
+
   vector<vector<string>> all_user_requests;
   vector<vector<string>> all_user_responses;
 
@@ -132,6 +233,8 @@ int main(int argc, char** argv) {
 
   test_user_request_high_load({"unknown command"});  
 
+  test_async_client();
+
   {  // high load test
     const size_t user_num = 30;
     const size_t add_table_num = 15;
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../HashServer/HashMap.h"
+#include "../HashServer/HashMap.cpp"
+#include "../HashServer/HashMemory.cpp"
+
+/**
+ * Compares hash and bin policies of HashMap.
+ *
+ * For every key set and every combination of policies it fills a HashMap with
+ * KEYS_NUM keys and prints:
+ *  used    - share of non-empty buckets
+ *  longest - length of the longest collision chain
+ *  probes  - average key comparisons of a successful lookup
+ *  ns/get  - average time of a successful lookup (keys in random order)
+ */
+
+static const size_t KEYS_NUM = 50'000;
+static const size_t LOOKUP_ROUNDS = 20;
+static const size_t MAX_TIMED_CHAIN = 1'000;  /// longer ones are not timed
+
+template <typename Key, typename Hash, typename Bins>
+void run(const char* keys_name, const char* hash_name, const char* bins_name,
+         const std::vector<Key>& keys) {
+  HashMap<Key, Hash, Bins> hm;
+  for (const auto& key : keys) {
+    hm.put(key, "v", 1000);
+  }
+  auto stats = hm.chain_stats();
+  printf("%-10s %-10s %-10s %6.1f%% %8zu %8.2f", keys_name, hash_name,
+         bins_name, 100.0 * stats.used / stats.buckets, stats.longest,
+         double(stats.probes) / keys.size());
+  if (stats.longest > MAX_TIMED_CHAIN) {
+    printf(" %8s\n", "-");
+    return;
+  }
+
+  std::vector<Key> order = keys;
+  std::shuffle(order.begin(), order.end(), std::mt19937(1));
+  size_t found = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t round = 0; round < LOOKUP_ROUNDS; round++) {
+    for (const auto& key : order) {
+      found += hm.get(key).has_value();
+    }
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+
+  printf(" %8.1f%s\n", double(ns) / (LOOKUP_ROUNDS * keys.size()),
+         found == LOOKUP_ROUNDS * keys.size() ? "" : " (lost keys)");
+}
+
+template <typename Key, typename Hash>
+void run_bins(const char* keys_name, const char* hash_name,
+              const std::vector<Key>& keys) {
+  run<Key, Hash, PowerOfTwoBins>(keys_name, hash_name, "pow2", keys);
+  run<Key, Hash, FastRangeBins>(keys_name, hash_name, "fastrange", keys);
+  run<Key, Hash, ModuloBins>(keys_name, hash_name, "modulo", keys);
+}
+
+template <typename Key>
+void run_all(const char* keys_name, const std::vector<Key>& keys) {
+  run_bins<Key, DefaultHash<Key>>(keys_name, "wyhash", keys);
+  run_bins<Key, FibonacciHash>(keys_name, "fibonacci", keys);
+  run_bins<Key, Crc32cHash>(keys_name, "crc32c", keys);
+  run_bins<Key, XxHash64>(keys_name, "xxh64", keys);
+}
+
+int main() {
+  printf("%-10s %-10s %-10s %7s %8s %8s %8s\n", "keys", "hash", "bins",
+         "used", "longest", "probes", "ns/get");
+#ifdef HASHSERVER_HW_CRC32C
+  printf("crc32c uses SSE4.2\n");
+#endif
+
+  std::vector<uint64_t> sequential, strided, random;
+  std::mt19937_64 generator(42);
+  for (uint64_t i = 0; i < KEYS_NUM; i++) {
+    sequential.push_back(i);
+    strided.push_back(i << 16);
+    random.push_back(generator());
+  }
+  std::vector<SmallKey> strings, long_strings;
+  for (size_t i = 0; i < KEYS_NUM; i++) {
+    strings.push_back("user:" + std::to_string(i));
+    long_strings.push_back("session:" + std::to_string(i) +
+                           ":0123456789abcdef0123456789abcdef");
+  }
+
+  run_all("sequential", sequential);
+  run_all("strided", strided);
+  run_all("random", random);
+  run_all("strings", strings);
+  run_all("long", long_strings);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "HashCluster.h"
+
+#include <sstream>
+#include <stdexcept>
+
+std::vector<std::string> cluster_nodes;
+size_t cluster_node = 0;
+
+void set_cluster(const std::string& nodes, size_t node) {
+  cluster_nodes.clear();
+  cluster_node = 0;
+  if (nodes.empty()) {
+    return;
+  }
+  std::istringstream ss(nodes);
+  std::string address;
+  while (std::getline(ss, address, ',')) {
+    if (address.find(':') == std::string::npos) {
+      throw std::invalid_argument("cluster node address must be ip:port");
+    }
+    cluster_nodes.push_back(address);
+  }
+  if (node >= cluster_nodes.size()) {
+    throw std::invalid_argument("node index is out of the cluster");
+  }
+  cluster_node = node;
+}
+
+size_t cluster_size() {
+  return cluster_nodes.empty() ? 1 : cluster_nodes.size();
+}
+
+bool owns_table(size_t table_num) {
+  return table_num % cluster_size() == cluster_node;
+}
+
+size_t table_index(size_t table_num) { return table_num / cluster_size(); }
+
+size_t table_number(size_t index) {
+  return index * cluster_size() + cluster_node;
+}
+
+std::string moved_error(size_t table_num) {
+  return "moved table=" + std::to_string(table_num) +
+         " node=" + cluster_nodes[table_num % cluster_size()];
+}
+
+std::string cluster_map() {
+  std::string result = "ok nodes=";
+  for (size_t i = 0; i < cluster_nodes.size(); i++) {
+    if (i > 0) {
+      result += ",";
+    }
+    result += cluster_nodes[i];
+  }
+  return result + " node=" + std::to_string(cluster_node);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <vector>
+
+/*
+    Cluster mode: table numbers are partitioned across several servers.
+
+    A cluster is a list of nodes ("ip:port") that every node and client
+    knows in the same order. The slot map is the table number modulo the
+    number of nodes: node k owns tables k, k + nodes, k + 2 * nodes, ... and
+    creates only them, so table numbers are unique in the cluster without any
+    coordination. A table is kept in tables[number / nodes] of its node.
+
+    A node answers a command of a table of another node with
+    "moved table=<no> node=<ip:port>" response. "cluster" command returns the
+    slot map, so a client can cache it and send commands to owners directly.
+
+    Without cluster options the server is the only node and table numbers are
+    indexes of tables.
+*/
+
+/// Addresses of all nodes of the cluster, empty if cluster mode is off
+extern std::vector<std::string> cluster_nodes;
+/// Index of this server in cluster_nodes
+extern size_t cluster_node;
+
+/** \brief Sets the cluster from the list of nodes.
+ * \param nodes addresses of nodes separated by ',', empty turns cluster off
+ * \param node index of this server in the list
+ *
+ * Throws std::invalid_argument if node is not in the list.
+ */
+void set_cluster(const std::string& nodes, size_t node);
+
+/// Returns the number of nodes (1 if cluster mode is off)
+size_t cluster_size();
+
+/// Checks whether a table number belongs to this server
+bool owns_table(size_t table_num);
+
+/// Returns index in tables of a table number owned by this server
+size_t table_index(size_t table_num);
+
+/// Returns table number of index in tables of this server
+size_t table_number(size_t index);
+
+/** \brief Builds redirect to the owner of a table.
+ * \param table_num table unique number
+ *
+ * \return "moved table=table_num node=ip:port" string
+ */
+std::string moved_error(size_t table_num);
+
+/** \brief Builds the slot map of the cluster.
+ *
+ * \return "ok nodes=ip:port,ip:port,... node=index" string
+ */
+std::string cluster_map();
@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "HashKeys.h"
+
+/**
+ * \class HotKeys
+ *
+ *
+ * \brief Sampled access statistics of one table: finds its most used keys.
+ *
+ * An access is sampled with probability 1 / SAMPLE_RATE (random, so periodic
+ * access patterns are not aliased). A sampled key is counted in a
+ * Count-Min sketch (DEPTH rows of WIDTH counters, the estimate is the
+ * minimum of the key's counters, so it is never lower than the real count)
+ * and is kept in a min-heap of TOP_K keys with the highest estimates.
+ * Unsampled accesses cost one xorshift step, the sketch is allocated by the
+ * first sample, so idle tables take no memory. All counters are halved
+ * every DECAY_SAMPLES samples, so the statistics follow the recent load.
+ *
+ * \warning HotKeys is not thread safe, it is used under mutex lock
+ */
+class HotKeys {
+ public:
+  static const size_t SAMPLE_RATE = 16;  /// power of two
+  static const size_t TOP_K = 16;
+
+  /// Counts an access of a key
+  void access(std::string_view key) {
+    random_ ^= random_ << 13;
+    random_ ^= random_ >> 7;
+    random_ ^= random_ << 17;
+    if (random_ & (SAMPLE_RATE - 1)) {
+      return;
+    }
+    if (!sketch_) {
+      sketch_ = std::make_unique<uint32_t[]>(DEPTH * WIDTH);
+    }
+    uint64_t hash = wyhash::hash(key.data(), key.size());
+    uint32_t estimate = UINT32_MAX;
+    for (size_t row = 0; row < DEPTH; row++) {
+      uint32_t& counter = sketch_[row * WIDTH + slot(hash, row)];
+      counter++;
+      estimate = std::min(estimate, counter);
+    }
+    update_top(key, estimate);
+    if (++samples_ == DECAY_SAMPLES) {
+      decay();
+    }
+  }
+
+  /** \brief Returns the hottest keys.
+   *
+   * \return keys and estimated numbers of accesses, most used first.
+   */
+  std::vector<std::pair<std::string, uint64_t>> top() const {
+    std::vector<std::pair<std::string, uint64_t>> result;
+    for (const auto& entry : top_) {
+      result.emplace_back(entry.key, uint64_t(entry.count) * SAMPLE_RATE);
+    }
+    std::sort(result.begin(), result.end(), [](const auto& a, const auto& b) {
+      return a.second > b.second;
+    });
+    return result;
+  }
+
+  /// Forgets all statistics and frees the sketch
+  void clear() {
+    sketch_.reset();
+    top_.clear();
+    samples_ = 0;
+  }
+
+ private:
+  static const size_t DEPTH = 4;
+  static const size_t WIDTH = 1024;  /// power of two
+  static const size_t DECAY_SAMPLES = 1 << 16;
+
+  struct Entry {
+    std::string key;
+    uint32_t count;
+  };
+
+  std::unique_ptr<uint32_t[]> sketch_;
+  std::vector<Entry> top_;  /// min-heap by count
+  uint64_t random_ = 0x9E3779B97F4A7C15ull;  /// xorshift64 state
+  size_t samples_ = 0;
+
+  /// Counter of a hash in a row, rows use different bits of the hash
+  static size_t slot(uint64_t hash, size_t row) {
+    return size_t(hash >> (row * 16)) & (WIDTH - 1);
+  }
+
+  static bool greater(const Entry& a, const Entry& b) {
+    return a.count > b.count;
+  }
+
+  void update_top(std::string_view key, uint32_t estimate) {
+    auto it = std::find_if(top_.begin(), top_.end(),
+                           [key](const Entry& e) { return e.key == key; });
+    if (it != top_.end()) {
+      it->count = estimate;
+      std::make_heap(top_.begin(), top_.end(), greater);
+    } else if (top_.size() < TOP_K) {
+      top_.push_back({std::string(key), estimate});
+      std::push_heap(top_.begin(), top_.end(), greater);
+    } else if (estimate > top_.front().count) {
+      std::pop_heap(top_.begin(), top_.end(), greater);
+      top_.back() = {std::string(key), estimate};
+      std::push_heap(top_.begin(), top_.end(), greater);
+    }
+  }
+
+  void decay() {
+    samples_ = 0;
+    for (size_t i = 0; i < DEPTH * WIDTH; i++) {
+      sketch_[i] >>= 1;
+    }
+    for (auto& entry : top_) {
+      entry.count >>= 1;
+    }
+  }
+};
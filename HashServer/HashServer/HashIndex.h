@@ -0,0 +1,324 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+#include "HashKeys.h"
+
+/// Order of keys in an ordered index: numbers
+inline bool key_less(const uint64_t& a, const uint64_t& b) { return a < b; }
+
+/// Order of keys in an ordered index: bytes, lexicographically
+inline bool key_less(const SmallKey& a, const SmallKey& b) {
+  return a.view() < b.view();
+}
+
+/**
+ * \class OrderedIndex
+ *
+ *
+ * \brief B+tree of keys of a HashMap for ordered and range scans.
+ *
+ * Nodes hold up to CAPACITY keys in arrays, so a lookup reads a few
+ * contiguous nodes instead of a pointer per key. Leaves are linked, a range
+ * scan finds the first leaf and walks the chain. Inner node keys separate
+ * children: keys of children[i] are less than keys[i], keys of
+ * children[i + 1] are not. A node that drops below MIN_KEYS borrows a key
+ * from a sibling or is merged with it, so the tree stays balanced.
+ *
+ * Only keys are stored, values stay in the HashMap.
+ */
+template <typename Key>
+class OrderedIndex {
+ public:
+  OrderedIndex() : root_(new Leaf()) { memory_ = sizeof(Leaf); }
+  ~OrderedIndex() { destroy(root_); }
+  OrderedIndex(const OrderedIndex&) = delete;
+  OrderedIndex& operator=(const OrderedIndex&) = delete;
+
+  /// Adds a key, does nothing if it is already there
+  void insert(const Key& key) {
+    auto split = insert(root_, key);
+    if (split) {  // the tree grows from the root
+      Inner* root = new Inner();
+      memory_ += sizeof(Inner);
+      root->size = 1;
+      root->keys[0] = std::move(split->first);
+      root->children[0] = root_;
+      root->children[1] = split->second;
+      root_ = root;
+    }
+  }
+
+  /// Removes a key, does nothing if it is not there
+  void erase(const Key& key) {
+    if (!erase(root_, key)) {
+      return;
+    }
+    if (!root_->leaf && root_->size == 0) {  // the tree shrinks at the root
+      Inner* root = static_cast<Inner*>(root_);
+      root_ = root->children[0];
+      delete root;
+      memory_ -= sizeof(Inner);
+    }
+  }
+
+  /** \brief Calls a function with keys from..to in order.
+   * \param from the least key (inclusive)
+   * \param to the greatest key (inclusive)
+   * \param f function that takes a key and returns false to stop
+   */
+  template <typename F>
+  void scan(const Key& from, const Key& to, F f) const {
+    const Node* node = root_;
+    while (!node->leaf) {
+      const Inner* inner = static_cast<const Inner*>(node);
+      node = inner->children[child_index(inner, from)];
+    }
+    const Leaf* leaf = static_cast<const Leaf*>(node);
+    size_t i = std::lower_bound(leaf->keys.begin(),
+                                leaf->keys.begin() + leaf->size, from, less) -
+               leaf->keys.begin();
+    for (; leaf; leaf = leaf->next, i = 0) {
+      for (; i < leaf->size; i++) {
+        if (key_less(to, leaf->keys[i]) || !f(leaf->keys[i])) {
+          return;
+        }
+      }
+    }
+  }
+
+  /// Returns number of keys
+  size_t size() const { return size_; }
+
+  /// Returns approximate number of bytes used by the index
+  size_t memory_usage() const { return memory_; }
+
+ private:
+  static constexpr size_t CAPACITY = 64;  /// keys in a node
+  static constexpr size_t MIN_KEYS = CAPACITY / 4;
+
+  struct Node {
+    explicit Node(bool is_leaf) : leaf(is_leaf) {}
+    bool leaf;
+    uint16_t size = 0;
+    std::array<Key, CAPACITY> keys;
+  };
+
+  struct Leaf : Node {
+    Leaf() : Node(true) {}
+    Leaf* next = nullptr;
+  };
+
+  struct Inner : Node {
+    Inner() : Node(false) {}
+    std::array<Node*, CAPACITY + 1> children;
+  };
+
+  Node* root_;
+  size_t size_ = 0;
+  size_t memory_ = 0;
+
+  static bool less(const Key& a, const Key& b) { return key_less(a, b); }
+
+  /// Index of the child of an inner node that may hold a key
+  static size_t child_index(const Inner* inner, const Key& key) {
+    return std::upper_bound(inner->keys.begin(),
+                            inner->keys.begin() + inner->size, key, less) -
+           inner->keys.begin();
+  }
+
+  void destroy(Node* node) {
+    if (node->leaf) {
+      delete static_cast<Leaf*>(node);
+      return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for (size_t i = 0; i <= inner->size; i++) {
+      destroy(inner->children[i]);
+    }
+    delete inner;
+  }
+
+  /// Inserts a key under a node, returns separator and new right sibling
+  /// if the node was split
+  std::optional<std::pair<Key, Node*>> insert(Node* node, const Key& key) {
+    if (node->leaf) {
+      Leaf* leaf = static_cast<Leaf*>(node);
+      auto end = leaf->keys.begin() + leaf->size;
+      auto it = std::lower_bound(leaf->keys.begin(), end, key, less);
+      if (it != end && !key_less(key, *it)) {
+        return std::nullopt;  // already indexed
+      }
+      std::move_backward(it, end, end + 1);
+      *it = key;
+      leaf->size++;
+      size_++;
+      memory_ += key_heap_size(key);
+      if (leaf->size < CAPACITY) {
+        return std::nullopt;
+      }
+      Leaf* right = new Leaf();
+      memory_ += sizeof(Leaf);
+      size_t half = CAPACITY / 2;
+      std::move(leaf->keys.begin() + half, leaf->keys.end(),
+                right->keys.begin());
+      right->size = uint16_t(CAPACITY - half);
+      leaf->size = uint16_t(half);
+      right->next = leaf->next;
+      leaf->next = right;
+      return std::make_pair(right->keys[0], static_cast<Node*>(right));
+    }
+
+    Inner* inner = static_cast<Inner*>(node);
+    size_t i = child_index(inner, key);
+    auto split = insert(inner->children[i], key);
+    if (!split) {
+      return std::nullopt;
+    }
+    std::move_backward(inner->keys.begin() + i,
+                       inner->keys.begin() + inner->size,
+                       inner->keys.begin() + inner->size + 1);
+    std::move_backward(inner->children.begin() + i + 1,
+                       inner->children.begin() + inner->size + 1,
+                       inner->children.begin() + inner->size + 2);
+    inner->keys[i] = std::move(split->first);
+    inner->children[i + 1] = split->second;
+    inner->size++;
+    if (inner->size < CAPACITY) {
+      return std::nullopt;
+    }
+    // the middle key moves up, the right half goes to a new node
+    Inner* right = new Inner();
+    memory_ += sizeof(Inner);
+    size_t middle = CAPACITY / 2;
+    std::move(inner->keys.begin() + middle + 1, inner->keys.end(),
+              right->keys.begin());
+    std::copy(inner->children.begin() + middle + 1, inner->children.end(),
+              right->children.begin());
+    right->size = uint16_t(CAPACITY - middle - 1);
+    inner->size = uint16_t(middle);
+    return std::make_pair(std::move(inner->keys[middle]),
+                          static_cast<Node*>(right));
+  }
+
+  /// Erases a key under a node, returns false if it is not found
+  bool erase(Node* node, const Key& key) {
+    if (node->leaf) {
+      Leaf* leaf = static_cast<Leaf*>(node);
+      auto end = leaf->keys.begin() + leaf->size;
+      auto it = std::lower_bound(leaf->keys.begin(), end, key, less);
+      if (it == end || key_less(key, *it)) {
+        return false;
+      }
+      memory_ -= key_heap_size(*it);
+      std::move(it + 1, end, it);
+      leaf->size--;
+      size_--;
+      return true;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    size_t i = child_index(inner, key);
+    if (!erase(inner->children[i], key)) {
+      return false;
+    }
+    if (inner->children[i]->size < MIN_KEYS) {
+      rebalance(inner, i);
+    }
+    return true;
+  }
+
+  /// Fills an underflowed child from its sibling or merges them
+  void rebalance(Inner* parent, size_t i) {
+    if (i > 0 && parent->children[i - 1]->size > MIN_KEYS) {
+      borrow_from_left(parent, i);
+    } else if (i < parent->size && parent->children[i + 1]->size > MIN_KEYS) {
+      borrow_from_right(parent, i);
+    } else if (i > 0) {
+      merge(parent, i - 1);
+    } else if (i < parent->size) {
+      merge(parent, i);
+    }
+  }
+
+  void borrow_from_left(Inner* parent, size_t i) {
+    Node* child = parent->children[i];
+    Node* left = parent->children[i - 1];
+    std::move_backward(child->keys.begin(), child->keys.begin() + child->size,
+                       child->keys.begin() + child->size + 1);
+    if (child->leaf) {
+      child->keys[0] = std::move(left->keys[left->size - 1]);
+      parent->keys[i - 1] = child->keys[0];
+    } else {
+      Inner* inner = static_cast<Inner*>(child);
+      Inner* left_inner = static_cast<Inner*>(left);
+      std::move_backward(inner->children.begin(),
+                         inner->children.begin() + inner->size + 1,
+                         inner->children.begin() + inner->size + 2);
+      inner->keys[0] = std::move(parent->keys[i - 1]);
+      inner->children[0] = left_inner->children[left->size];
+      parent->keys[i - 1] = std::move(left->keys[left->size - 1]);
+    }
+    left->size--;
+    child->size++;
+  }
+
+  void borrow_from_right(Inner* parent, size_t i) {
+    Node* child = parent->children[i];
+    Node* right = parent->children[i + 1];
+    if (child->leaf) {
+      child->keys[child->size] = std::move(right->keys[0]);
+      std::move(right->keys.begin() + 1, right->keys.begin() + right->size,
+                right->keys.begin());
+      parent->keys[i] = right->keys[0];
+    } else {
+      Inner* inner = static_cast<Inner*>(child);
+      Inner* right_inner = static_cast<Inner*>(right);
+      inner->keys[child->size] = std::move(parent->keys[i]);
+      inner->children[child->size + 1] = right_inner->children[0];
+      parent->keys[i] = std::move(right->keys[0]);
+      std::move(right->keys.begin() + 1, right->keys.begin() + right->size,
+                right->keys.begin());
+      std::copy(right_inner->children.begin() + 1,
+                right_inner->children.begin() + right->size + 1,
+                right_inner->children.begin());
+    }
+    right->size--;
+    child->size++;
+  }
+
+  /// Merges children[i + 1] of a parent into children[i]
+  void merge(Inner* parent, size_t i) {
+    Node* left = parent->children[i];
+    Node* right = parent->children[i + 1];
+    if (left->leaf) {
+      std::move(right->keys.begin(), right->keys.begin() + right->size,
+                left->keys.begin() + left->size);
+      left->size += right->size;
+      static_cast<Leaf*>(left)->next = static_cast<Leaf*>(right)->next;
+      delete static_cast<Leaf*>(right);
+      memory_ -= sizeof(Leaf);
+    } else {
+      Inner* left_inner = static_cast<Inner*>(left);
+      Inner* right_inner = static_cast<Inner*>(right);
+      left->keys[left->size] = std::move(parent->keys[i]);
+      std::move(right->keys.begin(), right->keys.begin() + right->size,
+                left->keys.begin() + left->size + 1);
+      std::copy(right_inner->children.begin(),
+                right_inner->children.begin() + right->size + 1,
+                left_inner->children.begin() + left->size + 1);
+      left->size += right->size + 1;
+      delete right_inner;
+      memory_ -= sizeof(Inner);
+    }
+    std::move(parent->keys.begin() + i + 1,
+              parent->keys.begin() + parent->size, parent->keys.begin() + i);
+    std::copy(parent->children.begin() + i + 2,
+              parent->children.begin() + parent->size + 1,
+              parent->children.begin() + i + 1);
+    parent->size--;
+  }
+};
@@ -0,0 +1,259 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+/**
+ * \class SmallKey
+ *
+ *
+ * \brief String key that stores short strings inline.
+ *
+ * Keys up to INLINE_SIZE bytes are stored inside of the object (24 bytes),
+ * longer keys are stored on the heap. The last inline byte keeps
+ * INLINE_SIZE - size for inline keys (so it is 0 for the longest one and
+ * doubles as terminating zero) and HEAP_MARK for heap keys.
+ */
+class SmallKey {
+ public:
+  static const size_t INLINE_SIZE = 23;
+
+  /// A constructor. Creates empty key.
+  SmallKey() { set_inline(std::string_view()); }
+
+  /**
+   * A constructor.
+   * \param key contents of the key
+   */
+  SmallKey(std::string_view key) {
+    if (key.size() <= INLINE_SIZE) {
+      set_inline(key);
+    } else {
+      set_heap(key);
+    }
+  }
+
+  SmallKey(const std::string& key) : SmallKey(std::string_view(key)) {}
+
+  SmallKey(const char* key) : SmallKey(std::string_view(key)) {}
+
+  SmallKey(const SmallKey& other) : SmallKey(other.view()) {}
+
+  SmallKey(SmallKey&& other) noexcept {
+    std::memcpy(inline_, other.inline_, sizeof(inline_));
+    other.set_inline(std::string_view());
+  }
+
+  SmallKey& operator=(SmallKey other) noexcept {
+    std::swap(inline_, other.inline_);
+    return *this;
+  }
+
+  /// A destructor. Frees heap part of a long key.
+  ~SmallKey() {
+    if (is_heap()) {
+      delete[] heap_.data;
+    }
+  }
+
+  /// Returns contents of the key
+  std::string_view view() const {
+    if (is_heap()) {
+      return std::string_view(heap_.data, heap_.size);
+    }
+    return std::string_view(inline_, INLINE_SIZE - inline_[INLINE_SIZE]);
+  }
+
+  /// Returns number of bytes allocated on the heap
+  size_t heap_size() const { return is_heap() ? heap_.size : 0; }
+
+  bool operator==(const SmallKey& other) const {
+    return view() == other.view();
+  }
+
+  bool operator!=(const SmallKey& other) const { return !(*this == other); }
+
+ private:
+  static const char HEAP_MARK = char(0xFF);
+
+  union {
+    char inline_[INLINE_SIZE + 1];
+    struct {
+      char* data;
+      size_t size;
+    } heap_;
+  };
+
+  bool is_heap() const { return inline_[INLINE_SIZE] == HEAP_MARK; }
+
+  void set_inline(std::string_view key) {
+    if (!key.empty()) {
+      std::memcpy(inline_, key.data(), key.size());
+    }
+    inline_[INLINE_SIZE] = char(INLINE_SIZE - key.size());
+  }
+
+  void set_heap(std::string_view key) {
+    heap_.data = new char[key.size()];
+    heap_.size = key.size();
+    std::memcpy(heap_.data, key.data(), key.size());
+    inline_[INLINE_SIZE] = HEAP_MARK;
+  }
+};
+
+/// Converts a key to the string to output it
+inline std::string key_to_string(uint64_t key) { return std::to_string(key); }
+
+/// Converts a key to the string to output it
+inline std::string key_to_string(const SmallKey& key) {
+  return std::string(key.view());
+}
+
+/// Restores a key from bytes returned by key_bytes, false if they do not fit
+inline bool key_from_bytes(std::string_view bytes, uint64_t& key) {
+  if (bytes.size() != sizeof(key)) {
+    return false;
+  }
+  std::memcpy(&key, bytes.data(), sizeof(key));
+  return true;
+}
+
+/// Restores a key from bytes returned by key_bytes, false if they do not fit
+inline bool key_from_bytes(std::string_view bytes, SmallKey& key) {
+  key = SmallKey(bytes);
+  return true;
+}
+
+/// Returns number of bytes that a key allocates on the heap
+inline size_t key_heap_size(uint64_t) { return 0; }
+
+/// Returns number of bytes that a key allocates on the heap
+inline size_t key_heap_size(const SmallKey& key) { return key.heap_size(); }
+
+/**
+ * Functions of wyhash (public domain, https://github.com/wangyi-fudan/wyhash):
+ * a fast hash function of a good quality based on 64x64->128 bit
+ * multiplication.
+ */
+namespace wyhash {
+static const uint64_t SECRET[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull,
+    0x4d5a2da51de1aa47ull};
+
+/// Multiplies A and B, stores low 64 bits into A and high 64 bits into B
+inline void mum(uint64_t* A, uint64_t* B) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = *A;
+  r *= *B;
+  *A = uint64_t(r);
+  *B = uint64_t(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  *A = _umul128(*A, *B, B);
+#else
+  uint64_t ha = *A >> 32, hb = *B >> 32, la = uint32_t(*A), lb = uint32_t(*B);
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  *A = lo;
+  *B = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+/// Multiplies A and B and folds the 128 bit result
+inline uint64_t mix(uint64_t A, uint64_t B) {
+  mum(&A, &B);
+  return A ^ B;
+}
+
+inline uint64_t read8(const uint8_t* p) {
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+
+inline uint64_t read4(const uint8_t* p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint64_t read3(const uint8_t* p, size_t k) {
+  return (uint64_t(p[0]) << 16) | (uint64_t(p[k >> 1]) << 8) | p[k - 1];
+}
+
+/// Hashes len bytes starting from key
+inline uint64_t hash(const void* key, size_t len, uint64_t seed = 0) {
+  const uint8_t* p = static_cast<const uint8_t*>(key);
+  seed ^= mix(seed ^ SECRET[0], SECRET[1]);
+  uint64_t a, b;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+      b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = read3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+        see1 = mix(read8(p + 16) ^ SECRET[2], read8(p + 24) ^ see1);
+        see2 = mix(read8(p + 32) ^ SECRET[3], read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = mix(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = read8(p + i - 16);
+    b = read8(p + i - 8);
+  }
+  a ^= SECRET[1];
+  b ^= seed;
+  mum(&a, &b);
+  return mix(a ^ SECRET[0] ^ len, b ^ SECRET[1]);
+}
+}  // namespace wyhash
+
+/**
+ * \struct DefaultHash
+ *
+ * \brief Default hash policy of HashMap for a key type.
+ *
+ * Hash policy is a function object that maps a key to 64 bit hash value.
+ */
+template <typename Key>
+struct DefaultHash;
+
+/// 64 bit keys are mixed with wyhash multiplication
+template <>
+struct DefaultHash<uint64_t> {
+  uint64_t operator()(uint64_t key) const {
+    return wyhash::mix(key ^ wyhash::SECRET[0], wyhash::SECRET[1]);
+  }
+};
+
+/// String keys are hashed with wyhash
+template <>
+struct DefaultHash<SmallKey> {
+  uint64_t operator()(const SmallKey& key) const {
+    std::string_view view = key.view();
+    return wyhash::hash(view.data(), view.size());
+  }
+};
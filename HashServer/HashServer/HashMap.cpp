@@ -1,47 +1,618 @@
 #include "HashMap.h"
 
-void HashMap::put(int key, std::string value, size_t ttl) {
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::put(const Key& key, std::string value,
+                                   size_t ttl) {
+  return store(find(key), key, encode(value), time(NULL) + ttl);
+}
+
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::put_until(const Key& key, std::string value,
+                                         time_t expires) {
+  return store(find(key), key, encode(value), expires);
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<std::string> HashMap<Key, Hash, Bins>::get(const Key& key) {
+  Record* record = find(key);
+  if (record == nullptr) {
+    return std::nullopt;
+  }
+  touch(*record);
+  return record->value.str();
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<std::pair<std::string, uint64_t>>
+HashMap<Key, Hash, Bins>::get_with_version(const Key& key) {
+  Record* record = find(key);
+  if (record == nullptr) {
+    return std::nullopt;
+  }
+  touch(*record);
+  return std::make_pair(record->value.str(), record->version);
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<std::pair<std::string, time_t>> HashMap<Key, Hash, Bins>::peek(
+    const Key& key) {
+  Record* record = find(key);
+  if (record == nullptr) {
+    return std::nullopt;
+  }
+  return std::make_pair(record->value.str(), record->expires);
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::vector<std::optional<std::string>> HashMap<Key, Hash, Bins>::get_many(
+    const std::vector<Key>& keys) {
+  std::vector<uint64_t> hashes(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    hashes[i] = Hash()(keys[i]);
+    size_t idx = bins_(hashes[i]);
+    prefetch(&tags_[idx]);
+    prefetch(&a[idx]);
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    size_t idx = bins_(hashes[i]);
+    if (match_tags(tags_[idx], tag_of(hashes[i])) != 0) {
+      prefetch(&a[idx].front());
+    }
+  }
+  std::vector<std::optional<std::string>> values(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    Record* record = find(keys[i], hashes[i]);
+    if (record != nullptr) {
+      touch(*record);
+      values[i] = record->value.str();
+    }
+  }
+  return values;
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<int64_t> HashMap<Key, Hash, Bins>::incr(const Key& key,
+                                                      int64_t delta,
+                                                      size_t ttl) {
+  Record* record = find(key);
+  int64_t value = 0;
   time_t expires = time(NULL) + ttl;
+  if (record != nullptr) {
+    if (auto integer = record->value.integer()) {
+      value = *integer;
+    } else {  // not canonical integers like "007" are parsed
+      std::string text = record->value.str();
+      size_t parsed = 0;
+      try {
+        value = std::stoll(text, &parsed);
+      } catch (std::exception&) {
+        return std::nullopt;
+      }
+      if (parsed != text.size()) {
+        return std::nullopt;
+      }
+    }
+    expires = record->expires;
+  }
+  if ((delta > 0 && value > INT64_MAX - delta) ||
+      (delta < 0 && value < INT64_MIN - delta)) {
+    return std::nullopt;
+  }
+  value += delta;
+  if (!store(record, key, CompactValue(value), expires)) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::put_if_absent(const Key& key,
+                                             std::string value, size_t ttl) {
+  Record* record = find(key);
+  if (record != nullptr) {
+    return false;
+  }
+  return store(nullptr, key, encode(value), time(NULL) + ttl);
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<std::string> HashMap<Key, Hash, Bins>::get_and_put(
+    const Key& key, std::string value, size_t ttl, bool& stored) {
+  Record* record = find(key);
+  std::optional<std::string> previous;
+  if (record != nullptr) {
+    previous = record->value.str();
+  }
+  stored = store(record, key, encode(value), time(NULL) + ttl);
+  return previous;
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<uint64_t> HashMap<Key, Hash, Bins>::compare_and_put(
+    const Key& key, std::string value, size_t ttl, uint64_t version) {
+  Record* record = find(key);
+  if (record == nullptr || record->version != version) {
+    return std::nullopt;
+  }
+  if (!store(record, key, encode(value), time(NULL) + ttl)) {
+    return std::nullopt;
+  }
+  return versions_;
+}
+
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::expire(const Key& key, size_t ttl) {
+  Record* record = find(key);
+  if (record == nullptr) {
+    return false;
+  }
+  record->expires = time(NULL) + ttl;
+  touch(*record);
+  return true;
+}
+
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::persist(const Key& key) {
+  Record* record = find(key);
+  if (record == nullptr) {
+    return false;
+  }
+  record->expires = NEVER;
+  touch(*record);
+  return true;
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<int64_t> HashMap<Key, Hash, Bins>::ttl(const Key& key) {
+  Record* record = find(key);
+  if (record == nullptr) {
+    return std::nullopt;
+  }
+  if (record->expires == NEVER) {
+    return -1;
+  }
+  return int64_t(record->expires - time(NULL));
+}
 
-  if (get(key) == std::nullopt) {
-    a[h(key)].push_back({key, value, expires}); // add new 
-  } else {
-    for (auto& iter : a[h(key)]) {
-      if (iter.key == key) { // change old value into the new one
-        iter.value = value;
-        iter.expires = expires;
-        break;
+template <typename Key, typename Hash, typename Bins>
+typename HashMap<Key, Hash, Bins>::Record* HashMap<Key, Hash, Bins>::find(
+    const Key& key, uint64_t hash) {
+  size_t idx = bins_(hash);
+  uint64_t matches = match_tags(tags_[idx], tag_of(hash));
+  auto& bucket = a[idx];
+  if (matches == 0 && bucket.size() <= TAG_SLOTS) {
+    return nullptr;
+  }
+  size_t slot = 0;
+  for (auto iter = bucket.begin(); iter != bucket.end(); iter++, slot++) {
+    if (slot < TAG_SLOTS && !((matches >> (8 * slot + 7)) & 1)) {
+      continue;  // tags differ, so keys differ too
+    }
+    if (iter->key == key) {
+      if (expired(iter->expires)) {
+        if (index_) {
+          index_->erase(iter->key);
+        }
+        records_--;
+        memory_ -= record_size(*iter);
+        bucket.erase(iter);
+        retag(idx);
+        return nullptr;
       }
+      return &*iter;
     }
   }
+  return nullptr;
 }
 
-std::optional<std::string> HashMap::get(int key) {
-  for (const auto& iter : a[h(key)]) {
-    if (iter.key == key && !expired(iter.expires)) {
-      return iter.value;
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::store(Record* record, const Key& key,
+                                     CompactValue value, time_t expires) {
+  if (record != nullptr) {  // change old value into the new one
+    memory_ -= record_size(*record);
+    record->value = std::move(value);
+    record->expires = expires;
+    record->version = ++versions_;
+    memory_ += record_size(*record);
+  } else {  // add new
+    uint64_t hash = Hash()(key);
+    size_t idx = bins_(hash);
+    a[idx].push_back({key, std::move(value), expires, ++versions_, 0,
+                      LFU_INIT, tag_of(hash)});
+    record = &a[idx].back();
+    retag(idx);
+    if (index_) {
+      index_->insert(key);
     }
+    records_++;
+    memory_ += record_size(*record);
   }
-  return std::nullopt;
+  touch(*record);
+
+  while (over_limits()) {
+    if (!evict(&key)) {  // only this record is left, it does not fit
+      remove(key);
+      return false;
+    }
+  }
+  return true;
 }
 
-void HashMap::remove(int key) {
-  for (auto it = a[h(key)].begin(); it != a[h(key)].end(); it++) {
+template <typename Key, typename Hash, typename Bins>
+void HashMap<Key, Hash, Bins>::remove(const Key& key) {
+  size_t idx = h(key);
+  for (auto it = a[idx].begin(); it != a[idx].end(); it++) {
     if ((*it).key == key) {
-      a[h(key)].erase(it);
+      if (index_) {
+        index_->erase(key);
+      }
+      records_--;
+      memory_ -= record_size(*it);
+      a[idx].erase(it);
+      retag(idx);
       break;
     }
   }
 }
 
-std::string HashMap::get_table() {
+template <typename Key, typename Hash, typename Bins>
+std::string HashMap<Key, Hash, Bins>::get_table() {
   std::string result;
   for (const auto& iter_v : a) {
     for (const auto& iter_l : iter_v) {
       if (!expired(iter_l.expires)) {
-        result += std::to_string(iter_l.key) + ":" + iter_l.value + "\n";
+        result +=
+            key_to_string(iter_l.key) + ":" + iter_l.value.str() + "\n";
       }
     }
   }
   return result.substr(0, result.size() - 1);  // remove \n last character
-}
\ No newline at end of file
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::vector<std::pair<std::string, time_t>>
+HashMap<Key, Hash, Bins>::expiring_keys() {
+  std::vector<std::pair<std::string, time_t>> result;
+  for (const auto& bucket : a) {
+    for (const auto& record : bucket) {
+      if (record.expires != NEVER && !expired(record.expires)) {
+        result.emplace_back(key_bytes(record.key), record.expires);
+      }
+    }
+  }
+  return result;
+}
+
+template <typename Key, typename Hash, typename Bins>
+void HashMap<Key, Hash, Bins>::enable_index() {
+  if (index_) {
+    return;
+  }
+  index_ = std::make_unique<OrderedIndex<Key>>();
+  for (const auto& bucket : a) {
+    for (const auto& record : bucket) {
+      index_->insert(record.key);
+    }
+  }
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::vector<std::pair<std::string, std::string>>
+HashMap<Key, Hash, Bins>::range(const Key& from, const Key& to,
+                                size_t limit) {
+  std::vector<std::pair<std::string, std::string>> result;
+  if (!index_) {
+    return result;
+  }
+  // keys are copied out first: find removes expired records from the index
+  std::vector<Key> keys;
+  Key start = from;
+  bool first = true;
+  while (result.size() < limit) {
+    keys.clear();
+    size_t wanted = limit - result.size();
+    index_->scan(start, to, [&](const Key& key) {
+      if (!first && !key_less(start, key)) {
+        return true;  // start was read by the previous pass
+      }
+      keys.push_back(key);
+      return keys.size() < wanted;
+    });
+    if (keys.empty()) {
+      break;
+    }
+    for (const Key& key : keys) {
+      Record* record = find(key);
+      if (record != nullptr) {
+        touch(*record);
+        result.emplace_back(key_to_string(key), record->value.str());
+      }
+    }
+    start = keys.back();
+    first = false;
+  }
+  return result;
+}
+
+/// Writes a number of a dump in little-endian byte order
+template <typename T>
+static void write_le(std::ostream& out, T value) {
+  char bytes[sizeof(T)];
+  for (size_t i = 0; i < sizeof(T); i++) {
+    bytes[i] = char(uint64_t(value) >> (8 * i));
+  }
+  out.write(bytes, sizeof(T));
+}
+
+/// Reads a number of a dump in little-endian byte order
+template <typename T>
+static bool read_le(std::istream& in, T& value) {
+  unsigned char bytes[sizeof(T)];
+  if (!in.read(reinterpret_cast<char*>(bytes), sizeof(T))) {
+    return false;
+  }
+  uint64_t number = 0;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    number |= uint64_t(bytes[i]) << (8 * i);
+  }
+  value = T(number);
+  return true;
+}
+
+template <typename Key, typename Hash, typename Bins>
+size_t HashMap<Key, Hash, Bins>::dump(std::ostream& out) {
+  size_t count = alive_records();
+  write_dump_header(out, count);
+  dump_records(out);
+  return count;
+}
+
+template <typename Key, typename Hash, typename Bins>
+size_t HashMap<Key, Hash, Bins>::alive_records() {
+  size_t count = 0;
+  for (const auto& bucket : a) {
+    for (const auto& record : bucket) {
+      count += !expired(record.expires);
+    }
+  }
+  return count;
+}
+
+template <typename Key, typename Hash, typename Bins>
+void HashMap<Key, Hash, Bins>::write_dump_header(std::ostream& out,
+                                                 uint64_t records) {
+  out.write(DUMP_MAGIC, sizeof(DUMP_MAGIC));
+  write_le(out, DUMP_VERSION);
+  write_le(out, records);
+}
+
+template <typename Key, typename Hash, typename Bins>
+size_t HashMap<Key, Hash, Bins>::dump_records(std::ostream& out) {
+  size_t count = 0;
+  for (const auto& bucket : a) {
+    for (const auto& record : bucket) {
+      if (expired(record.expires)) {
+        continue;
+      }
+      std::string_view key = key_bytes(record.key);
+      std::string value = record.value.str();
+      write_le(out, uint32_t(key.size()));
+      out.write(key.data(), std::streamsize(key.size()));
+      write_le(out, int64_t(record.expires));
+      write_le(out, uint32_t(value.size()));
+      out.write(value.data(), std::streamsize(value.size()));
+      count++;
+    }
+  }
+  return count;
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<size_t> HashMap<Key, Hash, Bins>::load(std::istream& in) {
+  std::optional<uint64_t> records = read_dump_header(in);
+  if (!records) {
+    return std::nullopt;
+  }
+  reserve(records_ + *records);
+
+  Key key;
+  std::string value;
+  time_t expires;
+  time_t now = time(NULL);
+  for (uint64_t i = 0; i < *records; i++) {
+    if (!read_dump_record(in, key, value, expires)) {
+      return std::nullopt;
+    }
+    if (expires >= now) {
+      put_until(key, value, expires);
+    }
+  }
+  return size_t(*records);
+}
+
+template <typename Key, typename Hash, typename Bins>
+std::optional<uint64_t> HashMap<Key, Hash, Bins>::read_dump_header(
+    std::istream& in) {
+  char magic[sizeof(DUMP_MAGIC)];
+  uint32_t version;
+  uint64_t records;
+  if (!in.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), DUMP_MAGIC) ||
+      !read_le(in, version) || version != DUMP_VERSION ||
+      !read_le(in, records)) {
+    return std::nullopt;
+  }
+  return records;
+}
+
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::read_dump_record(std::istream& in, Key& key,
+                                                std::string& value,
+                                                time_t& expires) {
+  std::string bytes;
+  uint32_t key_size, value_size;
+  int64_t until;
+  if (!read_le(in, key_size)) {
+    return false;
+  }
+  bytes.resize(key_size);
+  if (!in.read(bytes.data(), key_size) || !read_le(in, until) ||
+      !read_le(in, value_size)) {
+    return false;
+  }
+  value.resize(value_size);
+  if (!in.read(value.data(), value_size) || !key_from_bytes(bytes, key)) {
+    return false;
+  }
+  expires = time_t(until);
+  return true;
+}
+
+template <typename Key, typename Hash, typename Bins>
+void HashMap<Key, Hash, Bins>::reserve(size_t records) {
+  if (max_records_) {
+    records = std::min(records, max_records_);
+  }
+  if (max_memory_) {  // buckets take at most a half of the memory limit
+    records = std::min(records, max_memory_ / 2 / BUCKET_SIZE);
+  }
+  size_t buckets = Bins::round(records);
+  if (buckets <= a.size()) {
+    return;
+  }
+  Buckets old(buckets);
+  old.swap(a);
+  tags_.assign(a.size(), 0);
+  bins_.set_size(a.size());
+  for (auto& bucket : old) {
+    while (!bucket.empty()) {  // splice moves list nodes, records stay
+      size_t idx = h(bucket.front().key);
+      a[idx].splice(a[idx].end(), bucket, bucket.begin());
+    }
+  }
+  for (size_t idx = 0; idx < a.size(); idx++) {
+    retag(idx);
+  }
+  memory_ += (a.size() - old.size()) * BUCKET_SIZE;
+}
+
+template <typename Key, typename Hash, typename Bins>
+size_t HashMap<Key, Hash, Bins>::move_records(
+    HashMap& target, const std::function<bool(const Key&)>& moves) {
+  size_t moved = 0;
+  for (size_t idx = 0; idx < a.size(); idx++) {
+    auto& bucket = a[idx];
+    bool changed = false;
+    for (auto it = bucket.begin(); it != bucket.end();) {
+      auto next = std::next(it);
+      if (moves(it->key)) {  // splice moves the list node, record stays
+        size_t size = record_size(*it);
+        if (index_) {
+          index_->erase(it->key);
+        }
+        if (target.index_) {
+          target.index_->insert(it->key);
+        }
+        size_t to = target.h(it->key);
+        target.a[to].splice(target.a[to].end(), bucket, it);
+        target.retag(to);
+        records_--;
+        memory_ -= size;
+        target.records_++;
+        target.memory_ += size;
+        changed = true;
+        moved++;
+      }
+      it = next;
+    }
+    if (changed) {
+      retag(idx);
+    }
+  }
+  // versions stay unique and access times comparable in the target
+  target.versions_ = std::max(target.versions_, versions_);
+  target.clock_ = std::max(target.clock_, clock_);
+  return moved;
+}
+
+template <typename Key, typename Hash, typename Bins>
+bool HashMap<Key, Hash, Bins>::evict(const Key* keep) {
+  if (records_ == 0) {
+    return false;
+  }
+  std::list<Record>* victim_bucket = nullptr;
+  size_t victim_idx = 0;
+  typename std::list<Record>::iterator victim;
+  uint64_t victim_score = 0;
+
+  // walks from a random bucket to the next non-empty ones, so the cost of
+  // sampling is proportional to buckets per record, not to the table size
+  size_t idx = random_() % a.size();
+  size_t sampled = 0;
+  for (size_t visited = 0; visited < a.size() && sampled < EVICTION_SAMPLES;
+       visited++, idx = (idx + 1) % a.size()) {
+    for (auto it = a[idx].begin(); it != a[idx].end(); it++) {
+      if (keep && it->key == *keep) {
+        continue;
+      }
+      uint64_t score = eviction_score(*it);
+      if (victim_bucket == nullptr || score > victim_score) {
+        victim_bucket = &a[idx];
+        victim_idx = idx;
+        victim = it;
+        victim_score = score;
+      }
+      sampled++;
+    }
+  }
+  if (victim_bucket == nullptr) {
+    return false;
+  }
+  if (on_evict_) {
+    on_evict_(victim->key);
+  }
+  if (index_) {
+    index_->erase(victim->key);
+  }
+  records_--;
+  memory_ -= record_size(*victim);
+  victim_bucket->erase(victim);
+  retag(victim_idx);
+  return true;
+}
+
+template <typename Key, typename Hash, typename Bins>
+void HashMap<Key, Hash, Bins>::touch(Record& record) {
+  record.last_access = ++clock_;
+  if (record.hits < UINT8_MAX) {
+    // hits grows logarithmically: probability is 1 / ((hits - init) * 10 + 1)
+    uint32_t base = record.hits > LFU_INIT ? record.hits - LFU_INIT : 0;
+    if (random_() % (base * 10 + 1) == 0) {
+      record.hits++;
+    }
+  }
+}
+
+template <typename Key, typename Hash, typename Bins>
+uint64_t HashMap<Key, Hash, Bins>::eviction_score(const Record& record) {
+  if (expired(record.expires)) {
+    return UINT64_MAX;
+  }
+  uint32_t idle = clock_ - record.last_access;
+  switch (policy_) {
+    case EvictionPolicy::LFU: {
+      // hits are halved for every LFU_DECAY accesses to other records
+      uint32_t halvings = idle / LFU_DECAY;
+      uint32_t hits = halvings < 8 ? record.hits >> halvings : 0;
+      return (uint64_t(UINT8_MAX - hits) << 32) | idle;
+    }
+    case EvictionPolicy::TTL:
+      return UINT64_MAX - 1 - uint64_t(record.expires);
+    case EvictionPolicy::LRU:
+    default:
+      return idle;
+  }
+}
+
+template class HashMap<uint64_t>;
+template class HashMap<SmallKey>;
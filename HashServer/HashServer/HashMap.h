@@ -1,12 +1,34 @@
 #pragma once
+#include <algorithm>
+#include <cstdint>
 #include <ctime>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <list>
+#include <memory>
 #include <optional>
+#include <random>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "HashIndex.h"
+#include "HashKeys.h"
+#include "HashMemory.h"
+#include "HashPolicies.h"
+#include "HashValues.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+/// Eviction policy that is used when a table runs out of its budget
+enum class EvictionPolicy {
+  LRU,  ///< evicts least recently used record (approximated by sampling)
+  LFU,  ///< evicts least frequently used record (approximated by sampling)
+  TTL   ///< evicts record which is the nearest to expiration
+};
 
 /**
  * \class HashMap
@@ -16,6 +38,22 @@
  *
  * HashMap class has hash function that maps key values to bins (positions in vector).
  * Each element of the vector if a linked list, and elements are pushed back it the list.
+ * HashMap can be bounded by a number of records and by memory. When a bound is
+ * exceeded, records are evicted according to EvictionPolicy.
+ *
+ * HashMap is a template over key type, hash policy (a function object that
+ * maps a key to 64 bit hash) and bin policy (reduces the hash to a bucket),
+ * see HashPolicies.h. Instantiations for uint64_t keys and for short string
+ * keys (SmallKey) with default policies are compiled in HashMap.cpp.
+ *
+ * Next to every bucket a tag word is kept: byte i of it is a tag (8 bits of
+ * the hash) of i-th record of the chain. A lookup compares all tags of a
+ * bucket at once and compares keys only of the records whose tags match, so
+ * a miss usually does not touch the chain at all.
+ *
+ * Optionally HashMap keeps an ordered index of its keys (OrderedIndex, a
+ * B+tree) for range scans. It is updated when a record is added or removed
+ * (also by eviction and by removal of an expired record).
  *
  * \author $Author: Liliya Makhmutova $
  *
@@ -23,12 +61,19 @@
  *
  * \date $Date: 2021/01/16 00:00:00 $
  */
+template <typename Key, typename Hash = DefaultHash<Key>,
+          typename Bins = PowerOfTwoBins>
 class HashMap {
   /**
    * \struct Record
    *
    * \brief Each record constists of a key, value and expiration time.
    *
+   * Eviction bookkeeping is stored inline: last_access is a value of the
+   * access clock of the HashMap, hits is a logarithmic access counter.
+   * version is changed on every write of the record (used by cas).
+   * value is stored as CompactValue (inline, integer or compressed).
+   *
    * \author $Author: Liliya Makhmutova $
    *
    * \version $Revision: 1.0 $
@@ -36,41 +81,212 @@ class HashMap {
    * \date $Date: 2021/01/16 00:00:00 $
    */
   struct Record {
-    int key;
-    std::string value;
+    Key key;
+    CompactValue value;
     time_t expires;
+    uint64_t version;
+    uint32_t last_access;
+    uint8_t hits;
+    uint8_t tag;
   };
 
  public:
+  /// Initial number of buckets
+  static constexpr size_t BASIC_SIZE = 1 << 16;
+
   /**
    * A constructor.
    * Resizes the vector to some constant basic size BASIC_SIZE.
    */
-  HashMap() { a.resize(BASIC_SIZE); }
+  HashMap() { resize_buckets(); }
+
+  /**
+   * A constructor.
+   * Resizes the vector to buckets and sets limits of the HashMap.
+   * \param max_records max number of records (0 means unlimited)
+   * \param max_memory max memory in bytes (0 means unlimited)
+   * \param policy eviction policy
+   * \param compress_threshold min size of a value to compress (0 means never)
+   * \param buckets initial number of buckets (rounded by bin policy)
+   */
+  HashMap(size_t max_records, size_t max_memory, EvictionPolicy policy,
+          size_t compress_threshold = 0, size_t buckets = BASIC_SIZE)
+      : max_records_(max_records),
+        max_memory_(max_memory),
+        policy_(policy),
+        compress_threshold_(compress_threshold) {
+    resize_buckets(buckets);
+  }
+
+  /** \brief Changes limits of the HashMap.
+   * \param max_records max number of records (0 means unlimited)
+   * \param max_memory max memory in bytes (0 means unlimited)
+   *
+   * Records are not evicted until the next write.
+   */
+  void set_limits(size_t max_records, size_t max_memory) {
+    max_records_ = max_records;
+    max_memory_ = max_memory;
+  }
 
   /** \brief Puts value by key with ttl to HashMap.
    * \param key to identify a record.
    * \param value to store value
    * \param ttl to store expiration time
    *
-   * This method checks whether such key exists. 
-   * If yes, it looks for it in a[h(key)] list and modifies its value.
-   * Otherwise adds to a[h(key)] list new record.
+   * This method looks for the key in a[h(key)] list.
+   * If found, it modifies its value. Otherwise adds to a[h(key)] list new record.
+   * After that records are evicted while limits of the HashMap are exceeded.
    *
+   * \return false if the record itself does not fit into the limits
+   * (then it is not stored).
    */
-  void put(int key, std::string value, size_t ttl);
+  bool put(const Key& key, std::string value, size_t ttl);
+
+  /** \brief Puts value by key with absolute expiration time to HashMap.
+   * \param key to identify a record.
+   * \param value to store value
+   * \param expires expiration time (NEVER for persistent record)
+   *
+   * Works as put, used to apply records copied from another HashMap.
+   *
+   * \return false if the record does not fit into the limits.
+   */
+  bool put_until(const Key& key, std::string value, time_t expires);
 
   /** \brief Gets value by key from HashMap.
    * \param key to identify a record.
    *
    * This method checks whether such key exists.
    * If yes, it checks that it is not expired and returns its value.
-   * Otherwise it returns nullopt.
+   * Otherwise it returns nullopt. Expired record is removed.
    *
    * \return optional<string> object that is not nullopt 
    * when record exists and valid.
    */
-  std::optional<std::string> get(int key);
+  std::optional<std::string> get(const Key& key);
+
+  /** \brief Gets value and its version by key from HashMap.
+   * \param key to identify a record.
+   *
+   * \return value and version, nullopt when record does not exist or expired.
+   */
+  std::optional<std::pair<std::string, uint64_t>> get_with_version(
+      const Key& key);
+
+  /** \brief Passes value by key to a function without copying it.
+   * \param key to identify a record.
+   * \param f function that takes std::string_view, the view is valid only
+   * during the call
+   *
+   * Works as get, see CompactValue::view.
+   *
+   * \return false when record does not exist or expired.
+   */
+  template <typename F>
+  bool read(const Key& key, F f) {
+    Record* record = find(key);
+    if (record == nullptr) {
+      return false;
+    }
+    touch(*record);
+    record->value.view(f);
+    return true;
+  }
+
+  /** \brief Gets value and expiration time by key without touching it.
+   * \param key to identify a record.
+   *
+   * Unlike get it does not change LRU and LFU data of the record.
+   *
+   * \return value and expiration time, nullopt when record does not exist
+   * or expired.
+   */
+  std::optional<std::pair<std::string, time_t>> peek(const Key& key);
+
+  /** \brief Gets values of a batch of keys from HashMap.
+   * \param keys to identify records.
+   *
+   * Works as get for every key, but in stages over the whole batch: hashes
+   * all keys and prefetches their buckets, then prefetches heads of the
+   * chains whose tags match, then looks the keys up. So cache misses of
+   * different keys overlap instead of being paid one after another.
+   *
+   * \return values in the order of keys, nullopt for absent or expired ones.
+   */
+  std::vector<std::optional<std::string>> get_many(
+      const std::vector<Key>& keys);
+
+  /** \brief Adds delta to integer value by key.
+   * \param key to identify a record.
+   * \param delta value to add (negative to decrement)
+   * \param ttl expiration time of a new record
+   *
+   * Absent record is created with value delta and ttl, ttl of existing one is
+   * not changed.
+   *
+   * \return new value, nullopt if the value is not an integer, overflows or
+   * does not fit into the limits.
+   */
+  std::optional<int64_t> incr(const Key& key, int64_t delta, size_t ttl);
+
+  /** \brief Puts value by key only if the key is absent.
+   * \param key to identify a record.
+   * \param value to store value
+   * \param ttl to store expiration time
+   *
+   * \return true if the value is stored.
+   */
+  bool put_if_absent(const Key& key, std::string value, size_t ttl);
+
+  /** \brief Puts value by key and returns the previous one.
+   * \param key to identify a record.
+   * \param value to store value
+   * \param ttl to store expiration time
+   * \param[out] stored false if the value does not fit into the limits
+   *
+   * \return previous value, nullopt if there was no one.
+   */
+  std::optional<std::string> get_and_put(const Key& key, std::string value,
+                                         size_t ttl, bool& stored);
+
+  /** \brief Puts value by key if its version is equal to the expected one.
+   * \param key to identify a record.
+   * \param value to store value
+   * \param ttl to store expiration time
+   * \param version expected version of the record
+   *
+   * \return new version, nullopt if the record is absent, has other version
+   * or the value does not fit into the limits.
+   */
+  std::optional<uint64_t> compare_and_put(const Key& key, std::string value,
+                                          size_t ttl, uint64_t version);
+
+  /** \brief Changes expiration time of a record without changing its value.
+   * \param key to identify a record.
+   * \param ttl new time to live in seconds
+   *
+   * \return false if the record does not exist or expired.
+   */
+  bool expire(const Key& key, size_t ttl);
+
+  /** \brief Makes a record persistent (it never expires).
+   * \param key to identify a record.
+   *
+   * \return false if the record does not exist or expired.
+   */
+  bool persist(const Key& key);
+
+  /** \brief Gets remaining time to live of a record.
+   * \param key to identify a record.
+   *
+   * \return seconds before expiration, -1 for persistent record, nullopt if
+   * the record does not exist or expired.
+   */
+  std::optional<int64_t> ttl(const Key& key);
+
+  /// Expiration time of persistent records
+  static constexpr time_t NEVER = std::numeric_limits<time_t>::max();
 
   /** \brief Removes value by key from HashMap.
    * \param key to identify a record.
@@ -78,7 +294,7 @@ class HashMap {
    * This method looks for it in a[h(key)] list erases it if found.
    * 
    */
-  void remove(int key);
+  void remove(const Key& key);
 
   /** \brief Method that gets all contents of a table.
    *
@@ -89,26 +305,263 @@ class HashMap {
    */
   std::string get_table();
 
+  /** \brief Gets keys of alive records that have expiration time.
+   *
+   * \return keys and their expiration times (unix time) in no order.
+   */
+  std::vector<std::pair<std::string, time_t>> expiring_keys();
+
+  /** \brief Builds the ordered index of keys, range works after that.
+   *
+   * Does nothing if the index is built already.
+   */
+  void enable_index();
+
+  /// Drops the ordered index
+  void disable_index() { index_.reset(); }
+
+  /// Returns true if the ordered index is built
+  bool has_index() const { return index_ != nullptr; }
+
+  /** \brief Gets records with keys from..to in key order.
+   * \param from the least key (inclusive)
+   * \param to the greatest key (inclusive)
+   * \param limit max number of records
+   *
+   * Uses the ordered index, expired records met by the scan are removed.
+   *
+   * \return keys and values, empty if there is no index.
+   */
+  std::vector<std::pair<std::string, std::string>> range(const Key& from,
+                                                         const Key& to,
+                                                         size_t limit);
+
+  /** \brief Writes all records to a stream in binary format.
+   * \param out binary stream
+   *
+   * Format (little-endian byte order): DUMP_MAGIC, uint32_t DUMP_VERSION, uint64_t
+   * number of records, then for every record: uint32_t key length, key bytes,
+   * int64_t expiration time, uint32_t value length, value bytes. Expired
+   * records are skipped.
+   *
+   * \return number of written records.
+   */
+  size_t dump(std::ostream& out);
+
+  /** \brief Puts records written by dump into HashMap.
+   * \param in binary stream
+   *
+   * Buckets are reserved for all records of the stream beforehand. Existing
+   * records with the same keys are replaced, expired records are skipped,
+   * limits of the HashMap are kept by eviction.
+   *
+   * \return number of read records, nullopt if the stream is not a dump or
+   * is truncated (records read before the error stay in HashMap).
+   */
+  std::optional<size_t> load(std::istream& in);
+
+  /// Returns number of records that are not expired
+  size_t alive_records();
+
+  /// Writes header of a dump (see dump) with the number of records
+  static void write_dump_header(std::ostream& out, uint64_t records);
+
+  /** \brief Writes records of a dump without its header.
+   * \param out binary stream
+   *
+   * Lets several HashMaps write one dump: the header with their total of
+   * alive_records and then records of every one of them.
+   *
+   * \return number of written records.
+   */
+  size_t dump_records(std::ostream& out);
+
+  /** \brief Reads header of a dump.
+   * \param in binary stream
+   *
+   * \return number of records, nullopt if the stream is not a dump.
+   */
+  static std::optional<uint64_t> read_dump_header(std::istream& in);
+
+  /** \brief Reads one record of a dump.
+   * \param in binary stream
+   * \param[out] key of the record
+   * \param[out] value of the record
+   * \param[out] expires expiration time of the record
+   *
+   * \return false if the stream is truncated.
+   */
+  static bool read_dump_record(std::istream& in, Key& key, std::string& value,
+                               time_t& expires);
+
+  /** \brief Resizes the vector so that it has a bucket per record.
+   * \param records expected number of records
+   *
+   * The vector never shrinks. Records are moved to their new buckets without
+   * copying. Number of buckets is limited by max_records of the HashMap and
+   * by a half of its max_memory.
+   */
+  void reserve(size_t records);
+
+  /** \brief Moves records to another HashMap.
+   * \param target HashMap that receives the records
+   * \param moves function that returns true for keys to move
+   *
+   * Records are moved without copying (their list nodes are spliced), the
+   * ordered index of both HashMaps is kept. Limits are not checked.
+   *
+   * \return number of moved records.
+   */
+  size_t move_records(HashMap& target,
+                      const std::function<bool(const Key&)>& moves);
+
+  /// Returns number of buckets
+  size_t buckets() const { return a.size(); }
+
+  /** \brief Evicts one record according to eviction policy.
+   * \param keep key that must not be evicted
+   *
+   * Samples EVICTION_SAMPLES records starting from random buckets and removes
+   * the worst of them. Expired records are always evicted first.
+   *
+   * \return false if there is nothing to evict.
+   */
+  bool evict(const Key* keep = nullptr);
+
+  /** \brief Sets function that is called with the key of every evicted record.
+   * \param listener function, empty one removes the listener
+   *
+   * Expired records that are removed on access are not reported.
+   */
+  void set_eviction_listener(std::function<void(const Key&)> listener) {
+    on_evict_ = std::move(listener);
+  }
+
+  /// Returns approximate number of bytes used by the HashMap and its index
+  size_t memory_usage() const {
+    return memory_ + (index_ ? index_->memory_usage() : 0);
+  }
+
+  /// Returns number of records (including expired but not yet removed)
+  size_t records() const { return records_; }
+
+  /// Lengths of collision chains
+  struct ChainStats {
+    size_t buckets;  ///< number of buckets
+    size_t used;     ///< number of non-empty buckets
+    size_t longest;  ///< length of the longest chain
+    size_t probes;   ///< key comparisons to find every record once
+  };
+
+  /// Returns lengths of collision chains
+  ChainStats chain_stats() const {
+    ChainStats stats = {a.size(), 0, 0, 0};
+    for (const auto& bucket : a) {
+      if (!bucket.empty()) {
+        stats.used++;
+        stats.longest = std::max(stats.longest, bucket.size());
+        stats.probes += bucket.size() * (bucket.size() + 1) / 2;
+      }
+    }
+    return stats;
+  }
+
   /// Clears hash map
-  void free_hash_map() { a.clear(); }
+  void free_hash_map() {
+    a.clear();
+    tags_.clear();
+    index_.reset();
+    records_ = 0;
+    memory_ = 0;
+  }
 
  private:
-  static const size_t BASIC_SIZE = 50'000;
-  std::vector<std::list<Record>> a;
+  static const size_t EVICTION_SAMPLES = 5;
+  static const uint8_t LFU_INIT = 5;           /// hits of a new record
+  static const uint32_t LFU_DECAY = 1'000;     /// accesses to halve hits
+  static const size_t TAG_SLOTS = sizeof(uint64_t);  /// tagged records
+  static constexpr char DUMP_MAGIC[4] = {'H', 'S', 'T', 'B'};
+  static constexpr uint32_t DUMP_VERSION = 1;
+  static const size_t BUCKET_SIZE =  /// a list and its tag word
+      sizeof(std::list<Record>) + sizeof(uint64_t);
+  /// Bucket arrays, see TableAllocator
+  using Buckets =
+      std::vector<std::list<Record>, TableAllocator<std::list<Record>>>;
+  Buckets a;
+  /// tags of first TAG_SLOTS records of a[i]
+  std::vector<uint64_t, TableAllocator<uint64_t>> tags_;
+
+  size_t max_records_ = 0;
+  size_t max_memory_ = 0;
+  EvictionPolicy policy_ = EvictionPolicy::LRU;
+  size_t compress_threshold_ = 0;
+  std::function<void(const Key&)> on_evict_;
+  std::unique_ptr<OrderedIndex<Key>> index_;  /// nullptr if not enabled
+  size_t records_ = 0;
+  size_t memory_ = 0;
+  Bins bins_;
+  uint32_t clock_ = 0;
+  uint64_t versions_ = 0;
+  std::minstd_rand random_;
 
   /** \brief Hash function implementation.
    * \param key to identify a record.
    * 
-   * Large prime number was chosen to implement the hash function.
+   * Hash policy maps the key to 64 bit hash, then bin policy reduces it.
    *
    * \return Hash function mapping
    *
    */
-  size_t h(int key) {
-    size_t hash = (key * 2654435761) % BASIC_SIZE;
-    return hash;
+  size_t h(const Key& key) { return bins_(Hash()(key)); }
+
+  /// Returns tag of a hash, never 0 (0 marks an empty slot of a tag word).
+  /// Power of two bins select the bucket by the high bits only, so bits
+  /// 24-30 are free of it. Modulo bins use every bit, so with them tags
+  /// correlate with the bucket: more tags match, lookups stay correct.
+  static uint8_t tag_of(uint64_t hash) { return uint8_t(hash >> 24) | 0x80; }
+
+  /** \brief Compares tag with all tags of a tag word at once.
+   * \param tags tag word of a bucket
+   * \param tag to look for
+   *
+   * \return 0x80 in the bytes where tag is equal, 0 in the others.
+   */
+  static uint64_t match_tags(uint64_t tags, uint8_t tag) {
+    const uint64_t LOW7 = 0x7F7F7F7F7F7F7F7Full;
+    uint64_t diff = tags ^ (0x0101010101010101ull * tag);
+    // high bit of a byte is set only if all bits of diff byte are zero
+    return ~(((diff & LOW7) + LOW7) | diff | LOW7);
   }
 
+  /// Rebuilds tag word of a bucket after its chain was changed
+  void retag(size_t idx) {
+    uint64_t tags = 0;
+    size_t slot = 0;
+    for (auto it = a[idx].begin(); it != a[idx].end() && slot < TAG_SLOTS;
+         it++, slot++) {
+      tags |= uint64_t(it->tag) << (8 * slot);
+    }
+    tags_[idx] = tags;
+  }
+
+  /// Asks the processor to load memory at address into the cache
+  static void prefetch(const void* address) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+  }
+
+  /// Resizes the vector to buckets rounded by bin policy
+  void resize_buckets(size_t buckets = BASIC_SIZE) {
+    a.resize(Bins::round(buckets));
+    tags_.assign(a.size(), 0);
+    bins_.set_size(a.size());
+    memory_ = a.size() * BUCKET_SIZE;
+  }
   /** \brief This method checks whether time is expired.
    * \param time to check
    *
@@ -118,4 +571,67 @@ class HashMap {
    *
    */
   bool expired(time_t expires) { return expires < time(NULL); }
+
+  /** \brief Looks for a record by key.
+   * \param key to identify a record.
+   *
+   * Expired record is removed.
+   *
+   * \return pointer to the record, nullptr if it is not found.
+   */
+  Record* find(const Key& key) { return find(key, Hash()(key)); }
+
+  /** \brief Looks for a record by key with already computed hash.
+   * \param key to identify a record.
+   * \param hash of the key
+   *
+   * Expired record is removed.
+   *
+   * \return pointer to the record, nullptr if it is not found.
+   */
+  Record* find(const Key& key, uint64_t hash);
+
+  /** \brief Adds new record or changes value of the existing one.
+   * \param record pointer to the existing record or nullptr
+   * \param key to identify a record.
+   * \param value to store value
+   * \param expires expiration time
+   *
+   * \return false if the record does not fit into the limits.
+   */
+  bool store(Record* record, const Key& key, CompactValue value,
+             time_t expires);
+
+  /// Encodes a value, compressing it if it reaches compress_threshold_
+  CompactValue encode(std::string_view value) const {
+    return CompactValue(value, compress_threshold_);
+  }
+
+  /** \brief Marks record as accessed.
+   * \param record accessed record
+   *
+   * Updates LRU clock and increments logarithmic LFU counter: the bigger
+   * the counter is the less probable is its increment.
+   */
+  void touch(Record& record);
+
+  /** \brief Computes eviction score of a record.
+   * \param record to score
+   *
+   * \return score, the record with the biggest score is evicted first.
+   */
+  uint64_t eviction_score(const Record& record);
+
+  /// Returns approximate number of bytes used by a record
+  static size_t record_size(const Record& record) {
+    // list node has two pointers, long keys and values are on the heap
+    return sizeof(Record) + 2 * sizeof(void*) + key_heap_size(record.key) +
+           record.value.heap_size();
+  }
+
+  /// Checks whether limits are exceeded
+  bool over_limits() const {
+    return (max_records_ && records_ > max_records_) ||
+           (max_memory_ && memory_usage() > max_memory_);
+  }
 };
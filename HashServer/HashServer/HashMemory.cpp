@@ -0,0 +1,293 @@
+#include "HashMemory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static bool prefault_pages = false;
+static HugePages huge_page_mode = HugePages::OFF;
+static int numa_mode = NUMA_OFF;
+
+/// Size and huge pages of every array of at least MIN_MAPPED_SIZE bytes
+struct ArrayRegistry {
+  std::map<const void*, std::pair<size_t, bool>> arrays;
+  std::mutex mutex;
+};
+
+/// Registry is never destroyed: global tables free their arrays at exit
+static ArrayRegistry& registry() {
+  static ArrayRegistry* arrays = new ArrayRegistry;
+  return *arrays;
+}
+
+void configure_table_memory(bool prefault, HugePages huge_pages) {
+  prefault_pages = prefault;
+  huge_page_mode = huge_pages;
+#ifndef __linux__
+  if (prefault || huge_pages != HugePages::OFF) {
+    std::cerr << "warning: prefault and huge pages are supported on Linux only"
+              << std::endl;
+  }
+#endif
+}
+
+HugePages parse_huge_pages(const std::string& name) {
+  if (name == "off") {
+    return HugePages::OFF;
+  } else if (name == "transparent") {
+    return HugePages::TRANSPARENT;
+  } else if (name == "explicit") {
+    return HugePages::EXPLICIT;
+  }
+  throw std::invalid_argument("unknown huge pages mode " + name);
+}
+
+int parse_numa(const std::string& value) {
+  if (value == "off") {
+    return NUMA_OFF;
+  } else if (value == "interleave") {
+    return NUMA_INTERLEAVE;
+  }
+  size_t node = std::stoul(value);
+  if (node >= numa_nodes()) {
+    throw std::invalid_argument("no NUMA node " + value);
+  }
+  return int(node);
+}
+
+/** \brief Parses a list of numbers like "0-3,8,10-11".
+ * \param list the list, ranges are inclusive
+ *
+ * \return the numbers, empty on a wrong list.
+ */
+static std::vector<size_t> parse_ranges(const std::string& list) {
+  std::vector<size_t> numbers;
+  size_t pos = 0;
+  try {
+    while (pos < list.size()) {
+      size_t end = std::min(list.find(',', pos), list.size());
+      std::string range = list.substr(pos, end - pos);
+      size_t dash = range.find('-');
+      size_t first = std::stoul(range.substr(0, dash));
+      size_t last =
+          dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+      for (size_t number = first; number <= last; number++) {
+        numbers.push_back(number);
+      }
+      pos = end + 1;
+    }
+  } catch (std::exception&) {
+    numbers.clear();
+  }
+  return numbers;
+}
+
+/// Reads the first line of a file, empty if there is no such file
+static std::string read_line(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+size_t numa_nodes() {
+  static const size_t nodes = [] {
+    std::vector<size_t> online =
+        parse_ranges(read_line("/sys/devices/system/node/online"));
+    return online.empty() ? size_t(1) : online.back() + 1;
+  }();
+  return nodes;
+}
+
+void place_process(int numa) {
+  numa_mode = numa;
+  if (numa == NUMA_OFF) {
+    return;
+  }
+#ifdef __linux__
+  size_t nodes = numa == NUMA_INTERLEAVE ? numa_nodes() : size_t(numa) + 1;
+  std::vector<unsigned long> mask(nodes / (8 * sizeof(unsigned long)) + 1);
+  for (size_t node = numa == NUMA_INTERLEAVE ? 0 : numa; node < nodes;
+       node++) {
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1ul << (node % (8 * sizeof(unsigned long)));
+  }
+  int mode = numa == NUMA_INTERLEAVE ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+  if (syscall(SYS_set_mempolicy, mode, mask.data(),
+              mask.size() * 8 * sizeof(unsigned long) + 1) != 0) {
+    std::cerr << "warning: NUMA memory policy is not set" << std::endl;
+  }
+  if (numa == NUMA_INTERLEAVE) {
+    return;  // threads run anywhere, their memory is spread evenly
+  }
+  std::vector<size_t> cpus = parse_ranges(read_line(
+      "/sys/devices/system/node/node" + std::to_string(numa) + "/cpulist"));
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  if (cpus.empty() || sched_setaffinity(0, sizeof(set), &set) != 0) {
+    std::cerr << "warning: threads are not bound to NUMA node " << numa
+              << std::endl;
+  }
+#else
+  std::cerr << "warning: NUMA placement is supported on Linux only"
+            << std::endl;
+#endif
+}
+
+#ifdef __linux__
+/// Returns true if an array is mapped, not allocated by operator new
+static bool mapped(size_t bytes) {
+  return bytes >= MIN_MAPPED_SIZE &&
+         (prefault_pages || huge_page_mode != HugePages::OFF);
+}
+
+/// Returns true if an array is backed by huge pages
+static bool huge(size_t bytes) {
+  return huge_page_mode != HugePages::OFF && bytes >= MIN_HUGE_SIZE;
+}
+
+/// Size of the mapping of an array, whole huge pages for huge arrays
+static size_t mapped_size(size_t bytes) {
+  if (huge(bytes)) {
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  }
+  return bytes;
+}
+#endif
+
+/// Allocates an array without registering it
+static void* allocate_array(size_t bytes) {
+#ifdef __linux__
+  if (mapped(bytes)) {
+    static std::atomic<bool> warned{false};
+    const int protection = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    size_t size = mapped_size(bytes);
+    void* memory = MAP_FAILED;
+    if (huge(bytes) && huge_page_mode == HugePages::EXPLICIT) {
+      memory = mmap(nullptr, size, protection,
+                    flags | MAP_HUGETLB | (prefault_pages ? MAP_POPULATE : 0),
+                    -1, 0);
+      if (memory == MAP_FAILED && !warned.exchange(true)) {
+        std::cerr << "warning: no reserved huge pages, transparent huge "
+                     "pages are used"
+                  << std::endl;
+      }
+    }
+    if (memory == MAP_FAILED) {
+      // transparent huge pages are advised before the pages are touched
+      bool advise = huge(bytes);
+      size_t extra = advise ? HUGE_PAGE_SIZE : 0;  // to align the array
+      memory = mmap(nullptr, size + extra, protection,
+                    flags | (prefault_pages && !advise ? MAP_POPULATE : 0),
+                    -1, 0);
+      if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      if (advise) {  // only aligned huge pages can back the array
+        uintptr_t start = uintptr_t(memory);
+        uintptr_t aligned =
+            (start + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        if (aligned > start) {
+          munmap(memory, aligned - start);
+        }
+        if (start + extra > aligned) {
+          munmap(reinterpret_cast<void*>(aligned + size),
+                 start + extra - aligned);
+        }
+        memory = reinterpret_cast<void*>(aligned);
+        madvise(memory, size, MADV_HUGEPAGE);
+        for (size_t i = 0; prefault_pages && i < size; i += 4096) {
+          static_cast<volatile char*>(memory)[i] = 0;
+        }
+      }
+    }
+    return memory;
+  }
+#endif
+  return ::operator new(bytes);
+}
+
+void* allocate_table_memory(size_t bytes) {
+  void* memory = allocate_array(bytes);
+  if (bytes >= MIN_MAPPED_SIZE) {
+    bool huge_pages = false;
+#ifdef __linux__
+    huge_pages = huge(bytes);
+#endif
+    std::lock_guard<std::mutex> lg(registry().mutex);
+    registry().arrays[memory] = {bytes, huge_pages};
+  }
+  return memory;
+}
+
+void free_table_memory(void* memory, size_t bytes) {
+  if (bytes >= MIN_MAPPED_SIZE) {
+    std::lock_guard<std::mutex> lg(registry().mutex);
+    registry().arrays.erase(memory);
+  }
+#ifdef __linux__
+  if (mapped(bytes)) {
+    munmap(memory, mapped_size(bytes));
+    return;
+  }
+#endif
+  ::operator delete(memory);
+}
+
+TableMemoryStats table_memory_stats() {
+  static const size_t SAMPLES = 16;  /// pages asked per array
+  TableMemoryStats stats;
+  stats.numa = numa_mode;
+  stats.prefault = prefault_pages;
+  stats.huge_pages = huge_page_mode;
+#ifdef __linux__
+  stats.node_bytes.resize(numa_nodes());
+  const size_t page = size_t(sysconf(_SC_PAGESIZE));
+#endif
+  std::lock_guard<std::mutex> lg(registry().mutex);
+  for (const auto& [memory, array] : registry().arrays) {
+    stats.arrays++;
+    stats.bytes += array.first;
+    stats.huge_bytes += array.second ? array.first : 0;
+#ifdef __linux__
+    void* pages[SAMPLES];
+    int nodes[SAMPLES];
+    size_t samples = std::min(SAMPLES, (array.first + page - 1) / page);
+    for (size_t i = 0; i < samples; i++) {
+      uintptr_t address =
+          uintptr_t(memory) + array.first / samples * i + page - 1;
+      pages[i] = reinterpret_cast<void*>(address / page * page);
+    }
+    // without target nodes move_pages only tells nodes of the pages
+    if (syscall(SYS_move_pages, 0, samples, pages, nullptr, nodes, 0) != 0) {
+      stats.node_bytes.clear();
+      continue;
+    }
+    for (size_t i = 0; i < samples && !stats.node_bytes.empty(); i++) {
+      if (nodes[i] >= 0 && size_t(nodes[i]) < stats.node_bytes.size()) {
+        stats.node_bytes[nodes[i]] += array.first / samples;
+      }
+    }
+#endif
+  }
+  return stats;
+}
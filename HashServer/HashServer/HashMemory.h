@@ -0,0 +1,137 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/// Smaller arrays of tables are allocated by operator new
+constexpr size_t MIN_MAPPED_SIZE = 64 * 1024;
+
+/// Size of a huge page
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+/// Arrays of this size and more can use huge pages (a table of BASIC_SIZE
+/// buckets has a 1.5 MB bucket array)
+constexpr size_t MIN_HUGE_SIZE = HUGE_PAGE_SIZE / 2;
+
+/// NUMA placement: memory is placed by the system (the first touch)
+constexpr int NUMA_OFF = -2;
+
+/// NUMA placement: memory is interleaved over all nodes
+constexpr int NUMA_INTERLEAVE = -1;
+
+/// Pages that back big arrays of tables
+enum class HugePages {
+  OFF,          /// normal pages
+  TRANSPARENT,  /// normal mapping advised for transparent huge pages
+  EXPLICIT      /// reserved huge pages (MAP_HUGETLB), transparent if none
+};
+
+/** \brief Sets how big arrays of tables are allocated.
+ * \param prefault map arrays with all their pages at once
+ * \param huge_pages pages of arrays of at least MIN_HUGE_SIZE bytes
+ *
+ * Must be called at startup, before any table is created: allocations
+ * made before and after it are freed in different ways.
+ */
+void configure_table_memory(bool prefault, HugePages huge_pages);
+
+/** \brief Parses huge pages mode.
+ * \param name off, transparent or explicit
+ *
+ * \return parsed mode, throws std::invalid_argument on unknown name
+ */
+HugePages parse_huge_pages(const std::string& name);
+
+/** \brief Parses NUMA placement.
+ * \param value off, interleave or number of a node
+ *
+ * \return NUMA_OFF, NUMA_INTERLEAVE or the node, throws
+ * std::invalid_argument on wrong value
+ */
+int parse_numa(const std::string& value);
+
+/// Returns number of NUMA nodes, 1 if it is unknown
+size_t numa_nodes();
+
+/** \brief Places the process on NUMA nodes.
+ * \param numa NUMA_OFF, NUMA_INTERLEAVE or a node
+ *
+ * For a node the calling thread runs on the CPUs of the node and allocates
+ * memory on it while the node has free memory; for NUMA_INTERLEAVE memory
+ * of the calling thread is interleaved over all nodes. Threads created
+ * afterwards inherit both, so it is called before workers are started.
+ * Linux only.
+ */
+void place_process(int numa);
+
+/// Placement of big arrays of tables
+struct TableMemoryStats {
+  int numa = NUMA_OFF;
+  bool prefault = false;
+  HugePages huge_pages = HugePages::OFF;
+  size_t arrays = 0;      /// arrays of at least MIN_MAPPED_SIZE bytes
+  size_t bytes = 0;       /// bytes of the arrays
+  size_t huge_bytes = 0;  /// bytes of the arrays mapped for huge pages
+  std::vector<size_t> node_bytes;  /// bytes per node, estimated by samples
+};
+
+/** \brief Gets placement of big arrays of tables.
+ *
+ * Nodes of a few pages of every array are asked from the system, pages not
+ * touched yet are not counted. node_bytes is empty if the system can not
+ * tell nodes of pages.
+ */
+TableMemoryStats table_memory_stats();
+
+/** \brief Allocates memory of a big array of a table.
+ * \param bytes size of the array
+ *
+ * If prefault or huge pages are on, arrays of at least MIN_MAPPED_SIZE bytes
+ * are mapped on Linux, huge ones are rounded up to whole huge pages. Other
+ * arrays are allocated by operator new. Throws std::bad_alloc.
+ */
+void* allocate_table_memory(size_t bytes);
+
+/// Frees memory of allocate_table_memory, bytes is the same size
+void free_table_memory(void* memory, size_t bytes);
+
+/**
+ * \class TableAllocator
+ *
+ *
+ * \brief Allocator of bucket and tag arrays of HashMap.
+ *
+ * Stateless, the way of allocation is chosen by the size, so memory of one
+ * allocator is freed by any other one.
+ */
+template <typename T>
+class TableAllocator {
+ public:
+  using value_type = T;
+  using is_always_equal = std::true_type;
+
+  TableAllocator() = default;
+
+  template <typename U>
+  TableAllocator(const TableAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(allocate_table_memory(n * sizeof(T)));
+  }
+
+  void deallocate(T* memory, size_t n) {
+    free_table_memory(memory, n * sizeof(T));
+  }
+
+  template <typename U>
+  bool operator==(const TableAllocator<U>&) const {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const TableAllocator<U>&) const {
+    return false;
+  }
+};
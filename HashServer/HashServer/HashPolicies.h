@@ -0,0 +1,267 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "HashKeys.h"
+
+#if defined(__SSE4_2__) || defined(__AVX__)
+#include <nmmintrin.h>
+#define HASHSERVER_HW_CRC32C
+#endif
+
+/**
+ * Hash policies of HashMap.
+ *
+ * A hash policy maps a key (uint64_t or SmallKey) to 64 bit hash. High bits
+ * of the hash must be well mixed: bin policies reduce it to a bucket using
+ * them. DefaultHash (wyhash) is declared in HashKeys.h.
+ */
+
+/// Returns bytes of a key that are hashed
+inline std::string_view key_bytes(const uint64_t& key) {
+  return std::string_view(reinterpret_cast<const char*>(&key), sizeof(key));
+}
+
+/// Returns bytes of a key that are hashed
+inline std::string_view key_bytes(const SmallKey& key) { return key.view(); }
+
+/**
+ * \struct FibonacciHash
+ *
+ * \brief Multiplicative (Fibonacci) hashing: key * 2^64 / golden ratio.
+ *
+ * The cheapest policy, one multiplication per 8 bytes. High bits are good,
+ * low bits are not, so it is only suitable for bins that use high bits.
+ */
+struct FibonacciHash {
+  static const uint64_t FIBONACCI = 11400714819323198485ull;
+
+  uint64_t operator()(uint64_t key) const { return key * FIBONACCI; }
+
+  uint64_t operator()(const SmallKey& key) const {
+    std::string_view bytes = key.view();
+    uint64_t hash = bytes.size();
+    size_t i = 0;
+    for (; i + 8 <= bytes.size(); i += 8) {
+      uint64_t word;
+      std::memcpy(&word, bytes.data() + i, 8);
+      hash = (hash ^ word) * FIBONACCI;
+      hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, bytes.data() + i, bytes.size() - i);
+    return (hash ^ tail) * FIBONACCI;
+  }
+};
+
+/// CRC32C (Castagnoli) functions, SSE4.2 instruction is used if available
+namespace crc32c {
+/// Table of the software implementation (reflected polynomial 0x82F63B78)
+struct Table {
+  uint32_t t[256];
+  Table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; j++) {
+        crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+      }
+      t[i] = crc;
+    }
+  }
+};
+
+/// Updates crc with len bytes starting from data
+inline uint32_t update(uint32_t crc, const char* data, size_t len) {
+#ifdef HASHSERVER_HW_CRC32C
+  uint64_t crc64 = crc;
+  for (; len >= 8; len -= 8, data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = uint32_t(crc64);
+  for (; len > 0; len--, data++) {
+    crc = _mm_crc32_u8(crc, uint8_t(*data));
+  }
+#else
+  static const Table table;
+  for (; len > 0; len--, data++) {
+    crc = table.t[(crc ^ uint8_t(*data)) & 0xFF] ^ (crc >> 8);
+  }
+#endif
+  return crc;
+}
+}  // namespace crc32c
+
+/**
+ * \struct Crc32cHash
+ *
+ * \brief Two CRC32C with different seeds make 64 bit hash.
+ *
+ * With SSE4.2 it costs two crc32 instructions per 8 bytes of a key.
+ */
+struct Crc32cHash {
+  template <typename Key>
+  uint64_t operator()(const Key& key) const {
+    std::string_view bytes = key_bytes(key);
+    uint64_t high = crc32c::update(0xFFFFFFFFu, bytes.data(), bytes.size());
+    uint64_t low = crc32c::update(0x9E3779B9u, bytes.data(), bytes.size());
+    return (high << 32) | low;
+  }
+};
+
+/// xxHash64 functions (BSD 2-Clause, https://github.com/Cyan4973/xxHash)
+namespace xxh64 {
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ull;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ull;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME2;
+  acc = rotl(acc, 31);
+  return acc * PRIME1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+  acc ^= round(0, val);
+  return acc * PRIME1 + PRIME4;
+}
+
+/// Hashes len bytes starting from data
+inline uint64_t hash(const char* data, size_t len, uint64_t seed = 0) {
+  const char* p = data;
+  const char* end = data + len;
+  uint64_t h;
+  if (len >= 32) {
+    uint64_t v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2, v3 = seed,
+             v4 = seed - PRIME1;
+    do {
+      v1 = round(v1, wyhash::read8(reinterpret_cast<const uint8_t*>(p)));
+      v2 = round(v2, wyhash::read8(reinterpret_cast<const uint8_t*>(p + 8)));
+      v3 = round(v3, wyhash::read8(reinterpret_cast<const uint8_t*>(p + 16)));
+      v4 = round(v4, wyhash::read8(reinterpret_cast<const uint8_t*>(p + 24)));
+      p += 32;
+    } while (p + 32 <= end);
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge_round(h, v1);
+    h = merge_round(h, v2);
+    h = merge_round(h, v3);
+    h = merge_round(h, v4);
+  } else {
+    h = seed + PRIME5;
+  }
+  h += len;
+  for (; p + 8 <= end; p += 8) {
+    h ^= round(0, wyhash::read8(reinterpret_cast<const uint8_t*>(p)));
+    h = rotl(h, 27) * PRIME1 + PRIME4;
+  }
+  if (p + 4 <= end) {
+    h ^= wyhash::read4(reinterpret_cast<const uint8_t*>(p)) * PRIME1;
+    h = rotl(h, 23) * PRIME2 + PRIME3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= uint8_t(*p) * PRIME5;
+    h = rotl(h, 11) * PRIME1;
+  }
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+  return h;
+}
+}  // namespace xxh64
+
+/**
+ * \struct XxHash64
+ *
+ * \brief xxHash64 of the key bytes.
+ */
+struct XxHash64 {
+  template <typename Key>
+  uint64_t operator()(const Key& key) const {
+    std::string_view bytes = key_bytes(key);
+    return xxh64::hash(bytes.data(), bytes.size());
+  }
+};
+
+/**
+ * Bin policies of HashMap.
+ *
+ * A bin policy rounds the requested number of buckets and reduces a hash to
+ * the bucket index.
+ */
+
+/**
+ * \struct PowerOfTwoBins
+ *
+ * \brief Number of buckets is a power of two, bucket is the high bits of hash.
+ *
+ * Reduction is one shift.
+ */
+struct PowerOfTwoBins {
+  static size_t round(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+      p <<= 1;
+    }
+    return p;
+  }
+
+  void set_size(size_t n) {
+    shift = 64;
+    for (; n > 1; n >>= 1) {
+      shift--;
+    }
+  }
+
+  size_t operator()(uint64_t hash) const {
+    return shift == 64 ? 0 : size_t(hash >> shift);
+  }
+
+  unsigned shift = 64;
+};
+
+/**
+ * \struct FastRangeBins
+ *
+ * \brief Any number of buckets, bucket is high 64 bits of hash * size.
+ *
+ * Reduction is one multiplication (Lemire's fastrange) instead of division.
+ */
+struct FastRangeBins {
+  static size_t round(size_t n) { return n; }
+
+  void set_size(size_t n) { size = n; }
+
+  size_t operator()(uint64_t hash) const {
+    uint64_t high = size;
+    wyhash::mum(&hash, &high);
+    return size_t(high);
+  }
+
+  uint64_t size = 1;
+};
+
+/**
+ * \struct ModuloBins
+ *
+ * \brief Any number of buckets, bucket is hash % size.
+ *
+ * Costs a division per lookup, kept to compare with the other policies.
+ */
+struct ModuloBins {
+  static size_t round(size_t n) { return n; }
+
+  void set_size(size_t n) { size = n; }
+
+  size_t operator()(uint64_t hash) const { return size_t(hash % size); }
+
+  uint64_t size = 1;
+};
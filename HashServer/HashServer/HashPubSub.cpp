@@ -0,0 +1,183 @@
+#include "HashPubSub.h"
+
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <tuple>
+
+std::map<size_t, std::vector<boost::weak_ptr<con_handler>>> subscribers;
+
+/// Expiration times of keys of subscribed tables, by table index and key
+static std::map<std::pair<size_t, std::string>, time_t> expiring;
+
+/// The same expiration times, the earliest first
+static std::set<std::tuple<time_t, size_t, std::string>> expiration_order;
+
+static void forget_expiration(size_t index, const std::string& key) {
+  auto it = expiring.find({index, key});
+  if (it != expiring.end()) {
+    expiration_order.erase({it->second, index, key});
+    expiring.erase(it);
+  }
+}
+
+static void remember_expiration(size_t index, const std::string& key,
+                                time_t expires) {
+  forget_expiration(index, key);
+  if (expires != TableMap::NEVER) {
+    expiring.emplace(std::make_pair(index, key), expires);
+    expiration_order.emplace(expires, index, key);
+  }
+}
+
+/// Registers expiration times of all keys of a table
+static void remember_table(size_t index) {
+  if (index < tables.size() && tables[index].valid) {
+    for (const auto& [key, expires] : tables[index].hash_map.expiring_keys()) {
+      remember_expiration(index, key, expires);
+    }
+  }
+}
+
+static void forget_table(size_t index) {
+  auto begin = expiring.lower_bound({index, std::string()});
+  auto end = expiring.lower_bound({index + 1, std::string()});
+  for (auto it = begin; it != end; it++) {
+    expiration_order.erase({it->second, index, it->first.second});
+  }
+  expiring.erase(begin, end);
+}
+
+/// Returns live subscribers of a table, forgets a table without them
+static std::vector<boost::weak_ptr<con_handler>>* find_subscribers(
+    size_t index) {
+  auto it = subscribers.find(index);
+  if (it == subscribers.end()) {
+    return nullptr;
+  }
+  auto& connections = it->second;
+  connections.erase(
+      std::remove_if(connections.begin(), connections.end(),
+                     [](const auto& connection) { return connection.expired(); }),
+      connections.end());
+  if (connections.empty()) {
+    subscribers.erase(it);
+    forget_table(index);
+    return nullptr;
+  }
+  return &connections;
+}
+
+/// Builds an event once and posts it to every subscriber
+static void publish(const std::vector<boost::weak_ptr<con_handler>>& connections,
+                    std::string message) {
+  auto event = std::make_shared<const std::string>(std::move(message) + "\n");
+  for (const auto& subscriber : connections) {
+    if (auto connection = subscriber.lock()) {
+      connection->post_event(event);
+    }
+  }
+}
+
+static std::string event_prefix(size_t index) {
+  return "message table=" + std::to_string(table_number(index));
+}
+
+void subscribe(const boost::shared_ptr<con_handler>& connection,
+               size_t index) {
+  auto* connections = find_subscribers(index);
+  if (!connections) {
+    remember_table(index);
+    connections = &subscribers[index];
+  }
+  for (const auto& subscriber : *connections) {
+    if (subscriber.lock() == connection) {
+      return;  // already subscribed
+    }
+  }
+  connections->push_back(connection);
+}
+
+bool unsubscribe(const boost::shared_ptr<con_handler>& connection,
+                 size_t index) {
+  auto* connections = find_subscribers(index);
+  if (!connections) {
+    return false;
+  }
+  auto it = std::find_if(connections->begin(), connections->end(),
+                         [&connection](const auto& subscriber) {
+                           return subscriber.lock() == connection;
+                         });
+  if (it == connections->end()) {
+    return false;
+  }
+  connections->erase(it);
+  find_subscribers(index);  // forgets the table if it was the last one
+  return true;
+}
+
+void publish_key(size_t index, std::string_view key) {
+  if (subscribers.empty()) {
+    return;  // nobody subscribed, the common case
+  }
+  auto* connections = find_subscribers(index);
+  if (!connections) {
+    return;
+  }
+  std::string name(key);
+  auto state = tables[index].hash_map.peek(name);
+  if (!state) {
+    forget_expiration(index, name);
+    publish(*connections, event_prefix(index) + " del key=" + name);
+    return;
+  }
+  remember_expiration(index, name, state->second);
+  // a value may hold line feeds (eval, loadtable, the primary), its size
+  // tells where the event ends
+  publish(*connections, event_prefix(index) + " set key=" + name +
+                            " size=" + std::to_string(state->first.size()) +
+                            " value=" + state->first);
+}
+
+void publish_removal(size_t index, std::string_view key) {
+  if (subscribers.empty()) {
+    return;
+  }
+  auto* connections = find_subscribers(index);
+  if (!connections) {
+    return;
+  }
+  std::string name(key);
+  forget_expiration(index, name);
+  publish(*connections, event_prefix(index) + " del key=" + name);
+}
+
+void publish_table(size_t index, bool removed) {
+  auto* connections = find_subscribers(index);
+  if (!connections) {
+    return;
+  }
+  forget_table(index);
+  if (removed) {
+    publish(*connections, event_prefix(index) + " removed");
+    subscribers.erase(index);
+    return;
+  }
+  remember_table(index);
+  publish(*connections, event_prefix(index) + " loaded");
+}
+
+void publish_expirations() {
+  time_t now = time(NULL);
+  while (!expiration_order.empty() &&
+         std::get<0>(*expiration_order.begin()) < now) {
+    auto [expires, index, key] = *expiration_order.begin();
+    expiration_order.erase(expiration_order.begin());
+    expiring.erase({index, key});
+    auto* connections = find_subscribers(index);
+    if (!connections) {
+      continue;
+    }
+    publish(*connections, event_prefix(index) + " del key=" + key);
+  }
+}
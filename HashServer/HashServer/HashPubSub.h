@@ -0,0 +1,99 @@
+#pragma once
+#include <boost/weak_ptr.hpp>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HashServer.h"
+
+/*
+    Streams of table changes.
+
+    A line mode connection sends "subscribe <no> [drop|close]" and then gets
+    an event line for every change of the table:
+    message table=<no> set key=<key> size=<bytes> value=<value>
+                                - key is set (by any command or by a load),
+                                  value is raw: the event ends after size
+                                  bytes of it and '\n', a value may hold
+                                  line feeds
+    message table=<no> del key=<key>
+                                - key is removed, evicted or expired
+    message table=<no> loaded   - table is replaced by loadtable or by a new
+                                  snapshot of the primary, read it again
+    message table=<no> removed  - table is removed, the subscription ends
+    message dropped=<count>     - events were dropped by drop policy, read
+                                  the subscribed tables again
+
+    An event is built once and shared by all subscribers of the table.
+    Events of a connection are bounded by sub_buffer bytes: when a
+    subscriber does not read them, further events are dropped (drop policy)
+    or the connection is closed (close policy, the default).
+
+    Tables are identified by their indexes in tables, events have table
+    numbers. All functions must be called under exclusive mutex_ lock or
+    under notify_mutex (by a holder of the shared lock).
+*/
+
+/// Connections subscribed to a table, by table index
+extern std::map<size_t, std::vector<boost::weak_ptr<con_handler>>>
+    subscribers;
+
+/** \brief Subscribes a connection to changes of a table.
+ * \param connection subscribed connection
+ * \param index index of the table in tables
+ *
+ * The first subscription of a table registers expiration times of its keys.
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void subscribe(const boost::shared_ptr<con_handler>& connection,
+               size_t index);
+
+/** \brief Ends a subscription of a connection.
+ * \param connection subscribed connection
+ * \param index index of the table in tables
+ *
+ * \return false if the connection is not subscribed to the table.
+ *
+ * \warning this finction must be called under mutex lock
+ */
+bool unsubscribe(const boost::shared_ptr<con_handler>& connection,
+                 size_t index);
+
+/** \brief Sends current state of a changed key (set or del event).
+ * \param index index of the table in tables
+ * \param key changed key
+ *
+ * A set event has the size of the value before it, so values with line
+ * feeds do not break the lines of events.
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void publish_key(size_t index, std::string_view key);
+
+/** \brief Sends del event of a key that is being evicted.
+ * \param index index of the table in tables
+ * \param key evicted key
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void publish_removal(size_t index, std::string_view key);
+
+/** \brief Sends loaded or removed event of a whole table.
+ * \param index index of the table in tables
+ * \param removed true if the table is removed, then its subscriptions end
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void publish_table(size_t index, bool removed);
+
+/** \brief Sends del events of keys of subscribed tables that have expired.
+ *
+ * Called every TRACKING_INTERVAL seconds, because expired records are
+ * removed lazily. Tables are not read, so the holder of the shared lock
+ * calls it under notify_mutex.
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void publish_expirations();
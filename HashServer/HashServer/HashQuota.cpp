@@ -0,0 +1,119 @@
+#include "HashQuota.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+bool TokenBucket::admit(uint64_t rate, int64_t now) {
+  if (!rate) {
+    return true;
+  }
+  int64_t capacity = int64_t(rate) * SCALE;
+  int64_t last = refilled_.load(std::memory_order_relaxed);
+  // one thread wins the time slice since the last refill and adds it
+  if (now > last && refilled_.compare_exchange_strong(
+                        last, now, std::memory_order_relaxed)) {
+    int64_t elapsed = last < 0 ? SCALE : std::min(now - last, SCALE);
+    int64_t added = elapsed * int64_t(rate);
+    int64_t tokens = tokens_.load(std::memory_order_relaxed);
+    while (!tokens_.compare_exchange_weak(tokens,
+                                          std::min(tokens + added, capacity),
+                                          std::memory_order_relaxed)) {
+    }
+  }
+  return tokens_.load(std::memory_order_relaxed) >= SCALE;
+}
+
+UserStats::Stripe& UserStats::stripe() {
+  static thread_local size_t index =
+      std::hash<std::thread::id>()(std::this_thread::get_id()) % STRIPES;
+  return stripes[index];
+}
+
+UserStats& UserQuotas::find(std::string_view user) {
+  {
+    Shard& shard = shards_[std::hash<std::string_view>()(user) % SHARDS];
+    std::lock_guard<std::mutex> lg(shard.mutex);
+    std::string name(user);
+    auto it = shard.users.find(name);
+    if (it != shard.users.end()) {
+      return *it->second;
+    }
+    if (users_.load(std::memory_order_relaxed) < MAX_USERS || user == "*") {
+      users_++;
+      auto& stats = shard.users[name];
+      stats = std::make_unique<UserStats>(std::move(name));
+      return *stats;
+    }
+  }
+  return find("*");  // too many users, the rest share one entry
+}
+
+bool UserQuotas::admit(UserStats& stats, size_t bytes) {
+  UserStats::Stripe& stripe = stats.stripe();
+  if (ops_rate_ || bytes_rate_) {
+    int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    if (!stats.ops_bucket.admit(ops_rate_, now) ||
+        !stats.bytes_bucket.admit(bytes_rate_, now)) {
+      stripe.rejected.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    stats.ops_bucket.take(1);
+  }
+  stripe.ops.fetch_add(1, std::memory_order_relaxed);
+  account(stats, bytes);
+  return true;
+}
+
+void UserQuotas::account(UserStats& stats, size_t bytes) {
+  stats.stripe().bytes.fetch_add(bytes, std::memory_order_relaxed);
+  if (bytes_rate_) {
+    stats.bytes_bucket.take(bytes);
+  }
+}
+
+void UserQuotas::set_owned(
+    const std::unordered_map<std::string, std::pair<uint64_t, uint64_t>>&
+        owned) {
+  for (const auto& [user, counts] : owned) {
+    UserStats& stats = find(user);  // an owner may have sent no requests
+    stats.tables.store(counts.first, std::memory_order_relaxed);
+    stats.records.store(counts.second, std::memory_order_relaxed);
+  }
+  for (Shard& shard : shards_) {
+    std::lock_guard<std::mutex> lg(shard.mutex);
+    for (auto& [user, stats] : shard.users) {
+      if (!owned.count(user)) {
+        stats->tables.store(0, std::memory_order_relaxed);
+        stats->records.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+UserUsage UserQuotas::usage(const UserStats& stats) {
+  UserUsage usage{stats.user, 0, 0, 0, stats.tables.load(),
+                  stats.records.load()};
+  for (const auto& stripe : stats.stripes) {
+    usage.ops += stripe.ops.load(std::memory_order_relaxed);
+    usage.bytes += stripe.bytes.load(std::memory_order_relaxed);
+    usage.rejected += stripe.rejected.load(std::memory_order_relaxed);
+  }
+  return usage;
+}
+
+std::vector<UserUsage> UserQuotas::usage() const {
+  std::vector<UserUsage> result;
+  for (const Shard& shard : shards_) {
+    std::lock_guard<std::mutex> lg(shard.mutex);
+    for (const auto& user : shard.users) {
+      result.push_back(usage(*user.second));
+    }
+  }
+  std::sort(result.begin(), result.end(),
+            [](const auto& a, const auto& b) { return a.user < b.user; });
+  return result;
+}
@@ -0,0 +1,154 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * \class TokenBucket
+ *
+ *
+ * \brief Lock free token bucket: rate tokens per second, burst of one second.
+ *
+ * Tokens are kept in millionths, so a refill by elapsed microseconds is
+ * exact. A request is admitted while the bucket has a whole token and then
+ * its whole cost is taken, so the bucket can go into debt: a large request
+ * is not starved, the following ones wait until the debt is repaid.
+ */
+class TokenBucket {
+ public:
+  /** \brief Refills the bucket and checks whether it has tokens.
+   * \param rate tokens per second, 0 means unlimited
+   * \param now current time in microseconds (steady clock)
+   *
+   * \return false if the bucket has less than one token.
+   */
+  bool admit(uint64_t rate, int64_t now);
+
+  /// Takes tokens, the bucket may go into debt
+  void take(uint64_t tokens) {
+    tokens_.fetch_sub(int64_t(tokens) * SCALE, std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr int64_t SCALE = 1'000'000;  /// millionths of a token
+
+  std::atomic<int64_t> tokens_{0};
+  std::atomic<int64_t> refilled_{-1};  /// time of the last refill
+};
+
+/// Usage of one user, a copy of its counters
+struct UserUsage {
+  std::string user;
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t rejected;
+  uint64_t tables;
+  uint64_t records;
+};
+
+/**
+ * \struct UserStats
+ *
+ *
+ * \brief Counters and token buckets of one user.
+ *
+ * Counters are striped: a thread adds to its own cache line, usage() sums
+ * the stripes, so connections of one user on different workers do not
+ * share a contended counter. tables and records are refreshed by
+ * UserQuotas::set_owned.
+ */
+struct UserStats {
+  static const size_t STRIPES = 8;
+
+  struct alignas(64) Stripe {
+    std::atomic<uint64_t> ops{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> rejected{0};
+  };
+
+  explicit UserStats(std::string name) : user(std::move(name)) {}
+
+  /// Returns stripe of the calling thread
+  Stripe& stripe();
+
+  const std::string user;
+  TokenBucket ops_bucket;
+  TokenBucket bytes_bucket;
+  std::array<Stripe, STRIPES> stripes;
+  std::atomic<uint64_t> tables{0};   /// tables owned by the user
+  std::atomic<uint64_t> records{0};  /// records in these tables
+};
+
+/**
+ * \class UserQuotas
+ *
+ *
+ * \brief Per-user accounting and rate limits of requests.
+ *
+ * Users are kept in SHARDS maps by hash of the name, each with its own
+ * mutex, and are never removed, so a connection finds its user once and
+ * then works with counters and buckets of UserStats by pointer without any
+ * lock. Every request takes one token of the ops bucket and its request and
+ * response bytes from the bytes bucket. After MAX_USERS users, new names
+ * share one entry named "*".
+ */
+class UserQuotas {
+ public:
+  static const size_t SHARDS = 16;
+  static const size_t MAX_USERS = 100'000;
+
+  /** \brief Sets rate limits of every user.
+   * \param ops requests per second, 0 means unlimited
+   * \param bytes request and response bytes per second, 0 means unlimited
+   */
+  void set_rates(uint64_t ops, uint64_t bytes) {
+    ops_rate_ = ops;
+    bytes_rate_ = bytes;
+  }
+
+  /// Finds statistics of a user, creates them for a new one
+  UserStats& find(std::string_view user);
+
+  /** \brief Checks rate limits and counts a request.
+   * \param stats statistics of the user
+   * \param bytes size of the request
+   *
+   * \return false if the request is rejected, it is counted as rejected.
+   */
+  bool admit(UserStats& stats, size_t bytes);
+
+  /// Counts bytes of a response
+  void account(UserStats& stats, size_t bytes);
+
+  /** \brief Refreshes numbers of tables and records owned by users.
+   * \param owned tables and records by user name
+   *
+   * Users missing in owned have no tables now.
+   */
+  void set_owned(
+      const std::unordered_map<std::string, std::pair<uint64_t, uint64_t>>&
+          owned);
+
+  /// Returns usage of all users, sorted by name
+  std::vector<UserUsage> usage() const;
+
+  /// Returns usage of one user, sums its stripes without any lock
+  static UserUsage usage(const UserStats& stats);
+
+ private:
+  struct Shard {
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, std::unique_ptr<UserStats>> users;
+  };
+
+  std::array<Shard, SHARDS> shards_;
+  std::atomic<size_t> users_{0};
+  uint64_t ops_rate_ = 0;
+  uint64_t bytes_rate_ = 0;
+};
@@ -0,0 +1,298 @@
+#include "HashReplica.h"
+#include "HashPubSub.h"
+#include "HashTracking.h"
+
+#include <sstream>
+
+std::vector<boost::weak_ptr<con_handler>> replicas;
+
+/// Table of a follower: no limits, segments are the follower's own
+static Table follower_table(const std::string& username, bool valid) {
+  size_t segments = table_segments ? table_segments : 1;
+  return {username,
+          TableMap(0, 0, EvictionPolicy::LRU, 0, segments),
+          valid,
+          std::vector<HotKeys>(segments),
+          !table_segments,
+          &user_quotas.find(username)};
+}
+
+std::string snapshot_record(size_t ntables) {
+  return "snapshot " + std::to_string(ntables) + "\n";
+}
+
+std::string table_record(size_t table_num) {
+  std::ostringstream contents;
+  Table& table = tables[table_num];
+  if (table.valid) {
+    con_handler::dump_segments(table.hash_map, contents);
+  }
+  std::string bytes = contents.str();
+  return "table " + std::to_string(table_num) + " " +
+         std::to_string(int(table.valid)) + " " + table.username + " " +
+         std::to_string(bytes.size()) + "\n" + bytes;
+}
+
+void replicate(std::string record) {
+  for (auto it = replicas.begin(); it != replicas.end();) {
+    if (auto replica = it->lock()) {
+      replica->post_replica_record(record);
+      it++;
+    } else {
+      it = replicas.erase(it);  // follower disconnected
+    }
+  }
+}
+
+void replicate_key(size_t table_num, const std::string& key) {
+  if (replicas.empty()) {
+    return;
+  }
+  auto state = tables[table_num].hash_map.peek(key);
+  if (!state) {
+    replicate("del " + std::to_string(table_num) + " " +
+              std::to_string(key.size()) + "\n" + key);
+    return;
+  }
+  replicate("set " + std::to_string(table_num) + " " +
+            std::to_string(int64_t(state->second)) + " " +
+            std::to_string(key.size()) + " " +
+            std::to_string(state->first.size()) + "\n" + key + state->first);
+}
+
+void replicate_eviction(size_t table_num, const SmallKey& key) {
+  if (replicas.empty()) {
+    return;
+  }
+  std::string_view view = key.view();
+  replicate("del " + std::to_string(table_num) + " " +
+            std::to_string(view.size()) + "\n" + std::string(view));
+}
+
+ReplicaClient::ptr_to_client ReplicaClient::create(
+    boost::asio::io_context& io_context, const std::string& primary) {
+  size_t colon = primary.rfind(':');
+  if (colon == std::string::npos) {
+    throw std::invalid_argument("primary address must be ip:port");
+  }
+  tcp::endpoint endpoint(
+      boost::asio::ip::address::from_string(primary.substr(0, colon)),
+      std::stoi(primary.substr(colon + 1)));
+  return ptr_to_client(new ReplicaClient(io_context, endpoint));
+}
+
+void ReplicaClient::start() {
+  if (VERBOSE) {
+    cout << "Connecting to the primary " << primary_ << endl;
+  }
+  socket_.async_connect(
+      primary_, boost::bind(&ReplicaClient::handle_connect, shared_from_this(),
+                            boost::asio::placeholders::error));
+}
+
+void ReplicaClient::handle_connect(const boost::system::error_code& err) {
+  if (err) {
+    reconnect(err);
+    return;
+  }
+  boost::asio::async_write(
+      socket_, boost::asio::buffer(request_),
+      [self = shared_from_this()](const boost::system::error_code& write_err,
+                                  size_t) {
+        if (write_err) {
+          self->reconnect(write_err);
+        } else {
+          self->read_record();
+        }
+      });
+}
+
+void ReplicaClient::read_record() {
+  boost::asio::async_read_until(
+      socket_, buffer_, '\n',
+      boost::bind(&ReplicaClient::handle_header, shared_from_this(),
+                  boost::asio::placeholders::error,
+                  boost::asio::placeholders::bytes_transferred));
+}
+
+void ReplicaClient::handle_header(const boost::system::error_code& err,
+                                  size_t bytes) {
+  if (err) {
+    reconnect(err);
+    return;
+  }
+  // streambuf keeps its input sequence in one contiguous buffer
+  const char* data = static_cast<const char*>(buffer_.data().data());
+  header_.assign(data, bytes - 1);
+  buffer_.consume(bytes);
+
+  // payload size is the sum of the sizes at the end of the header
+  std::istringstream ss(header_);
+  std::string command, field;
+  ss >> command;
+  std::vector<std::string> fields;
+  while (ss >> field) {
+    fields.push_back(field);
+  }
+  payload_size_ = 0;
+  try {
+    if (command == "set" && fields.size() == 4) {
+      payload_size_ = std::stoull(fields[2]) + std::stoull(fields[3]);
+    } else if ((command == "del" && fields.size() == 2) ||
+               (command == "table" && fields.size() == 4)) {
+      payload_size_ = std::stoull(fields.back());
+    }
+  } catch (std::exception&) {
+    reconnect(boost::asio::error::invalid_argument);
+    return;
+  }
+
+  if (buffer_.size() >= payload_size_) {
+    handle_payload(boost::system::error_code());
+    return;
+  }
+  boost::asio::async_read(
+      socket_, buffer_,
+      boost::asio::transfer_exactly(payload_size_ - buffer_.size()),
+      boost::bind(&ReplicaClient::handle_payload, shared_from_this(),
+                  boost::asio::placeholders::error));
+}
+
+void ReplicaClient::handle_payload(const boost::system::error_code& err) {
+  if (err) {
+    reconnect(err);
+    return;
+  }
+  const char* data = static_cast<const char*>(buffer_.data().data());
+  std::string payload(data, payload_size_);
+  buffer_.consume(payload_size_);
+  if (!apply(header_, payload)) {
+    reconnect(boost::asio::error::invalid_argument);
+    return;
+  }
+  read_record();
+}
+
+bool ReplicaClient::apply(const std::string& header,
+                          const std::string& payload) {
+  std::istringstream ss(header);
+  std::string command;
+  ss >> command;
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << "Applying replication record: " << header << endl;
+  }
+  if (command == "snapshot") {
+    for (size_t index = 0; index < tables.size(); index++) {
+      invalidate_table(index, false);
+    }
+    tables.clear();
+    size = 0;
+    used_memory = 0;
+    return true;
+  }
+  if (command == "table") {
+    size_t table_num;
+    int valid;
+    std::string username;
+    ss >> table_num >> valid >> username;
+    if (!ss || table_num > tables.size()) {
+      return false;
+    }
+    if (table_num == tables.size()) {
+      tables.push_back(follower_table(username, false));
+      tables.back().hash_map.free_hash_map();
+    }
+    Table& table = tables[table_num];
+    if (table.valid) {
+      used_memory -= table.hash_map.memory_usage();
+      size--;
+    }
+    invalidate_table(table_num, false);
+    bool indexed = table.hash_map.has_index();  // the index is local
+    table.username = username;
+    table.owner = &user_quotas.find(username);
+    table.valid = valid;
+    table.hash_map =
+        TableMap(0, 0, EvictionPolicy::LRU, 0, table.hash_map.segments());
+    if (!valid) {
+      table.hash_map.free_hash_map();
+      publish_table(table_num, true);
+      return true;
+    }
+    std::istringstream contents(payload);
+    bool loaded = table.hash_map.load(contents).has_value();
+    if (indexed) {
+      table.hash_map.enable_index();
+    }
+    used_memory += table.hash_map.memory_usage();
+    size++;
+    publish_table(table_num, false);
+    return loaded;
+  }
+  if (command == "addtable") {
+    std::string username;
+    ss >> username;
+    tables.push_back(follower_table(username, true));
+    used_memory += tables.back().hash_map.memory_usage();
+    size++;
+    return true;
+  }
+
+  size_t table_num;
+  ss >> table_num;
+  if (!ss || table_num >= tables.size()) {
+    return false;
+  }
+  Table& table = tables[table_num];
+  if (command == "remtable") {
+    if (table.valid) {
+      table.valid = false;
+      used_memory -= table.hash_map.memory_usage();
+      table.hash_map.free_hash_map();
+      size--;
+    }
+    invalidate_table(table_num, true);
+    publish_table(table_num, true);
+    return true;
+  }
+  if (!table.valid) {
+    return true;  // a change of a table that was removed after it
+  }
+  size_t before = table.hash_map.memory_usage();
+  if (command == "set") {
+    int64_t expires;
+    size_t key_size;
+    ss >> expires >> key_size;
+    if (!ss || key_size > payload.size()) {
+      return false;
+    }
+    table.hash_map.put_until(payload.substr(0, key_size),
+                             payload.substr(key_size), time_t(expires));
+    invalidate_key(table_num, std::string_view(payload).substr(0, key_size));
+    publish_key(table_num, std::string_view(payload).substr(0, key_size));
+  } else if (command == "del") {
+    table.hash_map.remove(payload);
+    invalidate_key(table_num, payload);
+    publish_key(table_num, payload);
+  } else {
+    return false;
+  }
+  con_handler::update_used_memory(before, table.hash_map.memory_usage());
+  return true;
+}
+
+void ReplicaClient::reconnect(const boost::system::error_code& err) {
+  std::cerr << "error: replication from " << primary_
+            << " failed: " << err.message() << endl;
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+  buffer_.consume(buffer_.size());
+  timer_.expires_after(std::chrono::seconds(RECONNECT_INTERVAL));
+  timer_.async_wait([self = shared_from_this()](
+                        const boost::system::error_code& timer_err) {
+    if (!timer_err) {
+      self->start();
+    }
+  });
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HashServer.h"
+
+/*
+    Replication stream from a primary to its followers.
+
+    Every record is a header line and a payload of the size given by the
+    header (numbers are decimal):
+    snapshot <ntables>          - follower drops all its tables
+    table <no> <valid> <user> <bytes>
+                                - contents of a table in HashMap::dump format
+    addtable <user>             - a new table
+    remtable <no>               - table removed
+    set <no> <expires> <key_size> <value_size>
+                                - key and value, expires is unix time
+    del <no> <key_size>         - key removed (evicted or did not fit)
+
+    A follower sends "<user> replicate" line and gets snapshot and table
+    records of all tables, then records of every change. Table records are
+    copied one by one while the server serves other requests; changes made
+    meanwhile are sent after the last table record, so a change already in
+    a table record is sent again and the follower ends with the latest
+    state. Expired records are not sent: the follower expires them by
+    itself.
+*/
+
+/// Connections of followers, guarded by mutex_ and notify_mutex
+extern std::vector<boost::weak_ptr<con_handler>> replicas;
+
+/** \brief Builds snapshot record, table records of the tables follow it.
+ * \param ntables number of tables
+ */
+std::string snapshot_record(size_t ntables);
+
+/** \brief Builds table record with all contents of a table.
+ * \param table_num table unique number
+ *
+ * Segments of the table are copied one by one under their mutexes.
+ *
+ * \warning this finction must be called under mutex lock
+ */
+std::string table_record(size_t table_num);
+
+/** \brief Sends a record to all followers.
+ * \param record replication record
+ *
+ * Records are queued in followers' connections in the order of calls.
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void replicate(std::string record);
+
+/** \brief Sends current state of a key (set or del record) to all followers.
+ * \param table_num table unique number
+ * \param key changed key
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void replicate_key(size_t table_num, const std::string& key);
+
+/** \brief Sends del record of an evicted key to all followers.
+ * \param table_num table unique number
+ * \param key evicted key
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void replicate_eviction(size_t table_num, const SmallKey& key);
+
+/**
+ * \class ReplicaClient
+ *
+ *
+ * \brief Connects a follower to its primary and applies replication stream.
+ *
+ * Reads records one by one and applies them to tables under mutex_. Tables
+ * of a follower have no limits of their own: the primary sends evictions.
+ * When the connection is lost, the client reconnects every
+ * RECONNECT_INTERVAL seconds and gets a new snapshot. Until then the
+ * follower keeps serving reads of its tables.
+ */
+class ReplicaClient : public boost::enable_shared_from_this<ReplicaClient> {
+ public:
+  using ptr_to_client = boost::shared_ptr<ReplicaClient>;
+
+  /**
+   * A static member function that creates pointer to the client
+   * \param io_context an io_context& argument.
+   * \param primary address of the primary in "ip:port" format
+   */
+  static ptr_to_client create(boost::asio::io_context& io_context,
+                              const std::string& primary);
+
+  /// starts connecting to the primary
+  void start();
+
+ private:
+  static constexpr size_t RECONNECT_INTERVAL = 1;  /// seconds
+  tcp::socket socket_;
+  boost::asio::steady_timer timer_;
+  tcp::endpoint primary_;
+  boost::asio::streambuf buffer_;
+  std::string header_;        /// header of the record being read
+  size_t payload_size_ = 0;   /// size of its payload
+  const std::string request_ = "replica replicate\n";
+
+  ReplicaClient(boost::asio::io_context& io_context, tcp::endpoint primary)
+      : socket_(io_context), timer_(io_context), primary_(primary) {}
+
+  /// Invokes after connection to the primary, sends replicate request
+  void handle_connect(const boost::system::error_code& err);
+
+  /// Starts reading of the next record header
+  void read_record();
+
+  /// Invokes after the header is read, reads the payload
+  void handle_header(const boost::system::error_code& err, size_t bytes);
+
+  /// Invokes after the payload is read, applies the record
+  void handle_payload(const boost::system::error_code& err);
+
+  /** \brief Applies a record to tables.
+   * \param header header line of the record
+   * \param payload payload of the record
+   *
+   * \return false if the record cannot be parsed.
+   */
+  bool apply(const std::string& header, const std::string& payload);
+
+  /// Closes the socket and connects again after RECONNECT_INTERVAL
+  void reconnect(const boost::system::error_code& err);
+};
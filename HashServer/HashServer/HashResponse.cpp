@@ -0,0 +1,93 @@
+#include "HashResponse.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+void ResponseBuffer::append(std::string_view bytes) { copy(bytes, false); }
+
+void ResponseBuffer::append(std::string&& bytes) {
+  if (bytes.size() < CHUNK_SIZE) {
+    copy(bytes, false);
+    return;
+  }
+  Piece piece;
+  piece.end = bytes.size();
+  piece.owned = std::move(bytes);
+  size_ += piece.end;
+  pieces_.push_back(std::move(piece));
+}
+
+void ResponseBuffer::append_number(int64_t value) {
+  char digits[24];
+  auto end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+  copy(std::string_view(digits, end - digits), false);
+}
+
+void ResponseBuffer::append_line(std::string_view response) {
+  copy(response, true);
+}
+
+void ResponseBuffer::append_line(std::string&& response) {
+  if (response.size() < CHUNK_SIZE) {
+    copy(response, true);
+    return;
+  }
+  std::replace(response.begin(), response.end(), '\n', ' ');
+  append(std::move(response));
+}
+
+void ResponseBuffer::consume(size_t bytes) {
+  size_ -= bytes;
+  size_t done = 0;
+  for (; done < pieces_.size(); done++) {
+    Piece& piece = pieces_[done];
+    size_t n = std::min(bytes, piece.end - piece.begin);
+    piece.begin += n;
+    bytes -= n;
+    if (piece.begin < piece.end) {
+      break;
+    }
+  }
+  // the last chunk stays for the next responses
+  if (done && done == pieces_.size() && pieces_.back().chunk) {
+    pieces_.back().begin = pieces_.back().end = 0;
+    done--;
+  }
+  for (size_t i = 0; i < done; i++) {
+    if (pieces_[i].chunk && pool_.size() < MAX_POOLED) {
+      pool_.push_back(std::move(pieces_[i].chunk));
+    }
+  }
+  pieces_.erase(pieces_.begin(), pieces_.begin() + done);
+}
+
+void ResponseBuffer::copy(std::string_view bytes, bool line) {
+  while (!bytes.empty()) {
+    Piece& piece = tail();
+    size_t n = std::min(CHUNK_SIZE - piece.end, bytes.size());
+    char* target = piece.chunk.get() + piece.end;
+    memcpy(target, bytes.data(), n);
+    if (line) {
+      std::replace(target, target + n, '\n', ' ');
+    }
+    piece.end += n;
+    size_ += n;
+    bytes.remove_prefix(n);
+  }
+}
+
+ResponseBuffer::Piece& ResponseBuffer::tail() {
+  if (pieces_.empty() || !pieces_.back().chunk ||
+      pieces_.back().end == CHUNK_SIZE) {
+    Piece piece;
+    if (pool_.empty()) {
+      piece.chunk.reset(new char[CHUNK_SIZE]);
+    } else {
+      piece.chunk = std::move(pool_.back());
+      pool_.pop_back();
+    }
+    pieces_.push_back(std::move(piece));
+  }
+  return pieces_.back();
+}
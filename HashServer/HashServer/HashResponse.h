@@ -0,0 +1,98 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * \class ResponseBuffer
+ *
+ *
+ * \brief Output queue of one connection built of pooled chunks.
+ *
+ * Responses are formatted straight into fixed size chunks, so short
+ * responses cost no allocation once the connection has its chunks: written
+ * chunks go back to a small pool of the buffer and are reused. A long
+ * string (a table, a replication record) is moved in as a piece of its own
+ * and written without a copy.
+ *
+ * Unsent bytes are passed to a gather write by gather, the bytes stay in
+ * the buffer until consume, so appending during the write is allowed.
+ */
+class ResponseBuffer {
+ public:
+  static constexpr size_t CHUNK_SIZE = 4096;
+  static constexpr size_t MAX_POOLED = 2;  /// spare chunks kept for reuse
+
+  /// Copies bytes to the end of the buffer
+  void append(std::string_view bytes);
+
+  void append(const char* bytes) { append(std::string_view(bytes)); }
+
+  /// Appends a string, a long one is moved in without a copy
+  void append(std::string&& bytes);
+
+  /// Appends a decimal number
+  void append_number(int64_t value);
+
+  /// Copies a response as one line: line feeds become spaces
+  void append_line(std::string_view response);
+
+  void append_line(const char* response) {
+    append_line(std::string_view(response));
+  }
+
+  /// Appends a response as one line, a long one is moved in without a copy
+  void append_line(std::string&& response);
+
+  /// Returns number of bytes not written yet
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  /** \brief Passes unsent bytes to a gather write.
+   * \param max max number of pieces
+   * \param add function that takes (const char* data, size_t size)
+   *
+   * Pieces stay valid until they are consumed.
+   *
+   * \return number of bytes passed.
+   */
+  template <typename F>
+  size_t gather(size_t max, F add) const {
+    size_t bytes = 0;
+    for (size_t i = 0; i < pieces_.size() && i < max; i++) {
+      const Piece& piece = pieces_[i];
+      if (piece.end > piece.begin) {
+        add(piece.data() + piece.begin, piece.end - piece.begin);
+        bytes += piece.end - piece.begin;
+      }
+    }
+    return bytes;
+  }
+
+  /// Drops written bytes from the front, their chunks return to the pool
+  void consume(size_t bytes);
+
+ private:
+  /// Part of the buffer: a pooled chunk or a long string moved in
+  struct Piece {
+    std::unique_ptr<char[]> chunk;
+    std::string owned;
+    size_t begin = 0;  /// first byte not written
+    size_t end = 0;    /// end of bytes
+
+    const char* data() const { return chunk ? chunk.get() : owned.data(); }
+  };
+
+  /// Copies bytes to chunks, replaces line feeds if line is true
+  void copy(std::string_view bytes, bool line);
+
+  /// Returns the chunk at the end with free space, takes a new one if full
+  Piece& tail();
+
+  std::vector<Piece> pieces_;
+  std::vector<std::unique_ptr<char[]>> pool_;
+  size_t size_ = 0;
+};
@@ -0,0 +1,716 @@
+#include "HashScript.h"
+
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <map>
+
+#include "HashSegments.h"
+
+/// Value of a script expression
+struct Script::Value {
+  enum class Type { NIL, NUMBER, STRING };
+  Type type = Type::NIL;
+  int64_t number = 0;
+  std::string text;
+
+  static Value of(int64_t number) {
+    Value value;
+    value.type = Type::NUMBER;
+    value.number = number;
+    return value;
+  }
+
+  static Value of(std::string text) {
+    Value value;
+    value.type = Type::STRING;
+    value.text = std::move(text);
+    return value;
+  }
+
+  bool is_true() const {
+    return type == Type::STRING || (type == Type::NUMBER && number != 0);
+  }
+
+  /// Number of the value, nullopt if it is not an integer
+  std::optional<int64_t> integer() const {
+    if (type == Type::NUMBER) {
+      return number;
+    }
+    int64_t result;
+    const char* end = text.data() + text.size();
+    if (type == Type::STRING && !text.empty() &&
+        std::from_chars(text.data(), end, result).ptr == end) {
+      return result;
+    }
+    return std::nullopt;
+  }
+
+  std::string str() const {
+    return type == Type::NUMBER ? std::to_string(number) : text;
+  }
+};
+
+/**
+ * \class Script::Compiler
+ *
+ *
+ * \brief Recursive descent compiler of a script into bytecode.
+ */
+class Script::Compiler {
+ public:
+  explicit Compiler(Script& script) : script_(script) {
+    tokenize(script.source_);
+  }
+
+  void compile() {
+    block();
+    if (!at_end()) {
+      error("unexpected '" + peek().text + "'");
+    }
+    emit(Op::NIL);
+    emit(Op::RETURN);
+    script_.variables_ = variables_.size();
+  }
+
+ private:
+  enum class Kind { NAME, NUMBER, STRING, ARG, SYMBOL, END };
+
+  struct Token {
+    Kind kind;
+    std::string text;
+  };
+
+  struct FunctionInfo {
+    Function function;
+    uint8_t min_args;
+    uint8_t max_args;
+    bool writes;
+  };
+
+  /// Limits recursion of nested expressions and blocks
+  class Nesting {
+   public:
+    explicit Nesting(Compiler& compiler) : compiler_(compiler) {
+      if (++compiler_.depth_ > MAX_DEPTH) {
+        compiler_.error("too deep nesting");
+      }
+    }
+    ~Nesting() { compiler_.depth_--; }
+
+   private:
+    Compiler& compiler_;
+  };
+
+  Script& script_;
+  std::vector<Token> tokens_;
+  size_t pos_ = 0;
+  size_t depth_ = 0;
+  std::map<std::string, uint32_t> variables_;
+
+  [[noreturn]] void error(const std::string& message) {
+    throw ScriptError(message);
+  }
+
+  void tokenize(const std::string& source) {
+    static const char* const SYMBOLS[] = {"..", "==", "~=", "!=", "<=", ">=",
+                                          "+",  "-",  "*",  "/",  "%",  "<",
+                                          ">",  "=",  "(",  ")",  ",",  ";"};
+    for (size_t i = 0; i < source.size();) {
+      char c = source[i];
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        i++;
+      } else if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+        size_t begin = i;
+        while (i < source.size() &&
+               (std::isalnum(static_cast<unsigned char>(source[i])) ||
+                source[i] == '_')) {
+          i++;
+        }
+        tokens_.push_back({Kind::NAME, source.substr(begin, i - begin)});
+      } else if (std::isdigit(static_cast<unsigned char>(c)) || c == '$') {
+        size_t begin = c == '$' ? ++i : i;
+        while (i < source.size() &&
+               std::isdigit(static_cast<unsigned char>(source[i]))) {
+          i++;
+        }
+        if (i == begin) {
+          error("argument number expected after '$'");
+        }
+        tokens_.push_back({c == '$' ? Kind::ARG : Kind::NUMBER,
+                           source.substr(begin, i - begin)});
+      } else if (c == '\'' || c == '"') {
+        std::string text;
+        for (i++; i < source.size() && source[i] != c; i++) {
+          if (source[i] == '\\' && i + 1 < source.size()) {
+            i++;  // escaped quote or backslash
+          }
+          text += source[i];
+        }
+        if (i == source.size()) {
+          error("unfinished string");
+        }
+        i++;
+        tokens_.push_back({Kind::STRING, std::move(text)});
+      } else {
+        bool found = false;
+        for (const char* symbol : SYMBOLS) {
+          size_t length = std::char_traits<char>::length(symbol);
+          if (source.compare(i, length, symbol) == 0) {
+            tokens_.push_back({Kind::SYMBOL, symbol});
+            i += length;
+            found = true;
+            break;
+          }
+        }
+        if (!found) {
+          error(std::string("unexpected character '") + c + "'");
+        }
+      }
+    }
+  }
+
+  const Token& peek(size_t ahead = 0) const {
+    static const Token END{Kind::END, "end of script"};
+    return pos_ + ahead < tokens_.size() ? tokens_[pos_ + ahead] : END;
+  }
+
+  bool at_end() const { return pos_ == tokens_.size(); }
+
+  /// Checks whether the next token is a symbol or a keyword
+  bool is(const std::string& text, size_t ahead = 0) const {
+    const Token& token = peek(ahead);
+    return (token.kind == Kind::SYMBOL || token.kind == Kind::NAME) &&
+           token.text == text;
+  }
+
+  bool accept(const std::string& text) {
+    if (is(text)) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  void expect(const std::string& text) {
+    if (!accept(text)) {
+      error("'" + text + "' expected instead of '" + peek().text + "'");
+    }
+  }
+
+  static bool is_keyword(const std::string& name) {
+    static const char* const KEYWORDS[] = {"if",  "then", "else", "end",
+                                           "and", "or",   "not",  "nil",
+                                           "return"};
+    for (const char* keyword : KEYWORDS) {
+      if (name == keyword) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static const FunctionInfo* function_info(const std::string& name) {
+    static const std::map<std::string, FunctionInfo> FUNCTIONS = {
+        {"get", {Function::GET, 1, 1, false}},
+        {"exists", {Function::EXISTS, 1, 1, false}},
+        {"ttl", {Function::TTL, 1, 1, false}},
+        {"set", {Function::SET, 2, 3, true}},
+        {"del", {Function::DEL, 1, 1, true}},
+        {"incr", {Function::INCR, 2, 3, true}},
+        {"expire", {Function::EXPIRE, 2, 2, true}},
+        {"len", {Function::LEN, 1, 1, false}}};
+    auto it = FUNCTIONS.find(name);
+    return it == FUNCTIONS.end() ? nullptr : &it->second;
+  }
+
+  size_t emit(Op op, uint32_t arg = 0, uint8_t argc = 0) {
+    script_.code_.push_back({op, argc, arg});
+    return script_.code_.size() - 1;
+  }
+
+  /// Makes a jump go to the next instruction
+  void patch(size_t jump) {
+    script_.code_[jump].arg = uint32_t(script_.code_.size());
+  }
+
+  void block() {
+    Nesting nesting(*this);
+    while (!at_end() && !is("end") && !is("else")) {
+      statement();
+      accept(";");
+    }
+  }
+
+  void statement() {
+    if (accept("if")) {
+      expression();
+      size_t to_else = emit(Op::JUMP_IF_FALSE);
+      expect("then");
+      block();
+      if (accept("else")) {
+        size_t to_end = emit(Op::JUMP);
+        patch(to_else);
+        block();
+        patch(to_end);
+      } else {
+        patch(to_else);
+      }
+      expect("end");
+    } else if (accept("return")) {
+      if (at_end() || is(";") || is("end") || is("else")) {
+        emit(Op::NIL);
+      } else {
+        expression();
+      }
+      emit(Op::RETURN);
+    } else if (peek().kind == Kind::NAME && is("=", 1)) {
+      std::string name = peek().text;
+      if (is_keyword(name) || function_info(name)) {
+        error("'" + name + "' cannot be assigned");
+      }
+      pos_ += 2;
+      expression();
+      auto it = variables_.find(name);
+      if (it == variables_.end()) {
+        if (variables_.size() == MAX_VARIABLES) {
+          error("too many variables");
+        }
+        it = variables_.emplace(name, uint32_t(variables_.size())).first;
+      }
+      emit(Op::STORE, it->second);
+    } else {
+      expression();
+      emit(Op::POP);
+    }
+  }
+
+  void expression() {
+    Nesting nesting(*this);
+    logic_or();
+  }
+
+  void logic_or() {
+    logic_and();
+    while (accept("or")) {  // keeps the first true value
+      size_t to_end = emit(Op::OR);
+      logic_and();
+      patch(to_end);
+    }
+  }
+
+  void logic_and() {
+    comparison();
+    while (accept("and")) {  // keeps the first false value
+      size_t to_end = emit(Op::AND);
+      comparison();
+      patch(to_end);
+    }
+  }
+
+  void comparison() {
+    static const std::pair<const char*, Op> OPERATORS[] = {
+        {"==", Op::EQ}, {"~=", Op::NE}, {"!=", Op::NE}, {"<=", Op::LE},
+        {">=", Op::GE}, {"<", Op::LT},  {">", Op::GT}};
+    concatenation();
+    for (const auto& [symbol, op] : OPERATORS) {
+      if (accept(symbol)) {
+        concatenation();
+        emit(op);
+        return;
+      }
+    }
+  }
+
+  void concatenation() {
+    sum();
+    while (accept("..")) {
+      sum();
+      emit(Op::CONCAT);
+    }
+  }
+
+  void sum() {
+    product();
+    while (is("+") || is("-")) {
+      Op op = accept("+") ? Op::ADD : (pos_++, Op::SUB);
+      product();
+      emit(op);
+    }
+  }
+
+  void product() {
+    unary();
+    while (is("*") || is("/") || is("%")) {
+      Op op = accept("*") ? Op::MUL : accept("/") ? Op::DIV : (pos_++, Op::MOD);
+      unary();
+      emit(op);
+    }
+  }
+
+  void unary() {
+    Nesting nesting(*this);
+    if (accept("-")) {
+      unary();
+      emit(Op::NEG);
+    } else if (accept("not")) {
+      unary();
+      emit(Op::NOT);
+    } else {
+      primary();
+    }
+  }
+
+  void primary() {
+    Token token = peek();
+    if (token.kind == Kind::END) {
+      error("expression expected");
+    }
+    pos_++;
+    if (token.kind == Kind::NUMBER) {
+      int64_t number;
+      const char* end = token.text.data() + token.text.size();
+      if (std::from_chars(token.text.data(), end, number).ptr != end) {
+        error("number " + token.text + " is too large");
+      }
+      script_.numbers_.push_back(number);
+      emit(Op::NUMBER, uint32_t(script_.numbers_.size() - 1));
+    } else if (token.kind == Kind::STRING) {
+      script_.strings_.push_back(token.text);
+      emit(Op::STRING, uint32_t(script_.strings_.size() - 1));
+    } else if (token.kind == Kind::ARG) {
+      unsigned long arg = std::stoul(token.text);
+      if (arg == 0 || arg > UINT32_MAX) {
+        error("wrong argument $" + token.text);
+      }
+      emit(Op::ARG, uint32_t(arg - 1));
+    } else if (token.kind == Kind::SYMBOL && token.text == "(") {
+      expression();
+      expect(")");
+    } else if (token.kind == Kind::NAME && token.text == "nil") {
+      emit(Op::NIL);
+    } else if (token.kind == Kind::NAME && is("(")) {
+      call(token.text);
+    } else if (token.kind == Kind::NAME && !is_keyword(token.text)) {
+      auto it = variables_.find(token.text);
+      if (it == variables_.end()) {
+        error("unknown variable '" + token.text + "'");
+      }
+      emit(Op::LOAD, it->second);
+    } else {
+      error("unexpected '" + token.text + "'");
+    }
+  }
+
+  void call(const std::string& name) {
+    const FunctionInfo* info = function_info(name);
+    if (!info) {
+      error("unknown function '" + name + "'");
+    }
+    expect("(");
+    uint8_t argc = 0;
+    if (!accept(")")) {
+      do {
+        expression();
+        argc++;
+      } while (argc <= info->max_args && accept(","));
+      expect(")");
+    }
+    if (argc < info->min_args || argc > info->max_args) {
+      error("wrong number of arguments of '" + name + "'");
+    }
+    script_.writes_ |= info->writes;
+    emit(Op::CALL, uint32_t(info->function), argc);
+  }
+};
+
+Script::Script(const std::string& source) : source_(source) {
+  Compiler(*this).compile();
+}
+
+std::string Script::id(const std::string& source) {
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx",
+                (unsigned long long)wyhash::hash(source.data(), source.size()));
+  return hex;
+}
+
+template <typename Map>
+std::optional<std::string> Script::run(Map& hash_map,
+                                       const std::vector<std::string>& args,
+                                       const ChangeListener& changed) const {
+  std::vector<Value> stack;
+  std::vector<Value> variables(variables_);
+  auto pop = [&stack]() {
+    Value value = std::move(stack.back());
+    stack.pop_back();
+    return value;
+  };
+  auto integer = [](const Value& value) {
+    auto number = value.integer();
+    if (!number) {
+      throw ScriptError("'" + value.str() + "' is not a number");
+    }
+    return *number;
+  };
+  auto text = [](const Value& value) {
+    if (value.type == Value::Type::NIL) {
+      throw ScriptError("nil is not a string");
+    }
+    return value.str();
+  };
+  auto ttl_of = [&integer](const Value& value) {
+    int64_t ttl = integer(value);
+    if (ttl < 0) {
+      throw ScriptError("ttl must not be negative");
+    }
+    return size_t(ttl);
+  };
+  // -1, 0 or 1, integers are compared as numbers, other values as strings
+  auto compare = [&text](const Value& a, const Value& b) {
+    auto x = a.integer(), y = b.integer();
+    if (x && y) {
+      return *x < *y ? -1 : *x > *y;
+    }
+    int result = text(a).compare(text(b));
+    return result < 0 ? -1 : result > 0;
+  };
+
+  for (size_t pc = 0; pc < code_.size();) {
+    const Instruction& instruction = code_[pc++];
+    switch (instruction.op) {
+      case Op::STRING:
+        stack.push_back(Value::of(strings_[instruction.arg]));
+        break;
+      case Op::NUMBER:
+        stack.push_back(Value::of(numbers_[instruction.arg]));
+        break;
+      case Op::NIL:
+        stack.emplace_back();
+        break;
+      case Op::LOAD:
+        stack.push_back(variables[instruction.arg]);
+        break;
+      case Op::STORE:
+        variables[instruction.arg] = pop();
+        break;
+      case Op::ARG:
+        if (instruction.arg < args.size()) {
+          stack.push_back(Value::of(args[instruction.arg]));
+        } else {
+          stack.emplace_back();
+        }
+        break;
+      case Op::POP:
+        stack.pop_back();
+        break;
+      case Op::CALL: {
+        std::vector<Value> call_args(stack.end() - instruction.argc,
+                                     stack.end());
+        stack.resize(stack.size() - instruction.argc);
+        Value result;
+        switch (Function(instruction.arg)) {
+          case Function::GET: {
+            auto value = hash_map.get(text(call_args[0]));
+            if (value) {
+              result = Value::of(std::move(*value));
+            }
+            break;
+          }
+          case Function::EXISTS:
+            result = Value::of(
+                int64_t(hash_map.peek(text(call_args[0])).has_value()));
+            break;
+          case Function::TTL: {
+            auto ttl = hash_map.ttl(text(call_args[0]));
+            if (ttl) {
+              result = Value::of(*ttl);
+            }
+            break;
+          }
+          case Function::SET: {
+            std::string key = text(call_args[0]);
+            bool stored =
+                call_args.size() == 3
+                    ? hash_map.put(key, text(call_args[1]), ttl_of(call_args[2]))
+                    : hash_map.put_until(key, text(call_args[1]), Map::NEVER);
+            changed(key);
+            result = Value::of(int64_t(stored));
+            break;
+          }
+          case Function::DEL: {
+            std::string key = text(call_args[0]);
+            bool existed = hash_map.peek(key).has_value();
+            hash_map.remove(key);
+            if (existed) {
+              changed(key);
+            }
+            result = Value::of(int64_t(existed));
+            break;
+          }
+          case Function::INCR: {
+            std::string key = text(call_args[0]);
+            bool existed = hash_map.peek(key).has_value();
+            size_t ttl = call_args.size() == 3 ? ttl_of(call_args[2]) : 0;
+            auto value = hash_map.incr(key, integer(call_args[1]), ttl);
+            if (!value) {
+              throw ScriptError("value of '" + key + "' is not a number");
+            }
+            if (!existed && call_args.size() == 2) {
+              hash_map.persist(key);  // a new value without ttl never expires
+            }
+            changed(key);
+            result = Value::of(*value);
+            break;
+          }
+          case Function::EXPIRE: {
+            std::string key = text(call_args[0]);
+            bool found = hash_map.expire(key, ttl_of(call_args[1]));
+            if (found) {
+              changed(key);
+            }
+            result = Value::of(int64_t(found));
+            break;
+          }
+          case Function::LEN:
+            result = Value::of(int64_t(text(call_args[0]).size()));
+            break;
+        }
+        stack.push_back(std::move(result));
+        break;
+      }
+      case Op::ADD:
+      case Op::SUB:
+      case Op::MUL:
+      case Op::DIV:
+      case Op::MOD: {
+        int64_t b = integer(pop());
+        int64_t a = integer(pop());
+        // arithmetic wraps around instead of overflow
+        uint64_t x = uint64_t(a), y = uint64_t(b);
+        int64_t result;
+        if (instruction.op == Op::ADD) {
+          result = int64_t(x + y);
+        } else if (instruction.op == Op::SUB) {
+          result = int64_t(x - y);
+        } else if (instruction.op == Op::MUL) {
+          result = int64_t(x * y);
+        } else if (b == 0 || (a == INT64_MIN && b == -1)) {
+          throw ScriptError("division by zero or overflow");
+        } else {
+          result = instruction.op == Op::DIV ? a / b : a % b;
+        }
+        stack.push_back(Value::of(result));
+        break;
+      }
+      case Op::CONCAT: {
+        std::string b = text(pop());
+        std::string a = text(pop());
+        if (a.size() + b.size() > MAX_STRING) {
+          throw ScriptError("string is too long");
+        }
+        stack.push_back(Value::of(a + b));
+        break;
+      }
+      case Op::NEG:
+        stack.push_back(Value::of(int64_t(0 - uint64_t(integer(pop())))));
+        break;
+      case Op::NOT:
+        stack.push_back(Value::of(int64_t(!pop().is_true())));
+        break;
+      case Op::EQ:
+      case Op::NE: {
+        Value b = pop();
+        Value a = pop();
+        bool equal = a.type == Value::Type::NIL || b.type == Value::Type::NIL
+                         ? a.type == b.type
+                         : compare(a, b) == 0;
+        stack.push_back(Value::of(int64_t(equal == (instruction.op == Op::EQ))));
+        break;
+      }
+      case Op::LT:
+      case Op::LE:
+      case Op::GT:
+      case Op::GE: {
+        Value b = pop();
+        Value a = pop();
+        int order = compare(a, b);
+        bool result = instruction.op == Op::LT   ? order < 0
+                      : instruction.op == Op::LE ? order <= 0
+                      : instruction.op == Op::GT ? order > 0
+                                                 : order >= 0;
+        stack.push_back(Value::of(int64_t(result)));
+        break;
+      }
+      case Op::JUMP:
+        pc = instruction.arg;
+        break;
+      case Op::JUMP_IF_FALSE:
+        if (!pop().is_true()) {
+          pc = instruction.arg;
+        }
+        break;
+      case Op::AND:
+      case Op::OR:
+        if (stack.back().is_true() == (instruction.op == Op::OR)) {
+          pc = instruction.arg;  // the result is the first operand
+        } else {
+          stack.pop_back();
+        }
+        break;
+      case Op::RETURN: {
+        Value result = pop();
+        if (result.type == Value::Type::NIL) {
+          return std::nullopt;
+        }
+        return result.str();
+      }
+    }
+  }
+  return std::nullopt;
+}
+
+template std::optional<std::string> Script::run(
+    HashMap<SmallKey>&, const std::vector<std::string>&,
+    const ChangeListener&) const;
+template std::optional<std::string> Script::run(
+    SegmentedMap<SmallKey>&, const std::vector<std::string>&,
+    const ChangeListener&) const;
+
+std::shared_ptr<const Script> ScriptCache::load(const std::string& source) {
+  std::string script_id = Script::id(source);
+  auto cached = [this, &script_id, &source]() -> std::shared_ptr<const Script> {
+    auto found = scripts_.find(script_id);
+    if (found == scripts_.end()) {
+      return nullptr;
+    }
+    if (found->second->source() != source) {
+      throw ScriptError("id " + script_id + " is used by another script");
+    }
+    return found->second;
+  };
+  {
+    std::lock_guard<std::mutex> lg(mutex_);
+    if (auto script = cached()) {
+      return script;
+    }
+  }
+  auto script = std::make_shared<const Script>(source);
+  std::lock_guard<std::mutex> lg(mutex_);
+  if (auto other = cached()) {
+    return other;  // compiled by another thread meanwhile
+  }
+  if (scripts_.size() == MAX_SCRIPTS) {
+    scripts_.erase(order_.front());
+    order_.pop_front();
+  }
+  scripts_.emplace(script_id, script);
+  order_.push_back(script_id);
+  return script;
+}
+
+std::shared_ptr<const Script> ScriptCache::find(const std::string& id) const {
+  std::lock_guard<std::mutex> lg(mutex_);
+  auto found = scripts_.find(id);
+  return found == scripts_.end() ? nullptr : found->second;
+}
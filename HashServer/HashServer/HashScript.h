@@ -0,0 +1,145 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "HashKeys.h"
+#include "HashMap.h"
+
+/// Error of compilation or execution of a script
+class ScriptError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
+/**
+ * \class Script
+ *
+ *
+ * \brief Compiled script that reads and writes keys of one table.
+ *
+ * A script is a line of statements separated by optional ';':
+ *   name = expr                 - assigns a local variable
+ *   if expr then ... [else ...] end
+ *   return [expr]               - ends the script with its result
+ *   call(...)                   - calls a function, ignores its result
+ * Expressions have integer, string and nil values: literals (12, 'text',
+ * "text", nil), variables, arguments $1..$n, function calls, arithmetic
+ * (+ - * / %), concatenation (..), comparisons (== ~= != < <= > >=) and
+ * logic (and, or, not). Strings that hold integers are numbers in
+ * arithmetic. nil and 0 are false, other values are true.
+ * Functions: get(key), exists(key), ttl(key), set(key, value[, ttl]),
+ * del(key), incr(key, by[, ttl]), expire(key, ttl), len(value).
+ *
+ * The source is compiled once into bytecode of a stack machine. There are
+ * no loops, so every script ends after at most the number of its
+ * instructions. Scripts run under mutex lock, so they are atomic; writes
+ * done before a runtime error are kept.
+ */
+class Script {
+ public:
+  /// Called with every key the script has changed
+  using ChangeListener = std::function<void(const std::string&)>;
+
+  /** \brief Compiles a script.
+   * \param source text of the script
+   *
+   * Throws ScriptError if the script cannot be compiled.
+   */
+  explicit Script(const std::string& source);
+
+  /// Returns text of the script
+  const std::string& source() const { return source_; }
+
+  /// Returns true if the script can change the table
+  bool writes() const { return writes_; }
+
+  /** \brief Runs the script.
+   * \param hash_map table the script works with: HashMap<SmallKey> or
+   * SegmentedMap<SmallKey> (instantiated in HashScript.cpp)
+   * \param args values of $1..$n
+   * \param changed listener of changed keys
+   *
+   * Throws ScriptError on runtime errors (wrong types, division by zero).
+   *
+   * \return returned value, nullopt if the script returned nil or nothing.
+   */
+  template <typename Map>
+  std::optional<std::string> run(Map& hash_map,
+                                 const std::vector<std::string>& args,
+                                 const ChangeListener& changed) const;
+
+  /// Returns id of a script text (hex of its 64 bit hash)
+  static std::string id(const std::string& source);
+
+ private:
+  static constexpr size_t MAX_DEPTH = 64;       /// nesting of expressions
+  static constexpr size_t MAX_VARIABLES = 256;  /// local variables
+  static constexpr size_t MAX_STRING = 16 * 1024 * 1024;  /// bytes
+
+  enum class Op : uint8_t {
+    STRING, NUMBER, NIL, LOAD, STORE, ARG, CALL, POP,
+    ADD, SUB, MUL, DIV, MOD, CONCAT, NEG, NOT,
+    EQ, NE, LT, LE, GT, GE,
+    JUMP, JUMP_IF_FALSE, AND, OR, RETURN
+  };
+
+  enum class Function : uint8_t {
+    GET, EXISTS, TTL, SET, DEL, INCR, EXPIRE, LEN
+  };
+
+  struct Instruction {
+    Op op;
+    uint8_t argc;  /// arguments of CALL
+    uint32_t arg;  /// literal, variable, argument, function or jump target
+  };
+
+  struct Value;
+  class Compiler;
+
+  std::string source_;
+  std::vector<Instruction> code_;
+  std::vector<std::string> strings_;  /// string literals
+  std::vector<int64_t> numbers_;      /// integer literals
+  size_t variables_ = 0;
+  bool writes_ = false;
+};
+
+/**
+ * \class ScriptCache
+ *
+ *
+ * \brief Compiled scripts by their ids.
+ *
+ * Holds at most MAX_SCRIPTS scripts, the oldest one is dropped when it is
+ * full. Thread safe: the cache has its own mutex and a script is compiled
+ * outside of it, so eval of a cached script waits for no table lock.
+ */
+class ScriptCache {
+ public:
+  static const size_t MAX_SCRIPTS = 1000;
+
+  /** \brief Compiles a script or finds it compiled.
+   * \param source text of the script
+   *
+   * Throws ScriptError if the script cannot be compiled.
+   *
+   * \return compiled script, its id is Script::id(source).
+   */
+  std::shared_ptr<const Script> load(const std::string& source);
+
+  /// Finds a compiled script by id, returns nullptr if it is not cached
+  std::shared_ptr<const Script> find(const std::string& id) const;
+
+ private:
+  std::unordered_map<std::string, std::shared_ptr<const Script>> scripts_;
+  std::deque<std::string> order_;  /// ids, the oldest first
+  mutable std::mutex mutex_;       /// guards scripts_ and order_
+};
@@ -0,0 +1,322 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "HashMap.h"
+
+/**
+ * \class SegmentedMap
+ *
+ *
+ * \brief Hash map of one table split into independently locked segments.
+ *
+ * A key belongs to the segment selected by the low bits of its hash (the
+ * buckets of a segment are selected by the high bits, so keys of a segment
+ * still spread over all of its buckets). Every segment is a HashMap with
+ * its own mutex, so requests to different segments of one table can run in
+ * parallel. Limits of the table are divided among segments equally, buckets
+ * too: N segments together start with BASIC_SIZE buckets.
+ *
+ * Single key methods work with the segment of the key, the other ones with
+ * all segments. Number of segments is a power of two, split doubles it:
+ * every record moves either to the same segment or to the new one.
+ *
+ * \warning SegmentedMap does not lock anything itself: the caller either
+ * holds the table exclusively or holds mutex(segment_of(key)) while it
+ * works with a key
+ */
+template <typename Key, typename Hash = DefaultHash<Key>>
+class SegmentedMap {
+ public:
+  using Map = HashMap<Key, Hash>;
+
+  static constexpr size_t MAX_SEGMENTS = 64;
+  static constexpr time_t NEVER = Map::NEVER;
+
+  /// Creates a map of one segment without limits
+  SegmentedMap() : SegmentedMap(0, 0, EvictionPolicy::LRU) {}
+
+  /** \brief Creates a map.
+   * \param max_records max number of records (0 means unlimited)
+   * \param max_memory max memory in bytes (0 means unlimited)
+   * \param policy eviction policy
+   * \param compress_threshold min size of a value to compress (0 means never)
+   * \param segments number of segments, a power of two up to MAX_SEGMENTS
+   */
+  SegmentedMap(size_t max_records, size_t max_memory, EvictionPolicy policy,
+               size_t compress_threshold = 0, size_t segments = 1)
+      : max_records_(max_records),
+        max_memory_(max_memory),
+        policy_(policy),
+        compress_threshold_(compress_threshold) {
+    for (size_t i = 0; i < segments; i++) {
+      segments_.push_back(std::make_unique<Segment>(
+          share(max_records, segments), share(max_memory, segments), policy,
+          compress_threshold, Map::BASIC_SIZE / segments));
+    }
+  }
+
+  /// Returns true if n is a valid number of segments
+  static bool valid_segments(size_t n) {
+    return n && n <= MAX_SEGMENTS && (n & (n - 1)) == 0;
+  }
+
+  /// Returns number of segments
+  size_t segments() const { return segments_.size(); }
+
+  /// Returns index of the segment of a key
+  size_t segment_of(const Key& key) const {
+    return size_t(Hash()(key) & (segments_.size() - 1));
+  }
+
+  /// Returns HashMap of a segment
+  Map& segment(size_t i) { return segments_[i]->map; }
+
+  /// Returns mutex of a segment
+  std::mutex& mutex(size_t i) { return segments_[i]->mutex; }
+
+  /// Returns HashMap of the segment of a key
+  Map& map_of(const Key& key) { return segment(segment_of(key)); }
+
+  /** \brief Doubles number of segments.
+   *
+   * Records of segment i whose hash has the new bit set move to segment
+   * i + N without copying, limits are divided anew. Does nothing if there
+   * are MAX_SEGMENTS segments already.
+   *
+   * \return false if the map was not split.
+   */
+  bool split() {
+    size_t n = segments_.size();
+    if (n * 2 > MAX_SEGMENTS) {
+      return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+      auto target = std::make_unique<Segment>(
+          0, 0, policy_, compress_threshold_, segments_[i]->map.buckets());
+      if (index_) {
+        target->map.enable_index();
+      }
+      target->map.set_eviction_listener(on_evict_);
+      segments_[i]->map.move_records(target->map, [n](const Key& key) {
+        return (Hash()(key) & n) != 0;
+      });
+      segments_.push_back(std::move(target));
+    }
+    for (auto& segment : segments_) {
+      segment->map.set_limits(share(max_records_, 2 * n),
+                              share(max_memory_, 2 * n));
+    }
+    return true;
+  }
+
+  bool put(const Key& key, std::string value, size_t ttl) {
+    return map_of(key).put(key, std::move(value), ttl);
+  }
+
+  bool put_until(const Key& key, std::string value, time_t expires) {
+    return map_of(key).put_until(key, std::move(value), expires);
+  }
+
+  std::optional<std::string> get(const Key& key) { return map_of(key).get(key); }
+
+  std::optional<std::pair<std::string, time_t>> peek(const Key& key) {
+    return map_of(key).peek(key);
+  }
+
+  std::optional<int64_t> incr(const Key& key, int64_t delta, size_t ttl) {
+    return map_of(key).incr(key, delta, ttl);
+  }
+
+  bool expire(const Key& key, size_t ttl) { return map_of(key).expire(key, ttl); }
+
+  bool persist(const Key& key) { return map_of(key).persist(key); }
+
+  std::optional<int64_t> ttl(const Key& key) { return map_of(key).ttl(key); }
+
+  void remove(const Key& key) { map_of(key).remove(key); }
+
+  /// Contents of all segments, see HashMap::get_table
+  std::string get_table() {
+    std::string result;
+    for (auto& segment : segments_) {
+      std::string part = segment->map.get_table();
+      if (!part.empty()) {
+        result += result.empty() ? part : "\n" + part;
+      }
+    }
+    return result;
+  }
+
+  /// Keys with expiration time of all segments, see HashMap::expiring_keys
+  std::vector<std::pair<std::string, time_t>> expiring_keys() {
+    std::vector<std::pair<std::string, time_t>> result;
+    for (auto& segment : segments_) {
+      auto part = segment->map.expiring_keys();
+      result.insert(result.end(), part.begin(), part.end());
+    }
+    return result;
+  }
+
+  /// Builds ordered indexes of all segments
+  void enable_index() {
+    index_ = true;
+    for (auto& segment : segments_) {
+      segment->map.enable_index();
+    }
+  }
+
+  /// Drops ordered indexes of all segments
+  void disable_index() {
+    index_ = false;
+    for (auto& segment : segments_) {
+      segment->map.disable_index();
+    }
+  }
+
+  /// Returns true if the ordered index is built
+  bool has_index() const { return index_; }
+
+  /** \brief Gets records with keys from..to in key order.
+   *
+   * Every segment scans its own index, the sorted results are merged and
+   * the first limit records are returned, see HashMap::range. Keys are
+   * merged by their text, so the order is the one of byte string keys.
+   */
+  std::vector<std::pair<std::string, std::string>> range(const Key& from,
+                                                         const Key& to,
+                                                         size_t limit) {
+    std::vector<std::pair<std::string, std::string>> result;
+    for (auto& segment : segments_) {
+      auto part = segment->map.range(from, to, limit);
+      size_t middle = result.size();
+      result.insert(result.end(), std::make_move_iterator(part.begin()),
+                    std::make_move_iterator(part.end()));
+      std::inplace_merge(result.begin(), result.begin() + middle, result.end());
+      if (result.size() > limit) {
+        result.resize(limit);
+      }
+    }
+    return result;
+  }
+
+  /// Writes all segments as one dump, see HashMap::dump
+  size_t dump(std::ostream& out) {
+    size_t count = 0;
+    for (auto& segment : segments_) {
+      count += segment->map.alive_records();
+    }
+    Map::write_dump_header(out, count);
+    for (auto& segment : segments_) {
+      segment->map.dump_records(out);
+    }
+    return count;
+  }
+
+  /// Puts records of a dump into their segments, see HashMap::load
+  std::optional<size_t> load(std::istream& in) {
+    std::optional<uint64_t> records = Map::read_dump_header(in);
+    if (!records) {
+      return std::nullopt;
+    }
+    for (auto& segment : segments_) {
+      segment->map.reserve(segment->map.records() +
+                           *records / segments_.size());
+    }
+    Key key;
+    std::string value;
+    time_t expires;
+    time_t now = time(NULL);
+    for (uint64_t i = 0; i < *records; i++) {
+      if (!Map::read_dump_record(in, key, value, expires)) {
+        return std::nullopt;
+      }
+      if (expires >= now) {
+        put_until(key, value, expires);
+      }
+    }
+    return size_t(*records);
+  }
+
+  /** \brief Evicts one record from the largest segment that has records.
+   *
+   * An empty segment may be the largest one by its bucket array, so only
+   * segments with records are chosen.
+   *
+   * \return false if there is nothing to evict.
+   */
+  bool evict() {
+    Map* largest = nullptr;
+    for (auto& segment : segments_) {
+      if (segment->map.records() > 0 &&
+          (!largest || segment->map.memory_usage() > largest->memory_usage())) {
+        largest = &segment->map;
+      }
+    }
+    return largest && largest->evict();
+  }
+
+  /// Sets eviction listener of all segments
+  void set_eviction_listener(std::function<void(const Key&)> listener) {
+    on_evict_ = std::move(listener);
+    for (auto& segment : segments_) {
+      segment->map.set_eviction_listener(on_evict_);
+    }
+  }
+
+  /// Returns approximate number of bytes used by all segments
+  size_t memory_usage() const {
+    size_t memory = 0;
+    for (const auto& segment : segments_) {
+      memory += segment->map.memory_usage();
+    }
+    return memory;
+  }
+
+  /// Returns number of records of all segments
+  size_t records() const {
+    size_t records = 0;
+    for (const auto& segment : segments_) {
+      records += segment->map.records();
+    }
+    return records;
+  }
+
+  /// Clears all segments
+  void free_hash_map() {
+    for (auto& segment : segments_) {
+      segment->map.free_hash_map();
+    }
+  }
+
+ private:
+  /// A segment has a cache line of its own, so its mutex is not shared
+  struct alignas(64) Segment {
+    Segment(size_t max_records, size_t max_memory, EvictionPolicy policy,
+            size_t compress_threshold, size_t buckets)
+        : map(max_records, max_memory, policy, compress_threshold, buckets) {}
+    std::mutex mutex;
+    Map map;
+  };
+
+  /// Share of a limit per segment, 0 stays unlimited
+  static size_t share(size_t limit, size_t segments) {
+    return (limit + segments - 1) / segments;
+  }
+
+  std::vector<std::unique_ptr<Segment>> segments_;
+  size_t max_records_;
+  size_t max_memory_;
+  EvictionPolicy policy_;
+  size_t compress_threshold_;
+  std::function<void(const Key&)> on_evict_;
+  bool index_ = false;
+};
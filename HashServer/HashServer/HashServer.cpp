@@ -1,45 +1,514 @@
 #include "HashServer.h"
+#include "HashCluster.h"
+#include "HashPubSub.h"
+#include "HashReplica.h"
+#include "HashTracking.h"
+#include <algorithm>
+#include <charconv>
 #include <exception>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
 
 std::vector<Table> tables;
 size_t size = 0;
-std::mutex mutex_;
+std::shared_mutex mutex_;
+std::mutex notify_mutex;  /// serializes notifications under shared lock
+std::atomic<bool> listening{false};  /// somebody may wait for notifications
 size_t ntables;
+size_t maxtblsz;
+size_t maxmem;
+size_t tblmem;
+std::atomic<size_t> used_memory{0};
+EvictionPolicy evict_policy;
+size_t compress_threshold;
+size_t table_segments;     /// segments of a new table, 0 means automatic
+size_t max_auto_segments;  /// automatic split stops at this number
+std::string data_dir;
+bool read_only = false;
+size_t outq_high;
+size_t outq_low;
+size_t idle_timeout;
+size_t read_timeout;
+size_t sub_buffer;
+std::atomic<size_t> connections{0};
+size_t user_tables;
+size_t user_records;
+UserQuotas user_quotas;
 bool VERBOSE;
 
+/// Compiled scripts of eval and scriptload, guarded by their own mutex
+static ScriptCache scripts;
+
+/// Empty hash maps built at startup for addtable, guarded by spare_mutex
+static std::vector<TableMap> spare_maps;
+static std::mutex spare_mutex;
+
+/// Takes a spare hash map with a number of segments, nullopt if none left
+static std::optional<TableMap> take_spare_map(size_t segments) {
+  std::lock_guard<std::mutex> lg(spare_mutex);
+  if (spare_maps.empty() || spare_maps.back().segments() != segments) {
+    return std::nullopt;
+  }
+  std::optional<TableMap> hash_map(std::move(spare_maps.back()));
+  spare_maps.pop_back();
+  return hash_map;
+}
+
+/// Puts back a spare hash map taken by a rejected addtable
+static void return_spare_map(TableMap&& hash_map) {
+  std::lock_guard<std::mutex> lg(spare_mutex);
+  spare_maps.push_back(std::move(hash_map));
+}
+
+
+/** \brief Parses ttl of a request.
+ * \param token "ttl=<sec>" token
+ *
+ * \return seconds, throws RequestError "error ttl=<value>" if the value is
+ * not a number from 0 to INT_MAX, so a negative one does not wrap into a
+ * huge ttl.
+ */
+static size_t parse_ttl(const std::string& token) {
+  std::string value = token.size() > 4 ? token.substr(4) : "";
+  size_t ttl = 0;
+  auto [end, error] =
+      std::from_chars(value.data(), value.data() + value.size(), ttl);
+  if (value.empty() || error != std::errc() ||
+      end != value.data() + value.size() ||
+      ttl > size_t(std::numeric_limits<int>::max())) {
+    throw RequestError("error ttl=" + value);
+  }
+  return ttl;
+}
+
+/// Event that tells a subscriber how many events it has lost
+static std::shared_ptr<const std::string> dropped_notice(size_t count) {
+  return std::make_shared<const std::string>(
+      "message dropped=" + std::to_string(count) + "\n");
+}
+
+/// Counts records of a table under shared lock, segment by segment
+static size_t count_records(TableMap& hash_map) {
+  size_t records = 0;
+  for (size_t segment = 0; segment < hash_map.segments(); segment++) {
+    std::lock_guard<std::mutex> sl(hash_map.mutex(segment));
+    records += hash_map.segment(segment).records();
+  }
+  return records;
+}
+
+/// Refreshes tables and records owned by users, must be called under mutex_
+static void count_owned_records() {
+  std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> owned;
+  for (Table& table : tables) {
+    if (table.valid) {
+      auto& counts = owned[table.username];
+      counts.first++;
+      counts.second += count_records(table.hash_map);
+    }
+  }
+  user_quotas.set_owned(owned);
+}
+
+/// Sends evictions of a table to followers, trackers and subscribers
+static void listen_evictions(TableMap& hash_map, size_t index) {
+  hash_map.set_eviction_listener([index](const SmallKey& key) {
+    if (!listening) {
+      return;
+    }
+    std::lock_guard<std::mutex> nl(notify_mutex);
+    replicate_eviction(index, key);
+    invalidate_key(index, key.view());
+    publish_removal(index, key.view());
+  });
+}
+
+/**
+ * \brief Locks the segment of a key: tables are locked shared, so requests
+ * to other segments and tables run in parallel.
+ *
+ * The table is found under the lock (see con_handler::find_table), a write
+ * that adds records checks the record quota under the segment mutex too.
+ * Lock order is mutex_, then the mutex of a segment, then notify_mutex.
+ */
+struct SegmentLock {
+  SegmentLock(size_t table_num, const SmallKey& key, bool adds = false)
+      : tables_lock(mutex_),
+        table(con_handler::find_table(table_num)),
+        segment(table.hash_map.segment_of(key)),
+        hash_map(table.hash_map.segment(segment)),
+        segment_lock(table.hash_map.mutex(segment)) {
+    if (adds) {
+      con_handler::check_record_quota(table, &hash_map, key);
+    }
+  }
+
+  std::shared_lock<std::shared_mutex> tables_lock;
+  Table& table;
+  size_t segment;
+  TableMap::Map& hash_map;
+  std::lock_guard<std::mutex> segment_lock;
+};
 
 void con_handler::start() {
+  connections++;
+  counted = true;
+  start_read();
+}
+
+void con_handler::reject() {
+  closing = true;
+  boost::asio::post(strand_, boost::bind(&con_handler::queue_response,
+                                         shared_from_this(), "error busy\n"));
+}
+
+void con_handler::start_read() {
+  if (reading || closing) {
+    return;
+  }
+  reading = true;
+  // idle timeout between requests, read timeout inside of a started one
+  std::chrono::milliseconds timeout(
+      1000 * (in_buffer.empty() ? idle_timeout : read_timeout));
+  if (first_read && !in_buffer.empty()) {
+    timeout = ONE_SHOT_WAIT;  // the client may wait for a one-shot response
+  }
+  if (timeout.count() && !replica) {
+    timer_.expires_after(timeout);
+    timer_.async_wait(boost::asio::bind_executor(
+        strand_, boost::bind(&con_handler::handle_timeout, shared_from_this(),
+                             boost::asio::placeholders::error)));
+  }
   socket_.async_read_some(
       boost::asio::buffer(in_message, BUFFER_SIZE),
-      boost::bind(&con_handler::handle_read, shared_from_this(),
-                  boost::asio::placeholders::error,
-                  boost::asio::placeholders::bytes_transferred));
+      boost::asio::bind_executor(
+          strand_, boost::bind(&con_handler::handle_read, shared_from_this(),
+                               boost::asio::placeholders::error,
+                               boost::asio::placeholders::bytes_transferred)));
 }
 
 void con_handler::handle_read(const boost::system::error_code& err,
                  size_t bytes_transferred) {
+  reading = false;
+  timer_.cancel();
+  if (closing) {
+    return;  // a one-shot request has been taken by handle_timeout
+  }
   if (!err) {
-    if (VERBOSE) {
-      cout << "Server recieved from client: " << in_message << endl;
-    }
-    socket_.async_write_some(
-        boost::asio::buffer(out_message = parse_command_str(in_message),
-                            BUFFER_SIZE),
-        boost::bind(&con_handler::handle_write, shared_from_this(),
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
-  } else {
+    in_buffer.append(in_message, bytes_transferred);
+    if (first_read) {
+      // the mode is known at the first '\n', a one-shot request has none
+      if (in_buffer.find('\n') == std::string::npos &&
+          in_buffer.size() <= MAX_REQUEST_SIZE) {
+        start_read();  // until '\n', EOF or a pause of the client
+        return;
+      }
+      first_read = false;
+      line_mode = true;
+    }
+
+    size_t begin = 0, end;
+    while ((end = in_buffer.find('\n', begin)) != std::string::npos) {
+      std::string_view request(in_buffer.data() + begin, end - begin);
+      if (!request.empty() && request.back() == '\r') {
+        request.remove_suffix(1);
+      }
+      begin = end + 1;
+      if (VERBOSE) {
+        cout << "Server recieved from client: " << request << endl;
+      }
+      execute(request);
+    }
+    in_buffer.erase(0, begin);
+
+    if (in_buffer.size() > MAX_REQUEST_SIZE) {
+      std::cerr << "error: request is too long" << endl;
+      closing = true;
+      queue_response("error request\n");
+    } else if (out_.size() < outq_high) {
+      start_read();
+    } else if (VERBOSE) {
+      cout << "Output queue is full, reading is paused." << endl;
+    }
+  } else if (err == boost::asio::error::eof && first_read &&
+             !in_buffer.empty()) {
+    execute_one_shot();
+  } else if (err == boost::asio::error::eof && line_mode) {
+    closing = true;  // client finished, queued responses are still written
+    if (!in_buffer.empty()) {  // the last request may have no '\n'
+      execute(in_buffer);
+    }
+    if (!out_writing && event_writing.empty()) {
+      socket_.close();
+    }
+  } else if (err != boost::asio::error::operation_aborted) {
     std::cerr << "error: " << err.message() << std::endl;
     socket_.close();
   }
 }
 
+void con_handler::execute_one_shot() {
+  first_read = false;
+  if (VERBOSE) {
+    cout << "Server recieved from client: " << in_buffer << endl;
+  }
+  closing = true;
+  queue_response(process(in_buffer));
+}
+
+bool con_handler::admit(std::string_view request) {
+  std::string_view user = request.substr(0, request.find(' '));
+  if (!user_stats || user_stats->user != user) {
+    user_stats = &user_quotas.find(user);  // the same user usually
+  }
+  if (!user_quotas.admit(*user_stats, request.size())) {
+    if (VERBOSE) {
+      cout << "Rate limit of user " << user << " exceeded." << endl;
+    }
+    return false;
+  }
+  return true;
+}
+
+std::string con_handler::process(const std::string& request) {
+  if (replica) {
+    return parse_command_str(request);
+  }
+  if (!admit(request)) {
+    return "error quota=rate";
+  }
+  std::string response = parse_command_str(request);
+  user_quotas.account(*user_stats, response.size());
+  return response;
+}
+
+void con_handler::execute(std::string_view request) {
+  if (!replica && !VERBOSE && execute_getval(request)) {
+    start_write();
+    return;
+  }
+  std::string response = process(std::string(request));
+  if (replica) {  // replication records are not lines
+    queue_response(std::move(response));
+    return;
+  }
+  out_.append_line(std::move(response));  // a table is moved, not copied
+  out_.append("\n");
+  start_write();
+}
+
+bool con_handler::execute_getval(std::string_view request) {
+  // "<user> getval key=<key> table=<table>", other forms go to process
+  static constexpr std::string_view COMMAND = " getval key=";
+  static constexpr std::string_view TABLE = " table=";
+  size_t command = request.find(' ');
+  if (command == std::string_view::npos ||
+      request.compare(command, COMMAND.size(), COMMAND) != 0) {
+    return false;
+  }
+  std::string_view key = request.substr(command + COMMAND.size());
+  size_t table = key.find(' ');
+  if (table == std::string_view::npos ||
+      key.compare(table, TABLE.size(), TABLE) != 0) {
+    return false;
+  }
+  std::string_view digits = key.substr(table + TABLE.size());
+  key = key.substr(0, table);
+  int number;  // as stoi of parse_command_str
+  auto [end, error] =
+      std::from_chars(digits.data(), digits.data() + digits.size(), number);
+  if (error != std::errc() || end != digits.data() + digits.size()) {
+    return false;
+  }
+  size_t table_num = size_t(number);
+
+  if (!admit(request)) {
+    out_.append("error quota=rate\n");
+    return true;
+  }
+  size_t before = out_.size();
+  SmallKey small_key(key);
+  try {
+    SegmentLock lock(table_num, small_key);
+    lock.table.hot_keys[lock.segment].access(key);
+    bool found = lock.hash_map.read(small_key, [&](std::string_view value) {
+      out_.append("ok key=");
+      out_.append(key);
+      out_.append(" value=");
+      out_.append_line(value);
+      out_.append(" table=");
+      out_.append_number(int64_t(table_num));
+    });
+    if (!found) {
+      out_.append("error key=");
+      out_.append(key);
+    }
+    track_read(table_num, key);
+  } catch (RequestError& err) {
+    out_.append(err.what());
+  }
+  out_.append("\n");
+  user_quotas.account(*user_stats, out_.size() - before - 1);
+  return true;
+}
+
+void con_handler::queue_response(std::string response) {
+  out_.append(std::move(response));
+  start_write();
+}
+
+void con_handler::post_replica_record(std::string record) {
+  if (replica_syncing) {
+    // the snapshot may still miss the change, so it is sent afterwards
+    replica_held_bytes += record.size();
+    replica_held.push_back(std::move(record));
+    if (replica_held_bytes > MAX_REPLICA_LAG) {
+      replica_syncing = false;
+      replica_held.clear();
+      boost::asio::post(strand_,
+                        boost::bind(&con_handler::close_lagging_replica,
+                                    shared_from_this()));
+    }
+    return;
+  }
+  boost::asio::post(strand_,
+                    boost::bind(&con_handler::queue_replica_record,
+                                shared_from_this(), std::move(record)));
+}
+
+void con_handler::queue_replica_record(std::string record) {
+  if (!socket_.is_open()) {
+    return;
+  }
+  if (out_.size() > replica_limit) {
+    close_lagging_replica();
+    return;
+  }
+  queue_response(std::move(record));
+}
+
+void con_handler::close_lagging_replica() {
+  std::cerr << "error: follower lags too much, closing its connection"
+            << endl;
+  sending_snapshot = false;
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+}
+
+std::string con_handler::start_replication() {
+  std::shared_lock<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << "Follower connected, sending snapshot of " << tables.size()
+         << " tables." << endl;
+  }
+  {
+    // changes from now on, also of tables, are held, so the follower gets
+    // them after the snapshot, which may already have some of them
+    std::lock_guard<std::mutex> nl(notify_mutex);
+    replica_syncing = true;
+    replicas.push_back(shared_from_this());
+    listening = true;
+  }
+  replica = true;
+  replica_limit = std::numeric_limits<size_t>::max();
+  snapshot_tables = tables.size();
+  snapshot_next = 0;
+  sending_snapshot = true;
+  out_.append(snapshot_record(snapshot_tables));
+  lg.unlock();
+  queue_snapshot_table();
+  return "";
+}
+
+void con_handler::queue_snapshot_table() {
+  std::shared_lock<std::shared_mutex> lg(mutex_);
+  if (snapshot_next < snapshot_tables && snapshot_next < tables.size()) {
+    out_.append(table_record(snapshot_next++));
+    return;
+  }
+  // records held meanwhile follow the snapshot, later ones are posted to
+  // the strand after them
+  std::lock_guard<std::mutex> nl(notify_mutex);
+  for (auto& record : replica_held) {
+    out_.append(std::move(record));
+  }
+  replica_held.clear();
+  replica_held_bytes = 0;
+  replica_syncing = false;
+  sending_snapshot = false;
+  replica_limit = out_.size() + MAX_REPLICA_LAG;
+}
+
+void con_handler::start_write() {
+  if (out_writing || !event_writing.empty() ||
+      (out_.empty() && event_queue.empty())) {
+    return;
+  }
+  // coalesces pipelined responses and events into one gather write
+  write_buffers.clear();
+  out_writing = out_.gather(MAX_GATHER, [this](const char* data, size_t size) {
+    write_buffers.emplace_back(data, size);
+  });
+  while (!event_queue.empty() &&
+         write_buffers.size() + event_writing.size() < MAX_GATHER) {
+    event_writing.push_back(std::move(event_queue.front()));
+    event_queue.pop_front();
+  }
+  for (const auto& event : event_writing) {  // shared, not copied
+    write_buffers.push_back(boost::asio::buffer(*event));
+  }
+  GatherList buffers{write_buffers.data(),
+                     write_buffers.data() + write_buffers.size()};
+  boost::asio::async_write(
+      socket_, buffers,
+      boost::asio::bind_executor(
+          strand_, boost::bind(&con_handler::handle_write, shared_from_this(),
+                               boost::asio::placeholders::error,
+                               boost::asio::placeholders::bytes_transferred)));
+}
+
 void con_handler::handle_write(const boost::system::error_code& err,
                   size_t bytes_transferred) {
   if (!err) {
     if (VERBOSE) {
-      cout << "Server successfully sent message to the client: " << out_message
-           << endl;
+      cout << "Server successfully sent message to the client: ";
+      for (const auto& buffer : write_buffers) {
+        cout << std::string_view(static_cast<const char*>(buffer.data()),
+                                 buffer.size());
+      }
+      cout << endl;
+    }
+    size_t written_events = 0;
+    for (const auto& event : event_writing) {
+      written_events += event->size();
+    }
+    if (written_events) {
+      std::lock_guard<std::mutex> lg(events_mutex);
+      event_bytes -= written_events;
+      if (dropped_events && event_bytes == 0) {  // drained after drops
+        event_queue.push_back(dropped_notice(dropped_events));
+        event_bytes += event_queue.back()->size();
+        dropped_events = 0;
+      }
+    }
+    out_.consume(out_writing);
+    out_writing = 0;
+    event_writing.clear();
+    if (sending_snapshot && out_.size() <= outq_low) {
+      queue_snapshot_table();  // a table is copied when the last one is sent
+    }
+    if (!out_.empty() || !event_queue.empty()) {
+      start_write();
+    } else if (closing) {
+      boost::system::error_code ignored;
+      socket_.shutdown(tcp::socket::shutdown_both, ignored);
+      socket_.close();
+      return;
+    }
+    if (!reading && out_.size() <= outq_low) {
+      start_read();
     }
   } else {
     std::cerr << "error: " << err.message() << endl;
@@ -47,53 +516,792 @@ void con_handler::handle_write(const boost::system::error_code& err,
   }
 }
 
-std::string con_handler::add_table(std::string username) {
-  std::lock_guard<std::mutex> lg(mutex_);
+void con_handler::handle_timeout(const boost::system::error_code& err) {
+  if (err == boost::asio::error::operation_aborted || !reading ||
+      timer_.expiry() > boost::asio::steady_timer::clock_type::now()) {
+    return;  // cancelled or restarted
+  }
+  if (first_read && !in_buffer.empty()) {  // the client waits for a response
+    execute_one_shot();
+    boost::system::error_code ignored;
+    socket_.cancel(ignored);
+    return;
+  }
   if (VERBOSE) {
-    cout << "Table number " << size << " was successfully added for user "
-         << username << endl;
+    cout << "Connection timed out, closing it." << endl;
+  }
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+}
+
+std::string con_handler::add_table(std::string username, size_t segments) {
+  std::optional<TableMap> hash_map = take_spare_map(segments ? segments : 1);
+  bool spare = bool(hash_map);
+  if (!hash_map) {  // buckets are allocated before the lock
+    hash_map.emplace(maxtblsz, tblmem, evict_policy, compress_threshold,
+                     segments ? segments : 1);
   }
-  tables.push_back({username, HashMap(), true});
+  // a rejected request keeps the spare map for the next one, so rejections
+  // do not drain the preallocated maps
+  auto reject = [&hash_map, spare](std::string error) {
+    if (spare) {
+      return_spare_map(std::move(*hash_map));
+    }
+    return error;
+  };
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  if (ntables <= size) {
+    if (VERBOSE) {
+      cout << "Table limit exceeded." << endl;
+    }
+    return reject(get_table_error(table_number(ntables)));  // too much
+  }
+  if (user_tables &&
+      size_t(std::count_if(tables.begin(), tables.end(),
+                           [&username](const Table& table) {
+                             return table.valid && table.username == username;
+                           })) >= user_tables) {
+    if (VERBOSE) {
+      cout << "Table quota exceeded, table is not added for user " << username
+           << endl;
+    }
+    return reject("error quota=tables");
+  }
+  if (maxmem && used_memory + hash_map->memory_usage() > maxmem) {
+    if (VERBOSE) {
+      cout << "Memory limit exceeded, table is not added for user " << username
+           << endl;
+    }
+    return reject(get_table_error(table_number(tables.size())));
+  }
+  size_t index = tables.size();
+  listen_evictions(*hash_map, index);
+  used_memory += hash_map->memory_usage();
+  std::vector<HotKeys> hot_keys(hash_map->segments());
+  tables.push_back({username, std::move(*hash_map), true, std::move(hot_keys),
+                    !segments, &user_quotas.find(username)});
   size++;
-  return std::to_string(tables.size() - 1);
+  replicate("addtable " + username + "\n");
+  if (VERBOSE) {
+    cout << "Table number " << table_number(index)
+         << " was successfully added for user " << username << endl;
+  }
+  return std::to_string(table_number(index));
+}
+
+void con_handler::check_record_quota(const Table& table,
+                                     TableMap::Map* segment,
+                                     const SmallKey& key) {
+  if (!user_records || table.owner->records.load() < user_records) {
+    return;
+  }
+  if (segment && segment->ttl(key)) {
+    return;  // changes of existing records are allowed
+  }
+  if (VERBOSE) {
+    cout << "Record quota of user " << table.username << " exceeded." << endl;
+  }
+  throw RequestError("error quota=records");
 }
 
-std::string con_handler::get_table(size_t table_num) {
-  std::lock_guard<std::mutex> lg(mutex_);
+std::string con_handler::user_stats_str(const std::string& username) {
+  // usage of other users is not shown: names and load of tenants are private
+  UserUsage own = UserQuotas::usage(user_quotas.find(username));
+  return "ok user=" + own.user + " ops=" + std::to_string(own.ops) +
+         " bytes=" + std::to_string(own.bytes) +
+         " rejected=" + std::to_string(own.rejected) +
+         " tables=" + std::to_string(own.tables) +
+         " records=" + std::to_string(own.records);
+}
+
+std::string con_handler::memory_stats_str() {
+  static const char* HUGE_PAGES[] = {"off", "transparent", "explicit"};
+  TableMemoryStats stats = table_memory_stats();
+  std::string result = "ok numa=";
+  result += stats.numa == NUMA_OFF          ? "off"
+            : stats.numa == NUMA_INTERLEAVE ? "interleave"
+                                            : std::to_string(stats.numa);
+  result += std::string(" prefault=") + (stats.prefault ? "on" : "off") +
+            " huge_pages=" + HUGE_PAGES[int(stats.huge_pages)] +
+            " arrays=" + std::to_string(stats.arrays) +
+            " bytes=" + std::to_string(stats.bytes) +
+            " huge=" + std::to_string(stats.huge_bytes);
+  for (size_t node = 0; node < stats.node_bytes.size(); node++) {
+    result += "\nok node=" + std::to_string(node) +
+              " bytes=" + std::to_string(stats.node_bytes[node]);
+  }
+  return result;
+}
+
+std::string con_handler::get_table(size_t table_num,
+                                   const std::string& username) {
+  std::shared_lock<std::shared_mutex> lg(mutex_);
   if (VERBOSE) {
     cout << "Getting table with number " << table_num << endl;
   }
-  return tables[table_num].hash_map.get_table();
+  TableMap& hash_map = find_table(table_num, &username).hash_map;
+  std::string result;
+  for (size_t segment = 0; segment < hash_map.segments(); segment++) {
+    std::lock_guard<std::mutex> sl(hash_map.mutex(segment));
+    std::string part = hash_map.segment(segment).get_table();
+    if (!part.empty()) {
+      result += result.empty() ? part : "\n" + part;
+    }
+  }
+  return result;
+}
+
+std::string con_handler::hot_keys(size_t table_num,
+                                  const std::string& username) {
+  std::shared_lock<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << "Getting hot keys of table with number " << table_num << endl;
+  }
+  // a key is counted in one segment only, so the tops are just merged
+  std::vector<std::pair<std::string, uint64_t>> top;
+  Table& table = find_table(table_num, &username);
+  for (size_t segment = 0; segment < table.hot_keys.size(); segment++) {
+    std::vector<std::pair<std::string, uint64_t>> part;
+    {
+      std::lock_guard<std::mutex> sl(table.hash_map.mutex(segment));
+      part = table.hot_keys[segment].top();
+    }
+    top.insert(top.end(), part.begin(), part.end());
+  }
+  std::stable_sort(top.begin(), top.end(), [](const auto& a, const auto& b) {
+    return a.second > b.second;
+  });
+  top.resize(std::min(top.size(), HotKeys::TOP_K));
+  std::string result;
+  for (const auto& [key, hits] : top) {
+    if (!result.empty()) {
+      result += "\n";
+    }
+    result += "ok key=" + key + " hits=" + std::to_string(hits) +
+              " table=" + std::to_string(table_num);
+  }
+  return result;
+}
+
+std::string con_handler::set_index(size_t table_num,
+                                   const std::string& username, bool enabled) {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << (enabled ? "Building" : "Dropping")
+         << " index of table with number " << table_num << endl;
+  }
+  TableMap& hash_map = find_table(table_num, &username).hash_map;
+  size_t before = hash_map.memory_usage();
+  if (enabled) {
+    hash_map.enable_index();
+  } else {
+    hash_map.disable_index();
+  }
+  update_used_memory(before, hash_map.memory_usage());
+  evict_global();
+  return "ok table=" + std::to_string(table_num) +
+         " records=" + std::to_string(hash_map.records());
+}
+
+std::string con_handler::dump_table(size_t table_num,
+                                    const std::string& username,
+                                    const std::string& file) {
+  std::shared_lock<std::shared_mutex> lg(mutex_);
+  TableMap& hash_map = find_table(table_num, &username).hash_map;
+  auto path = table_file_path(file);
+  if (!path) {
+    return get_file_error(file);
+  }
+  std::ofstream out(*path, std::ios::binary | std::ios::trunc);
+  if (VERBOSE) {
+    cout << "Dumping table with number " << table_num << " to " << *path
+         << endl;
+  }
+  size_t records = dump_segments(hash_map, out);
+  out.close();
+  if (!out) {
+    return get_file_error(file);
+  }
+  return "ok table=" + std::to_string(table_num) +
+         " records=" + std::to_string(records);
+}
+
+size_t con_handler::dump_segments(TableMap& hash_map, std::ostream& out) {
+  // segments are copied one by one, the number of records is known last
+  std::streampos start = out.tellp();
+  TableMap::Map::write_dump_header(out, 0);
+  size_t records = 0;
+  std::ostringstream part;
+  for (size_t segment = 0; segment < hash_map.segments(); segment++) {
+    part.str(std::string());
+    {
+      std::lock_guard<std::mutex> sl(hash_map.mutex(segment));
+      records += hash_map.segment(segment).dump_records(part);
+    }
+    std::string bytes = part.str();
+    out.write(bytes.data(), std::streamsize(bytes.size()));
+  }
+  std::streampos end = out.tellp();
+  out.seekp(start);
+  TableMap::Map::write_dump_header(out, records);
+  out.seekp(end);
+  return records;
 }
 
-void con_handler::set_val(size_t table_num, int key, std::string val,
-                          time_t ttl) {
-  std::lock_guard<std::mutex> lg(mutex_);
+std::string con_handler::load_table(size_t table_num,
+                                    const std::string& username,
+                                    const std::string& file) {
+  size_t segments;
+  bool indexed;
+  {
+    std::shared_lock<std::shared_mutex> lg(mutex_);
+    Table& table = find_table(table_num, &username);
+    check_record_quota(table, nullptr, "");
+    segments = table.hash_map.segments();
+    indexed = table.hash_map.has_index();
+  }
+  auto path = table_file_path(file);
+  if (!path) {
+    return get_file_error(file);
+  }
+  std::ifstream in(*path, std::ios::binary);
+  if (!in) {
+    return get_file_error(file);
+  }
   if (VERBOSE) {
-    cout << "Setting table's with number " << table_num << " key: " << key
-         << " equal to value: " << val << " with ttl: " << ttl << " seconds."
+    cout << "Loading table with number " << table_num << " from " << *path
          << endl;
   }
-  tables[table_num].hash_map.put(key, val, ttl);
+  // the new hash map is built without locks, the old one is freed after them
+  TableMap hash_map(maxtblsz, tblmem, evict_policy, compress_threshold,
+                    segments);
+  auto records = hash_map.load(in);
+  if (!records) {
+    return get_file_error(file);
+  }
+  if (indexed) {
+    hash_map.enable_index();
+  }
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  Table& table = find_table(table_num, &username);
+  if (table.hash_map.has_index() != hash_map.has_index()) {
+    if (hash_map.has_index()) {  // changed by remindex or addindex meanwhile
+      hash_map.disable_index();
+    } else {
+      hash_map.enable_index();
+    }
+  }
+  listen_evictions(hash_map, table_index(table_num));
+  size_t before = table.hash_map.memory_usage();
+  std::swap(table.hash_map, hash_map);
+  table.hot_keys = std::vector<HotKeys>(table.hash_map.segments());
+  update_used_memory(before, table.hash_map.memory_usage());
+  evict_global();
+  if (!replicas.empty()) {
+    replicate(table_record(table_index(table_num)));
+  }
+  invalidate_table(table_index(table_num), false);
+  publish_table(table_index(table_num), false);
+  return "ok table=" + std::to_string(table_num) +
+         " records=" + std::to_string(*records);
+}
+
+bool con_handler::set_val(size_t table_num, const std::string& key,
+                          std::string val, time_t ttl) {
+  bool stored;
+  {
+    SegmentLock lock(table_num, key, true);
+    if (VERBOSE) {
+      cout << "Setting table's with number " << table_num << " key: " << key
+           << " equal to value: " << val << " with ttl: " << ttl
+           << " seconds." << endl;
+    }
+    lock.table.hot_keys[lock.segment].access(key);
+    size_t before = lock.hash_map.memory_usage();
+    stored = lock.hash_map.put(key, std::move(val), ttl);
+    if (!stored && VERBOSE) {
+      cout << "Value does not fit into table " << table_num << " limits."
+           << endl;
+    }
+    update_used_memory(before, lock.hash_map.memory_usage());
+    key_changed(table_num, key);
+  }
+  evict_if_needed();
+  return stored;
+}
+
+std::optional<int64_t> con_handler::incr_val(size_t table_num,
+                                             const std::string& key,
+                                             int64_t delta, time_t ttl) {
+  std::optional<int64_t> value;
+  {
+    SegmentLock lock(table_num, key, true);
+    if (VERBOSE) {
+      cout << "Incrementing table's with number " << table_num
+           << " key: " << key << " by: " << delta << endl;
+    }
+    size_t before = lock.hash_map.memory_usage();
+    value = lock.hash_map.incr(key, delta, ttl);
+    update_used_memory(before, lock.hash_map.memory_usage());
+    key_changed(table_num, key);
+  }
+  evict_if_needed();
+  return value;
+}
+
+bool con_handler::setnx_val(size_t table_num, const std::string& key,
+                            std::string val, time_t ttl) {
+  bool stored;
+  {
+    SegmentLock lock(table_num, key, true);
+    if (VERBOSE) {
+      cout << "Setting if absent table's with number " << table_num
+           << " key: " << key << " equal to value: " << val << endl;
+    }
+    size_t before = lock.hash_map.memory_usage();
+    stored = lock.hash_map.put_if_absent(key, std::move(val), ttl);
+    update_used_memory(before, lock.hash_map.memory_usage());
+    key_changed(table_num, key);
+  }
+  evict_if_needed();
+  return stored;
 }
 
-std::optional<std::string> con_handler::get_val(size_t table_num, int key) {
-  std::lock_guard<std::mutex> lg(mutex_);
+std::optional<std::string> con_handler::getset_val(size_t table_num,
+                                                   const std::string& key,
+                                                   std::string val, time_t ttl,
+                                                   bool& stored) {
+  std::optional<std::string> previous;
+  {
+    SegmentLock lock(table_num, key, true);
+    if (VERBOSE) {
+      cout << "Getting and setting table's with number " << table_num
+           << " key: " << key << " equal to value: " << val << endl;
+    }
+    size_t before = lock.hash_map.memory_usage();
+    previous = lock.hash_map.get_and_put(key, std::move(val), ttl, stored);
+    update_used_memory(before, lock.hash_map.memory_usage());
+    key_changed(table_num, key);
+  }
+  evict_if_needed();
+  return previous;
+}
+
+std::optional<uint64_t> con_handler::cas_val(size_t table_num,
+                                             const std::string& key,
+                                             std::string val, time_t ttl,
+                                             uint64_t version) {
+  std::optional<uint64_t> new_version;
+  {
+    SegmentLock lock(table_num, key, true);
+    if (VERBOSE) {
+      cout << "Compare and set table's with number " << table_num
+           << " key: " << key << " version: " << version << endl;
+    }
+    size_t before = lock.hash_map.memory_usage();
+    new_version =
+        lock.hash_map.compare_and_put(key, std::move(val), ttl, version);
+    update_used_memory(before, lock.hash_map.memory_usage());
+    key_changed(table_num, key);
+  }
+  evict_if_needed();
+  return new_version;
+}
+
+std::optional<std::pair<std::string, uint64_t>> con_handler::gets_val(
+    size_t table_num, const std::string& key) {
+  SegmentLock lock(table_num, key);
+  if (VERBOSE) {
+    cout << "Getting with version table's with number " << table_num
+         << " key: " << key << endl;
+  }
+  auto value = lock.hash_map.get_with_version(key);
+  track_read(table_num, key);
+  return value;
+}
+
+bool con_handler::expire_val(size_t table_num, const std::string& key,
+                             std::optional<time_t> ttl) {
+  SegmentLock lock(table_num, key);
+  if (VERBOSE) {
+    cout << "Changing ttl of table's with number " << table_num
+         << " key: " << key << " to: "
+         << (ttl ? std::to_string(*ttl) + " seconds." : "persistent") << endl;
+  }
+  bool changed =
+      ttl ? lock.hash_map.expire(key, *ttl) : lock.hash_map.persist(key);
+  key_changed(table_num, key);
+  return changed;
+}
+
+std::optional<int64_t> con_handler::ttl_val(size_t table_num,
+                                            const std::string& key) {
+  SegmentLock lock(table_num, key);
+  if (VERBOSE) {
+    cout << "Getting ttl of table's with number " << table_num
+         << " key: " << key << endl;
+  }
+  return lock.hash_map.ttl(key);
+}
+
+void con_handler::key_changed(size_t table_num, const std::string& key) {
+  if (!listening) {
+    return;  // no followers, trackers and subscribers, the common case
+  }
+  std::lock_guard<std::mutex> nl(notify_mutex);
+  replicate_key(table_index(table_num), key);
+  invalidate_key(table_index(table_num), key);
+  publish_key(table_index(table_num), key);
+}
+
+void con_handler::track_read(size_t table_num, std::string_view key) {
+  if (!track_reads) {
+    return;
+  }
+  std::lock_guard<std::mutex> nl(notify_mutex);
+  auto ttl = tables[table_index(table_num)].hash_map.ttl(key);
+  time_t expires = ttl && *ttl >= 0 ? time(NULL) + *ttl : TableMap::NEVER;
+  track_key(shared_from_this(), table_index(table_num), std::string(key),
+            expires);
+  listening = true;  // writers of the key hold its segment, they see it
+}
+
+std::string con_handler::start_tracking(std::optional<size_t> table_num) {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  if (table_num) {
+    find_table(*table_num);
+    tracking = true;
+    if (VERBOSE) {
+      cout << "Connection tracks table with number " << *table_num << endl;
+    }
+    track_table(shared_from_this(), table_index(*table_num));
+    listening = true;
+    return "ok tracking=table table=" + std::to_string(*table_num);
+  }
+  if (VERBOSE) {
+    cout << "Connection tracks keys it reads." << endl;
+  }
+  tracking = true;
+  track_reads = true;
+  return "ok tracking=on";
+}
+
+std::string con_handler::stop_tracking() {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << "Connection stops tracking." << endl;
+  }
+  tracking = false;  // registrations are dropped when they are invalidated
+  track_reads = false;
+  return "ok tracking=off";
+}
+
+void con_handler::queue_invalidation(std::string message) {
+  if (!tracking || closing) {
+    return;
+  }
+  if (out_.size() > outq_high) {  // the client cannot keep its cache valid
+    std::cerr << "error: tracking client does not read invalidations, "
+                 "closing its connection"
+              << endl;
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+    return;
+  }
+  queue_response(std::move(message) + "\n");
+}
+
+void con_handler::post_event(const std::shared_ptr<const std::string>& event) {
+  std::lock_guard<std::mutex> lg(events_mutex);
+  if (events_overflow) {
+    return;
+  }
+  if (event_bytes + event->size() > sub_buffer) {
+    if (drop_events) {
+      dropped_events++;
+      return;
+    }
+    events_overflow = true;
+    boost::asio::post(strand_, boost::bind(&con_handler::close_slow_subscriber,
+                                           shared_from_this()));
+    return;
+  }
+  bool posted = !events.empty();  // queue_events is pending already
+  if (dropped_events) {  // the subscriber must read its tables again
+    events.push_back(dropped_notice(dropped_events));
+    event_bytes += events.back()->size();
+    dropped_events = 0;
+  }
+  event_bytes += event->size();
+  events.push_back(event);
+  if (!posted) {
+    boost::asio::post(strand_,
+                      boost::bind(&con_handler::queue_events, shared_from_this()));
+  }
+}
+
+void con_handler::queue_events() {
+  std::vector<std::shared_ptr<const std::string>> posted;
+  {
+    std::lock_guard<std::mutex> lg(events_mutex);
+    posted.swap(events);
+  }
+  if (closing) {
+    return;
+  }
+  for (auto& event : posted) {
+    event_queue.push_back(std::move(event));
+  }
+  start_write();
+}
+
+void con_handler::close_slow_subscriber() {
+  std::cerr << "error: subscriber does not read its events, closing its "
+               "connection"
+            << endl;
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+}
+
+std::string con_handler::start_subscription(size_t table_num,
+                                            const std::string& username,
+                                            bool drop) {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  find_table(table_num, &username);
+  if (VERBOSE) {
+    cout << "Connection subscribes to table with number " << table_num
+         << (drop ? ", slow events are dropped." : ".") << endl;
+  }
+  {
+    std::lock_guard<std::mutex> events_lg(events_mutex);
+    drop_events = drop;
+  }
+  subscribe(shared_from_this(), table_index(table_num));
+  listening = true;
+  return "ok subscribe table=" + std::to_string(table_num);
+}
+
+std::string con_handler::stop_subscription(size_t table_num,
+                                           const std::string& username) {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  find_table(table_num, &username);
+  if (VERBOSE) {
+    cout << "Connection unsubscribes from table with number " << table_num
+         << endl;
+  }
+  if (!unsubscribe(shared_from_this(), table_index(table_num))) {
+    return get_table_error(table_num);
+  }
+  return "ok unsubscribe table=" + std::to_string(table_num);
+}
+
+void con_handler::update_used_memory(size_t before, size_t after) {
+  used_memory += after - before;  // wraps around when memory is freed
+}
+
+void con_handler::preallocate_tables(size_t count) {
+  size_t segments = table_segments ? table_segments : 1;
+  std::vector<TableMap> maps;
+  maps.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    maps.emplace_back(maxtblsz, tblmem, evict_policy, compress_threshold,
+                      segments);
+  }
+  {
+    std::lock_guard<std::shared_mutex> lg(mutex_);
+    tables.reserve(count);
+  }
+  std::lock_guard<std::mutex> lg(spare_mutex);
+  spare_maps = std::move(maps);
+  if (VERBOSE && count) {
+    cout << "Preallocated " << count << " tables." << endl;
+  }
+}
+
+void con_handler::evict_if_needed() {
+  if (maxmem && used_memory > maxmem) {
+    std::lock_guard<std::shared_mutex> lg(mutex_);
+    evict_global();
+  }
+}
+
+void con_handler::evict_global() {
+  static std::minstd_rand random;
+  while (maxmem && used_memory > maxmem) {
+    TableMap* largest = nullptr;
+    for (size_t i = 0; i < EVICTION_TABLES && !tables.empty(); i++) {
+      Table& table = tables[random() % tables.size()];
+      if (table.valid && table.hash_map.records() > 0 &&
+          (!largest ||
+           table.hash_map.memory_usage() > largest->memory_usage())) {
+        largest = &table.hash_map;
+      }
+    }
+    if (!largest) {  // sampling missed, fall back to the first non-empty one
+      for (auto& table : tables) {
+        if (table.valid && table.hash_map.records() > 0) {
+          largest = &table.hash_map;
+          break;
+        }
+      }
+    }
+    if (!largest) {
+      break;  // only empty tables are left
+    }
+    size_t before = largest->memory_usage();
+    if (!largest->evict()) {
+      break;  // nothing is evicted, another pass would find the same table
+    }
+    update_used_memory(before, largest->memory_usage());
+    if (VERBOSE) {
+      cout << "Record was evicted, used memory: " << used_memory << endl;
+    }
+  }
+}
+
+std::optional<std::string> con_handler::get_val(size_t table_num,
+                                                const std::string& key) {
+  SegmentLock lock(table_num, key);
   if (VERBOSE) {
     cout << "Getting table's with number " << table_num << " key: " << key
          << endl;
   }
-  return tables[table_num].hash_map.get(key);
+  lock.table.hot_keys[lock.segment].access(key);
+  auto value = lock.hash_map.get(key);
+  track_read(table_num, key);
+  return value;
+}
+
+std::vector<std::optional<std::string>> con_handler::mget_val(
+    size_t table_num, const std::vector<std::string>& keys) {
+  std::vector<SmallKey> batch(keys.begin(), keys.end());
+  std::shared_lock<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << "Getting table's with number " << table_num << " "
+         << keys.size() << " keys" << endl;
+  }
+  Table& table = find_table(table_num);
+  // keys are grouped by segment, each group is read under its mutex
+  std::vector<std::vector<size_t>> positions(table.hash_map.segments());
+  for (size_t i = 0; i < batch.size(); i++) {
+    positions[table.hash_map.segment_of(batch[i])].push_back(i);
+  }
+  std::vector<std::optional<std::string>> values(keys.size());
+  std::vector<SmallKey> group;
+  for (size_t segment = 0; segment < positions.size(); segment++) {
+    if (positions[segment].empty()) {
+      continue;
+    }
+    group.clear();
+    for (size_t i : positions[segment]) {
+      group.push_back(std::move(batch[i]));
+    }
+    std::lock_guard<std::mutex> sl(table.hash_map.mutex(segment));
+    for (size_t i : positions[segment]) {
+      table.hot_keys[segment].access(keys[i]);
+    }
+    auto found = table.hash_map.segment(segment).get_many(group);
+    for (size_t j = 0; j < found.size(); j++) {
+      size_t i = positions[segment][j];
+      values[i] = std::move(found[j]);
+      track_read(table_num, keys[i]);
+    }
+  }
+  return values;
+}
+
+std::optional<std::vector<std::pair<std::string, std::string>>>
+con_handler::range_val(size_t table_num, const std::string& from,
+                       const std::string& to, size_t limit) {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << "Getting table's with number " << table_num << " keys from "
+         << from << " to " << to << endl;
+  }
+  TableMap& hash_map = find_table(table_num).hash_map;
+  if (!hash_map.has_index()) {
+    return std::nullopt;
+  }
+  size_t before = hash_map.memory_usage();
+  auto records = hash_map.range(from, to, limit);
+  // expired records are removed
+  update_used_memory(before, hash_map.memory_usage());
+  for (const auto& record : records) {
+    track_read(table_num, record.first);
+  }
+  return records;
 }
 
-std::string con_handler::remove_table(size_t table_num) {
-  std::lock_guard<std::mutex> lg(mutex_);
+std::string con_handler::run_script(size_t table_num, const Script& script,
+                                    const std::vector<std::string>& args) {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  if (VERBOSE) {
+    cout << "Running script " << Script::id(script.source())
+         << " on table with number " << table_num << endl;
+  }
+  Table& table = find_table(table_num);
+  if (script.writes()) {
+    check_record_quota(table, nullptr, "");
+  }
+  TableMap& hash_map = table.hash_map;
+  size_t before = hash_map.memory_usage();
+  std::optional<std::string> result;
+  std::string error;
+  try {
+    result = script.run(hash_map, args, [this, table_num](const std::string& key) {
+      key_changed(table_num, key);
+    });
+  } catch (ScriptError& err) {
+    error = err.what();  // changes made before the error are kept
+  }
+  update_used_memory(before, hash_map.memory_usage());
+  evict_global();
+  if (!error.empty()) {
+    if (VERBOSE) {
+      cout << "Script failed: " << error << endl;
+    }
+    return "error script=" + error;
+  }
+  if (!result) {
+    return "ok table=" + std::to_string(table_num);
+  }
+  return "ok value=" + *result + " table=" + std::to_string(table_num);
+}
+
+std::shared_ptr<const Script> con_handler::load_script(
+    const std::string& source, std::string& error) {
+  try {
+    return scripts.load(source);
+  } catch (ScriptError& err) {
+    error = err.what();
+    if (VERBOSE) {
+      cout << "Script is not compiled: " << error << endl;
+    }
+    return nullptr;
+  }
+}
+
+std::shared_ptr<const Script> con_handler::find_script(const std::string& id) {
+  return scripts.find(id);
+}
+
+std::string con_handler::remove_table(size_t table_num,
+                                      const std::string& username) {
+  std::lock_guard<std::shared_mutex> lg(mutex_);
   if (VERBOSE) {
     cout << "Removing table with number " << table_num << endl;
   }
-  tables[table_num].valid = false;
-  tables[table_num].hash_map.free_hash_map();
+  Table& table = find_table(table_num, &username);
+  table.valid = false;
+  used_memory -= table.hash_map.memory_usage();
+  table.hash_map.free_hash_map();
+  for (HotKeys& keys : table.hot_keys) {
+    keys.clear();
+  }
   size--;  
+  replicate("remtable " + std::to_string(table_index(table_num)) + "\n");
+  invalidate_table(table_index(table_num), true);
+  publish_table(table_index(table_num), true);
   if (VERBOSE) {
     cout << "Table number " << table_num << " was successfully deleted."
          << endl;
@@ -116,98 +1324,271 @@ std::string con_handler::parse_command_str(std::string str) {
     cout << "Command is " << token << ". Parsing command..." << endl;
   }
   try {
+    if (read_only && is_write_command(token)) {
+      return "error readonly";
+    }
+    if (token == "replicate") {
+      return start_replication();
+    }
+    if (token == "cluster") {
+      return cluster_map();
+    }
+    if (token == "userstats") {
+      return user_stats_str(username);
+    }
+    if (token == "memstats") {
+      return memory_stats_str();
+    }
+    if (token == "tracking") {
+      std::getline(ss, token, ' ');
+      if (!line_mode || replica) {
+        return "error tracking";  // invalidations need a persistent connection
+      }
+      if (token == "on") {
+        return start_tracking(std::nullopt);
+      } else if (token == "off") {
+        return stop_tracking();
+      }
+      return start_tracking(std::stoi(token.substr(6)));
+    }
     if (token == "addtable") {
-      if (ntables <= size) {
-        if (VERBOSE) {
-          cout << "Table limit exceeded." << endl;
+      size_t segments = table_segments;
+      if (std::getline(ss, token, ' ') && token.rfind("segments=", 0) == 0) {
+        std::string value = token.substr(9);
+        segments = value == "auto" ? 0 : std::stoul(value);
+        if (value != "auto" && !TableMap::valid_segments(segments)) {
+          return "error segments=" + value;
         }
-        return get_table_error(ntables);  // too much
-      } else {
-        return add_table(username);
       }
+      return add_table(username, segments);
     } else if (token == "remtable") {
       std::getline(ss, token, ' ');
-      size_t num = std::stoi(token);
-      if (is_valid_table(num)) {
-        if (tables[num].username == username) {
-          return remove_table(num);
-        } else {
-          if (VERBOSE) {
-            cout << "Table number " << num << " does not belong to user "
-                 << username
-                 << " (this user does not have privileges to delete)." << endl;
-          }
-          return get_table_error(num);  // rights issues
-        }
-      } else {
-        if (VERBOSE) {
-          cout << "There is no table with number " << num << endl;
-        }
-        return get_table_error(num);  // no such idx
-      }
+      return remove_table(std::stoi(token), username);
     } else if (token == "gettable") {
+      std::getline(ss, token, ' ');
+      return get_table(std::stoi(token), username);
+    } else if (token == "hotkeys") {
+      std::getline(ss, token, ' ');
+      return hot_keys(std::stoi(token), username);
+    } else if (token == "addindex" || token == "remindex") {
+      bool enabled = token == "addindex";
+      std::getline(ss, token, ' ');
+      return set_index(std::stoi(token), username, enabled);
+    } else if (token == "subscribe" || token == "unsubscribe") {
+      std::string command = token;
       std::getline(ss, token, ' ');
       size_t num = std::stoi(token);
-      if (is_valid_table(num)) {
-        if (tables[num].username == username) {
-          return get_table(num);
-        } else {
-          if (VERBOSE) {
-            cout << "Table number " << num << " does not belong to user "
-                 << username
-                 << " (this user does not have privileges to get it's full "
-                    "content, try get values by the keys)."
-                 << endl;
+      std::string policy;
+      std::getline(ss, policy, ' ');
+      if (!line_mode || replica ||
+          (!policy.empty() && policy != "drop" && policy != "close")) {
+        return "error subscribe";  // events need a persistent connection
+      }
+      return command == "subscribe"
+                 ? start_subscription(num, username, policy == "drop")
+                 : stop_subscription(num, username);
+    } else if (token == "eval" || token == "evalsha" ||
+               token == "scriptload") {
+      std::string command = token;
+      size_t table_num = 0;
+      if (command != "scriptload") {
+        std::getline(ss, token, ' ');
+        table_num = std::stoi(token.substr(6));
+      }
+      std::vector<std::string> args;
+      std::shared_ptr<const Script> script;
+      while (std::getline(ss, token, ' ')) {
+        if (command == "evalsha" && token.rfind("sha=", 0) == 0) {
+          script = find_script(token.substr(4));
+          if (!script) {
+            return "error sha=" + token.substr(4);  // not loaded or dropped
           }
-          return get_table_error(num);  // rights issues
-        }
-      } else {
-        if (VERBOSE) {
-          cout << "There is no table with number " << num << endl;
+        } else if (command != "evalsha" && token.rfind("script=", 0) == 0) {
+          std::string rest, error;  // the script is the rest of the line
+          std::getline(ss, rest);
+          script = load_script(
+              token.substr(7) + (rest.empty() ? "" : " " + rest), error);
+          if (!script) {
+            return "error script=" + error;
+          }
+        } else if (token.rfind("arg=", 0) == 0) {
+          args.push_back(token.substr(4));
         }
-        return get_table_error(num);  // no such idx
       }
+      if (!script) {
+        return "error script";
+      }
+      if (command == "scriptload") {
+        return "ok sha=" + Script::id(script->source());
+      }
+      if (read_only && script->writes()) {
+        return "error readonly";
+      }
+      return run_script(table_num, *script, args);
+    } else if (token == "dumptable" || token == "loadtable") {
+      std::string command = token;
+      std::getline(ss, token, ' ');
+      size_t num = std::stoi(token);
+      std::string file;
+      std::getline(ss, file, ' ');
+      return command == "dumptable" ? dump_table(num, username, file)
+                                    : load_table(num, username, file);
     } else if (token == "setval") {
       std::getline(ss, token, ' ');
-      size_t key = std::stoi(token.substr(4));
+      std::string key = token.substr(4);
       std::getline(ss, token, ' ');
       std::string val = token.substr(4);
       std::getline(ss, token, ' ');
       size_t table_num = std::stoi(token.substr(6));
       std::getline(ss, token, ' ');
-      size_t ttl = std::stoi(token.substr(4));
+      size_t ttl = parse_ttl(token);
 
-      if (is_valid_table(table_num)) {
-        set_val(table_num, key, val, ttl);
+      if (set_val(table_num, key, val, ttl)) {
         return "";
-      } else {
-        return get_table_error(table_num);
       }
+      return get_key_error(key);
     } else if (token == "getval") {
       std::getline(ss, token, ' ');
-      size_t key = std::stoi(token.substr(4));
+      std::string key = token.substr(4);
       std::getline(ss, token, ' ');
       size_t table_num = std::stoi(token.substr(6));
 
-      if (is_valid_table(table_num)) {
-        auto value = get_val(table_num, key);
-        if (value != std::nullopt) {
-          return get_okey(key, *value, table_num);
-        } else {
+      auto value = get_val(table_num, key);
+      if (value != std::nullopt) {
+        return get_okey(key, *value, table_num);
+      } else {
+        return get_key_error(key);
+      }
+    } else if (token == "mgetval") {
+      std::getline(ss, token, ' ');
+      size_t table_num = std::stoi(token.substr(6));
+      std::vector<std::string> keys;
+      while (std::getline(ss, token, ' ')) {
+        keys.push_back(token.substr(4));
+      }
+
+      auto values = mget_val(table_num, keys);
+      std::string result;
+      for (size_t i = 0; i < keys.size(); i++) {
+        if (i > 0) {
+          result += "\n";
+        }
+        result += values[i] ? get_okey(keys[i], *values[i], table_num)
+                            : get_key_error(keys[i]);
+      }
+      return result;
+    } else if (token == "rangeval") {
+      std::getline(ss, token, ' ');
+      size_t table_num = std::stoi(token.substr(6));
+      std::getline(ss, token, ' ');
+      std::string from = token.substr(5);
+      std::getline(ss, token, ' ');
+      std::string to = token.substr(3);
+      std::getline(ss, token, ' ');
+      size_t limit = std::min<size_t>(std::stoul(token.substr(6)),
+                                      MAX_RANGE_RECORDS);
+
+      auto records = range_val(table_num, from, to, limit);
+      if (!records) {
+        return "error index=" + std::to_string(table_num);
+      }
+      std::string result;
+      for (const auto& [key, value] : *records) {
+        if (!result.empty()) {
+          result += "\n";
+        }
+        result += get_okey(key, value, table_num);
+      }
+      return result;
+    } else if (token == "incr" || token == "decr") {
+      bool decrement = token == "decr";
+      std::getline(ss, token, ' ');
+      std::string key = token.substr(4);
+      std::getline(ss, token, ' ');
+      size_t table_num = std::stoi(token.substr(6));
+      std::getline(ss, token, ' ');
+      int64_t delta = std::stoll(token.substr(3));
+      std::getline(ss, token, ' ');
+      size_t ttl = parse_ttl(token);
+
+      auto value = incr_val(table_num, key, decrement ? -delta : delta, ttl);
+      if (value != std::nullopt) {
+        return get_okey(key, std::to_string(*value), table_num);
+      }
+      return get_key_error(key);
+    } else if (token == "setnx" || token == "getset" || token == "cas") {
+      std::string command = token;
+      std::getline(ss, token, ' ');
+      std::string key = token.substr(4);
+      std::getline(ss, token, ' ');
+      std::string val = token.substr(4);
+      std::getline(ss, token, ' ');
+      size_t table_num = std::stoi(token.substr(6));
+      std::getline(ss, token, ' ');
+      size_t ttl = parse_ttl(token);
+
+      if (command == "setnx") {
+        return setnx_val(table_num, key, val, ttl) ? "" : get_key_error(key);
+      } else if (command == "getset") {
+        bool stored;
+        auto previous = getset_val(table_num, key, val, ttl, stored);
+        if (!stored) {
           return get_key_error(key);
         }
+        return previous ? get_okey(key, *previous, table_num) : "";
       } else {
-        if (VERBOSE) {
-          cout << "There is no table with number " << table_num << endl;
+        std::getline(ss, token, ' ');
+        uint64_t version = std::stoull(token.substr(4));
+        auto new_version = cas_val(table_num, key, val, ttl, version);
+        if (new_version == std::nullopt) {
+          return get_key_error(key);
         }
-        return get_table_error(table_num);
+        return "ok key=" + key +
+               " ver=" + std::to_string(*new_version) +
+               " table=" + std::to_string(table_num);
+      }
+    } else if (token == "gets") {
+      std::getline(ss, token, ' ');
+      std::string key = token.substr(4);
+      std::getline(ss, token, ' ');
+      size_t table_num = std::stoi(token.substr(6));
+
+      auto value = gets_val(table_num, key);
+      if (value != std::nullopt) {
+        return get_okey(key, value->first, table_num) +
+               " ver=" + std::to_string(value->second);
       }
+      return get_key_error(key);
+    } else if (token == "touch" || token == "ttl" || token == "persist") {
+      std::string command = token;
+      std::getline(ss, token, ' ');
+      std::string key = token.substr(4);
+      std::getline(ss, token, ' ');
+      size_t table_num = std::stoi(token.substr(6));
+
+      if (command == "ttl") {
+        auto ttl = ttl_val(table_num, key);
+        if (ttl == std::nullopt) {
+          return get_key_error(key);
+        }
+        return "ok key=" + key +
+               " ttl=" + std::to_string(*ttl) +
+               " table=" + std::to_string(table_num);
+      }
+      std::optional<time_t> ttl;  // persist by default
+      if (command == "touch") {
+        std::getline(ss, token, ' ');
+        ttl = parse_ttl(token);
+      }
+      return expire_val(table_num, key, ttl) ? "" : get_key_error(key);
     } else {
       if (VERBOSE) {
         cout << "Unknown command" << endl;
       }
     }
     return "";
+  } catch (RequestError& err) {
+    return err.what();  // the table or the quota of the command
   } catch (std::exception& err) {
     cout << "Request parsing failed: " << err.what() << endl;
     return "";
@@ -215,15 +1596,44 @@ std::string con_handler::parse_command_str(std::string str) {
   return "";
 }
 
-bool con_handler::is_valid_table(size_t table_num) {
-  std::lock_guard<std::mutex> lg(mutex_);
+bool con_handler::is_write_command(const std::string& command) {
+  static const std::vector<std::string> WRITE_COMMANDS = {
+      "addtable", "remtable", "setval",  "incr",    "decr",     "setnx",
+      "getset",   "cas",      "touch",   "persist", "loadtable", "replicate"};
+  return std::find(WRITE_COMMANDS.begin(), WRITE_COMMANDS.end(), command) !=
+         WRITE_COMMANDS.end();
+}
+
+Table& con_handler::find_table(size_t table_num, const std::string* owner) {
   if (VERBOSE) {
     cout << "Checking whether table is valid..." << endl;
-  }  
-  return tables.size() > table_num && tables[table_num].valid;
+  }
+  if (!owns_table(table_num) || tables.size() <= table_index(table_num) ||
+      !tables[table_index(table_num)].valid) {
+    if (VERBOSE) {
+      cout << "There is no table with number " << table_num << endl;
+    }
+    throw RequestError(get_table_error(table_num));
+  }
+  Table& table = tables[table_index(table_num)];
+  if (owner && table.username != *owner) {
+    if (VERBOSE) {
+      cout << "Table number " << table_num << " does not belong to user "
+           << *owner << endl;
+    }
+    throw RequestError(get_table_error(table_num));  // rights issues
+  }
+  return table;
 }
 
 std::string con_handler::get_table_error(size_t table) {
+  if (!owns_table(table)) {
+    if (VERBOSE) {
+      cout << "Table numbered " << table << " belongs to another node."
+           << endl;
+    }
+    return moved_error(table);
+  }
   if (VERBOSE) {
     cout << "Table error occured. Table numbered " << table << " is incorrect."
          << endl;
@@ -233,25 +1643,100 @@ std::string con_handler::get_table_error(size_t table) {
   return result;
 }
 
-std::string con_handler::get_key_error(size_t key) {
+std::string con_handler::get_key_error(const std::string& key) {
   if (VERBOSE) {
     cout << "Key error occured. Key" << key << " is incorrect." << endl;
   }
   std::string result = "error key=";
-  result += std::to_string(key);
+  result += key;
   return result;
 }
 
-std::string con_handler::get_okey(size_t key, std::string value, size_t table) {
+std::string con_handler::get_file_error(const std::string& file) {
+  if (VERBOSE) {
+    cout << "File error occured. File " << file << " cannot be used." << endl;
+  }
+  return "error file=" + file;
+}
+
+std::optional<std::filesystem::path> con_handler::table_file_path(
+    const std::string& file) {
+  if (file.empty() || file == "." || file == ".." ||
+      file.find_first_of("/\\:") != std::string::npos) {
+    return std::nullopt;
+  }
+  return std::filesystem::path(data_dir) / file;
+}
+
+std::string con_handler::get_okey(const std::string& key, std::string value,
+                                  size_t table) {
   if (VERBOSE) {
     cout << "Key and table are correct. Table number: " << table
          << " key: " << key << " value: " << value << endl;
   }
   std::string result = "ok key=";
-  result += std::to_string(key);
+  result += key;
   result += " value=";
   result += value;
   result += " table=";
   result += std::to_string(table);
   return result;
 }
+
+void HashServer::split_tables() {
+  auto full = [](Table& table, size_t records) {
+    return table.valid && table.auto_segments &&
+           table.hash_map.segments() < max_auto_segments &&
+           records >= table.hash_map.segments() * SEGMENT_RECORDS;
+  };
+  std::vector<size_t> split;
+  {
+    std::shared_lock<std::shared_mutex> lg(mutex_);
+    for (size_t index = 0; index < tables.size(); index++) {
+      if (full(tables[index], count_records(tables[index].hash_map))) {
+        split.push_back(index);
+      }
+    }
+  }
+  if (split.empty()) {
+    return;  // the common case, writers are not stopped
+  }
+  std::lock_guard<std::shared_mutex> lg(mutex_);
+  for (size_t index : split) {
+    Table& table = tables[index];
+    TableMap& hash_map = table.hash_map;
+    if (!full(table, hash_map.records())) {
+      continue;  // removed or shrunk since it was counted
+    }
+    size_t before = hash_map.memory_usage();
+    hash_map.split();
+    // keys moved to the new segments, a key must be counted in one only
+    table.hot_keys = std::vector<HotKeys>(hash_map.segments());
+    con_handler::update_used_memory(before, hash_map.memory_usage());
+    if (VERBOSE) {
+      cout << "Table was split into " << hash_map.segments()
+           << " segments." << endl;
+    }
+  }
+  con_handler::evict_global();
+}
+
+void HashServer::start_tracking_timer() {
+  tracking_timer_.expires_after(std::chrono::seconds(TRACKING_INTERVAL));
+  tracking_timer_.async_wait([this](const boost::system::error_code& err) {
+    if (err) {
+      return;
+    }
+    {
+      std::shared_lock<std::shared_mutex> lg(mutex_);
+      count_owned_records();
+      expire_tracked_keys();
+      std::lock_guard<std::mutex> nl(notify_mutex);
+      publish_expirations();
+      listening = !replicas.empty() || !tracked_keys.empty() ||
+                  !table_trackers.empty() || !subscribers.empty();
+    }
+    split_tables();
+    start_tracking_timer();
+  });
+}
@@ -2,10 +2,23 @@
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <atomic>
+#include <deque>
+#include <filesystem>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
 #include <vector>
 
+#include "HashCluster.h"
+#include "HashHotKeys.h"
 #include "HashMap.h"
+#include "HashQuota.h"
+#include "HashResponse.h"
+#include "HashScript.h"
+#include "HashSegments.h"
 #include "HashServerConfig.h"
 
 using namespace boost::asio;
@@ -14,10 +27,40 @@ using std::cout;
 using std::endl;
 struct Table;
 
+/// Hash map of a table, keys are strings (short ones are stored inline)
+using TableMap = SegmentedMap<SmallKey>;
+
+/// Error of a request found while it is executed, what() is the response
+class RequestError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
 extern std::vector<Table> tables;
 extern size_t size;
-extern std::mutex mutex_;
+extern std::shared_mutex mutex_;
+extern std::mutex notify_mutex;
+extern std::atomic<bool> listening;
 extern size_t ntables;
+extern size_t maxtblsz;
+extern size_t maxmem;
+extern size_t tblmem;
+extern std::atomic<size_t> used_memory;
+extern EvictionPolicy evict_policy;
+extern size_t compress_threshold;
+extern size_t table_segments;
+extern size_t max_auto_segments;
+extern std::string data_dir;
+extern size_t outq_high;
+extern size_t outq_low;
+extern size_t idle_timeout;
+extern size_t read_timeout;
+extern size_t sub_buffer;
+extern std::atomic<size_t> connections;
+extern size_t user_tables;
+extern size_t user_records;
+extern UserQuotas user_quotas;
+extern bool read_only;
 extern bool VERBOSE;
 
 
@@ -28,6 +71,9 @@ extern bool VERBOSE;
  * \brief Table struct that stores hash table, creator and validity information
  *
  * When table is deleted, it becomes invalid. Each table has an owner.
+ * getval, mgetval and setval sample accesses to keys in hot_keys, one
+ * HotKeys per segment of hash_map (guarded by the mutex of the segment).
+ * A table with auto_segments is split when its segments get full.
  *
  *
  * \author $Author: Liliya Makhmutova $
@@ -38,8 +84,11 @@ extern bool VERBOSE;
  */
 struct Table {
   std::string username;
-  HashMap hash_map;
+  TableMap hash_map;
   bool valid;
+  std::vector<HotKeys> hot_keys;
+  bool auto_segments;
+  UserStats* owner = nullptr;  /// statistics of username, found once
 };
 
 /**
@@ -55,6 +104,45 @@ struct Table {
  * If unsuccessful, prints error to the stderr.
  * Prints dubug messages is VERBOSE mode is on.
  *
+ * If the first request of a connection has no '\n', the connection is a
+ * one-shot one: the request ends at EOF (the client shuts down sending) or
+ * when the client sends nothing more for ONE_SHOT_WAIT, the response is
+ * written as is and the connection is closed. Reading goes on until the
+ * first '\n', so a long first line or a line split between segments is not
+ * taken for a one-shot request. Otherwise every '\n'-terminated line is a
+ * request, responses are '\n'-terminated and the connection stays open, so
+ * requests can be pipelined. Responses are queued in a ResponseBuffer and
+ * written with gather writes, getval is answered straight into it (see
+ * execute_getval). Reading is paused while queued bytes exceed outq_high and is resumed
+ * when they drop below outq_low. All handlers of a connection run in a strand.
+ *
+ * A connection is closed if it sends nothing for idle_timeout seconds or if a
+ * started request is not completed in read_timeout seconds.
+ *
+ * After "replicate" request the connection becomes a follower connection:
+ * it gets the replication stream (see HashReplica.h) instead of responses
+ * and has no timeouts. Changes made while the snapshot is sent follow the
+ * snapshot. It is closed if the follower lags by more than MAX_REPLICA_LAG
+ * bytes, then the follower reconnects and resyncs.
+ *
+ * After "tracking" request the connection gets invalidations of keys it has
+ * read or of tables it tracks (see HashTracking.h) between responses. It is
+ * closed if its output queue exceeds outq_high, so its client drops the
+ * whole cache instead of using stale values.
+ *
+ * After "subscribe" request the connection gets change events of the table
+ * (see HashPubSub.h). Events are shared by all subscribers, they are posted
+ * to a small inbox of the connection under its own mutex, so the publisher
+ * does not wait for the strand, and are written with responses. Events not
+ * written yet are bounded by sub_buffer bytes.
+ *
+ * A command resolves its table once, under the same lock it is executed with
+ * (see find_table), so a table can not be removed or moved by addtable
+ * between the check and the change. Methods that take table_num throw
+ * RequestError with the table error string if the table is not valid or,
+ * for commands of the owner, belongs to another user, and
+ * parse_command_str responds with it.
+ *
  *
  * \author $Author: Liliya Makhmutova $
  *
@@ -72,7 +160,16 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    * \param io_context an io_context& argument.
    */
   explicit con_handler(boost::asio::io_context& io_context)
-      : socket_(io_context) {}
+      : socket_(io_context),
+        strand_(io_context.get_executor()),
+        timer_(io_context) {}
+
+  /// A destructor. Decreases number of connections if it was counted.
+  ~con_handler() {
+    if (counted) {
+      connections--;
+    }
+  }
 
   /**
    * A static member function that creates pointer to the connection
@@ -85,15 +182,19 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
   /// socket getter
   tcp::socket& socket() { return socket_; }
 
-  /// starts anync_read of the socket
+  /// counts the connection and starts anync_read of the socket
   void start();
 
+  /// rejects the connection with "error busy" response
+  void reject();
+
   /** \brief Method that invokes after user's response has been read.
    * \param err contains all information on error.
    * \param bytes_transferred contains number of bytes read
    *
    * This method checks whether no error occured.
-   * If yes, it sends response asychronically.
+   * If yes, it parses complete requests and queues responses.
+   * Then it continues reading unless the output queue is above outq_high.
    * If no, it prints error to stderr and closes the socket.
    *
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
@@ -106,6 +207,7 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    * \param bytes_transferred contains number of bytes read
    *
    * This method checks whether no error occured.
+   * If yes, it writes the rest of the queue and resumes paused reading.
    * If no, it prints error to stderr and closes the socket.
    *
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
@@ -113,30 +215,208 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
   void handle_write(const boost::system::error_code& err,
                     size_t bytes_transferred);
 
+  /** \brief Method that invokes after idle or read timer has expired.
+   * \param err contains all information on error.
+   *
+   * Closes the socket unless the timer was cancelled or restarted. If the
+   * first message has no '\n' yet, executes it as a one-shot request.
+   *
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  void handle_timeout(const boost::system::error_code& err);
+
+  /** \brief Method that puts response to the output queue.
+   * \param response string to send to the user
+   *
+   * Starts writing if no write is in progress.
+   */
+  void queue_response(std::string response);
+
+  /** \brief Method that queues replication record in the connection strand.
+   * \param record replication record
+   *
+   * Can be called from any thread, records are queued in the order of calls.
+   * Records of changes made while the snapshot is sent are held and queued
+   * right after the snapshot.
+   *
+   * \warning this finction must be called under mutex lock and notify_mutex
+   * or under unique mutex lock
+   */
+  void post_replica_record(std::string record);
+
+  /** \brief Method that queues invalidation in the connection strand.
+   * \param message invalidation line without '\n'
+   *
+   * Can be called from any thread. Ignored if tracking is off.
+   */
+  void post_invalidation(std::string message) {
+    boost::asio::post(strand_,
+                      boost::bind(&con_handler::queue_invalidation,
+                                  shared_from_this(), std::move(message)));
+  }
+
+  /** \brief Method that queues a change event of a subscribed table.
+   * \param event event line shared by all subscribers
+   *
+   * Can be called from any thread. If events of the connection exceed
+   * sub_buffer, the event is dropped or the connection is closed, as its
+   * subscription asked.
+   */
+  void post_event(const std::shared_ptr<const std::string>& event);
+
   /** \brief Method that adds table with username to tables.
    * \param username string contains username
    *
    * This method adds new table with empty hashmap, username.
    * Each table has a unique number (just like id field in database)
-   * that equals to its position in vector of tables.
-   * Increases size by 1.
+   * that equals to its position in vector of tables. In cluster mode it is
+   * the next number owned by this node (see HashCluster.h).
+   * Increases size by 1. Fails if there are ntables tables, the table does
+   * not fit into maxmem or the user already owns user_tables tables.
+   * \param segments number of segments of the hash map, 0 means automatic
+   * (one segment that is split while the table grows)
+   *
+   * The hash map is a spare one built at startup (see preallocate_tables) or
+   * is built before the exclusive lock is taken, so its buckets are not
+   * allocated under the lock. A spare map of a rejected request is put back.
    *
    * \warning this finction uses mutex lock_guard
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  std::string add_table(std::string username);
+  std::string add_table(std::string username, size_t segments);
 
   /** \brief Method that gets all contents of a table with table_num number.
    * \param table_num table unique number
+   * \param username user of the request, it must own the table
    *
    * This method gets all contents of a table with table_num number.
+   * Segments are read one by one, each under its own mutex, so writers of
+   * the other segments are not stopped.
    *
    * \return Outputs string in the format: "key1:value1\nkey2:value2..."
    *
+   * \warning this finction uses shared mutex lock
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::string get_table(size_t table_num, const std::string& username);
+
+  /** \brief Method that checks the record quota of the owner of a table.
+   * \param table table to write to
+   * \param segment hash map of the segment of the key, nullptr if any key
+   * may be added
+   * \param key key to write
+   *
+   * Records of users are counted every TRACKING_INTERVAL seconds, so a user
+   * can go over user_records by the writes of one interval.
+   *
+   * Throws RequestError "error quota=records" if the owner has user_records
+   * records and the write may add a new one.
+   *
+   * \warning this finction must be called under mutex lock and the mutex of
+   * the segment
+   */
+  static void check_record_quota(const Table& table, TableMap::Map* segment,
+                                 const SmallKey& key);
+
+  /** \brief Method that gets usage statistics of a user.
+   * \param username user of the request, only its own usage is returned
+   *
+   * \return "ok user=user ops=count bytes=count rejected=count tables=count
+   * records=count" string. A user over UserQuotas::MAX_USERS gets the
+   * shared "*" entry its requests are counted in.
+   */
+  std::string user_stats_str(const std::string& username);
+
+  /** \brief Method that gets placement of bucket arrays of tables.
+   *
+   * \return "ok numa=placement prefault=on|off huge_pages=mode arrays=count
+   * bytes=count huge=bytes" string, then "ok node=node bytes=count" strings
+   * of NUMA nodes, separated by newline, see table_memory_stats.
+   */
+  static std::string memory_stats_str();
+
+  /** \brief Method that writes a table in HashMap::dump format.
+   * \param hash_map hash map of the table
+   * \param out output stream, it must support seekp
+   *
+   * Segments are copied one by one under their mutexes and written after
+   * the mutex is released, the header is written again with the number of
+   * records at the end.
+   *
+   * \return number of written records.
+   *
+   * \warning this finction must be called under mutex lock
+   */
+  static size_t dump_segments(TableMap& hash_map, std::ostream& out);
+
+  /** \brief Method that gets the most used keys of a table.
+   * \param table_num table unique number
+   * \param username user of the request, it must own the table
+   *
+   * Keys are found by sampling of getval, mgetval and setval (see HotKeys).
+   * Statistics of the segments are read one by one under shared lock and the
+   * mutex of the segment, so the table keeps serving.
+   *
+   * \return "ok key=key hits=count table=table" strings of hot keys separated
+   * by newline, most used first, hits are estimated numbers of accesses.
+   *
    * \warning this finction uses mutex lock_guard
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  std::string get_table(size_t table_num);
+  std::string hot_keys(size_t table_num, const std::string& username);
+
+  /** \brief Method that builds or drops the ordered index of a table.
+   * \param table_num table unique number
+   * \param username user of the request, it must own the table
+   * \param enabled true to build the index, false to drop it
+   *
+   * The index (see OrderedIndex) is needed by rangeval. It is kept by this
+   * node only, it is not replicated.
+   *
+   * \return "ok table=table records=count" string.
+   *
+   * \warning this finction uses mutex lock_guard
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::string set_index(size_t table_num, const std::string& username,
+                        bool enabled);
+
+  /** \brief Method that writes all records of a table to a file.
+   * \param table_num table unique number
+   * \param username user of the request, it must own the table
+   * \param file name of the file in the data directory
+   *
+   * Records are written in HashMap::dump format. Segments are copied one by
+   * one, each under its own mutex, and written to the file after it is
+   * released, so writers are not stopped by the disk.
+   *
+   * \return "ok table=table records=count" string, file error string if the
+   * file cannot be written.
+   *
+   * \warning this finction uses shared mutex lock
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::string dump_table(size_t table_num, const std::string& username,
+                         const std::string& file);
+
+  /** \brief Method that puts records from a file into a table.
+   * \param table_num table unique number
+   * \param username user of the request, it must own the table
+   * \param file name of the file written by dump_table in the data directory
+   *
+   * The records replace the records of the table. They are read by
+   * HashMap::load into a new hash map, which reserves buckets for all of
+   * them and does not parse commands. The file is read without locks, the
+   * exclusive lock is taken only to swap the new hash map in.
+   *
+   * \return "ok table=table records=count" string, file error string if the
+   * file cannot be read or is not a dump (then the table is not changed).
+   *
+   * \warning this finction uses mutex lock_guard
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::string load_table(size_t table_num, const std::string& username,
+                         const std::string& file);
 
   /** \brief Method that sets value in table by key with ttl.
    * \param table_num table unique number
@@ -144,11 +424,16 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    * \param val value in HashMap
    * \param ttl time in seconds that this value exists in the table
    *
+   * If maxmem is exceeded after that, records of other tables are evicted.
    *
-   * \warning this finction uses mutex lock_guard
+   * \return false if the value does not fit into the table limits.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  void set_val(size_t table_num, int key, std::string val, time_t ttl);
+  bool set_val(size_t table_num, const std::string& key, std::string val,
+               time_t ttl);
 
   /** \brief Method that gets value in table by key.
    * \param table_num table unique number
@@ -158,13 +443,187 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    * exists and alive.
    *
    *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::optional<std::string> get_val(size_t table_num, const std::string& key);
+
+  /** \brief Method that gets values in table by a batch of keys.
+   * \param table_num table unique number
+   * \param keys in HashMap
+   *
+   * \return values in the order of keys, nullopt for absent ones.
+   *
+   * The whole batch is looked up under one lock by HashMap::get_many.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::vector<std::optional<std::string>> mget_val(
+      size_t table_num, const std::vector<std::string>& keys);
+
+  /** \brief Method that gets records of a table with keys in a range.
+   * \param table_num table unique number
+   * \param from the least key (inclusive)
+   * \param to the greatest key (inclusive)
+   * \param limit max number of records
+   *
+   * Keys are compared bytewise, the table must have an ordered index.
+   *
+   * \return keys and values in key order, nullopt if there is no index.
+   *
    * \warning this finction uses mutex lock_guard
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  std::optional<std::string> get_val(size_t table_num, int key);
+  std::optional<std::vector<std::pair<std::string, std::string>>> range_val(
+      size_t table_num, const std::string& from, const std::string& to,
+      size_t limit);
+
+  /** \brief Method that adds delta to integer value in table by key.
+   * \param table_num table unique number
+   * \param key in HashMap
+   * \param delta value to add (negative to decrement)
+   * \param ttl time in seconds that a new value exists in the table
+   *
+   * \return new value, nullopt if the value is not an integer.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::optional<int64_t> incr_val(size_t table_num, const std::string& key,
+                                  int64_t delta, time_t ttl);
+
+  /** \brief Method that sets value in table by key if the key is absent.
+   * \param table_num table unique number
+   * \param key in HashMap
+   * \param val value in HashMap
+   * \param ttl time in seconds that this value exists in the table
+   *
+   * \return true if the value is set.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  bool setnx_val(size_t table_num, const std::string& key, std::string val,
+                 time_t ttl);
+
+  /** \brief Method that sets value in table by key and gets the previous one.
+   * \param table_num table unique number
+   * \param key in HashMap
+   * \param val value in HashMap
+   * \param ttl time in seconds that this value exists in the table
+   * \param[out] stored false if the value does not fit into the table limits
+   *
+   * \return previous value, nullopt if there was no one.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::optional<std::string> getset_val(size_t table_num,
+                                        const std::string& key,
+                                        std::string val, time_t ttl,
+                                        bool& stored);
+
+  /** \brief Method that sets value in table by key if version is not changed.
+   * \param table_num table unique number
+   * \param key in HashMap
+   * \param val value in HashMap
+   * \param ttl time in seconds that this value exists in the table
+   * \param version expected version of the value
+   *
+   * \return new version, nullopt if the version is changed.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::optional<uint64_t> cas_val(size_t table_num, const std::string& key,
+                                  std::string val, time_t ttl,
+                                  uint64_t version);
+
+  /** \brief Method that gets value and its version in table by key.
+   * \param table_num table unique number
+   * \param key in HashMap
+   *
+   * \return value and version, nullopt if value does not exist.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::optional<std::pair<std::string, uint64_t>> gets_val(
+      size_t table_num, const std::string& key);
+
+  /** \brief Method that changes expiration time of a value in table by key.
+   * \param table_num table unique number
+   * \param key in HashMap
+   * \param ttl new time in seconds that this value exists in the table,
+   * nullopt makes the value persistent
+   *
+   * \return false if value does not exist.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  bool expire_val(size_t table_num, const std::string& key,
+                  std::optional<time_t> ttl);
+
+  /** \brief Method that gets remaining time to live of a value by key.
+   * \param table_num table unique number
+   * \param key in HashMap
+   *
+   * \return seconds, -1 for persistent value, nullopt if value does not exist.
+   *
+   * \warning this finction uses shared mutex lock and the mutex of the
+   * segment of the key
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::optional<int64_t> ttl_val(size_t table_num, const std::string& key);
+
+  /** \brief Method that runs a script on a table.
+   * \param table_num table unique number
+   * \param script compiled script (see Script)
+   * \param args values of $1..$n of the script
+   *
+   * The whole script runs under one lock, so other commands see either none
+   * or all of its changes. Changed keys are replicated and invalidated.
+   *
+   * \return "ok value=value table=table" string with the returned value,
+   * "ok table=table" if it is nil, "error script=message" on runtime error.
+   *
+   * \warning this finction uses mutex lock_guard
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::string run_script(size_t table_num, const Script& script,
+                         const std::vector<std::string>& args);
+
+  /** \brief Method that compiles a script and caches it by its id.
+   * \param source text of the script
+   *
+   * Tables are not locked: the cache has its own mutex.
+   *
+   * \return compiled script, nullptr with error string in error if it
+   * cannot be compiled.
+   */
+  std::shared_ptr<const Script> load_script(const std::string& source,
+                                            std::string& error);
+
+  /** \brief Method that finds a cached script by its id.
+   * \param id id returned by scriptload
+   *
+   * \return compiled script, nullptr if it is not cached.
+   */
+  std::shared_ptr<const Script> find_script(const std::string& id);
 
   /** \brief Method that removes table by table_num.
    * \param table_num table unique number
+   * \param username user of the request, it must own the table
    *
    * \return empty string to send to the user.
    *
@@ -173,7 +632,7 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    * \warning this finction uses mutex lock_guard
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  std::string remove_table(size_t table_num);
+  std::string remove_table(size_t table_num, const std::string& username);
 
   /** \brief Method that parses user request.
    * \param table_num table unique number
@@ -181,7 +640,9 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    * \return string to send to the user.
    *
    * Checks validity of response.
-   * Response could be: addtable, remtable, gettable, setval, getval.
+   * Response could be: addtable, remtable, gettable, setval, getval, mgetval,
+   * hotkeys, cluster, tracking, subscribe, unsubscribe, eval, evalsha,
+   * scriptload, addindex, remindex, rangeval, userstats, memstats.
    * If the response cannot be parsed, the function prints erroe to stderr.
    *
    * \warning this finction uses mutex lock_guard (it calls other functions that
@@ -190,28 +651,35 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    */
   std::string parse_command_str(std::string str);
 
-  /** \brief Method that checks whether table is valid.
+  /** \brief Method that finds the table of a request.
    * \param table_num table unique number
+   * \param owner user of a command that only the owner may run, nullptr
+   * for commands that any user may run
    *
-   * \return boolean value that indicates validity of a table
+   * \return the table, valid until the lock is released.
    *
-   * Table is valid when its number exists and it has not been removed.
+   * Table is valid when its number belongs to this node, exists and it has
+   * not been removed. Throws RequestError with the table error string if the
+   * table is not valid or is owned by another user.
    *
-   * \warning this finction uses mutex lock_guard
+   * \warning this finction must be called under mutex lock (shared or
+   * exclusive)
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  bool is_valid_table(size_t table_num);
+  static Table& find_table(size_t table_num,
+                           const std::string* owner = nullptr);
 
   /** \brief Method that returns table error string.
    * \param table_num table unique number
    *
    * \return error string
    *
-   * Returns "error table=table_num" string.
+   * Returns "error table=table_num" string, or "moved" redirect if the
+   * table belongs to another node of the cluster.
    *
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  std::string get_table_error(size_t table_num);
+  static std::string get_table_error(size_t table_num);
 
   /** \brief Method that returns key error string.
    * \param key value of key
@@ -222,7 +690,26 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    *
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  std::string get_key_error(size_t key);
+  std::string get_key_error(const std::string& key);
+
+  /** \brief Method that returns file error string.
+   * \param file name of the file
+   *
+   * \return error string
+   *
+   * Returns "error file=file" string.
+   *
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  std::string get_file_error(const std::string& file);
+
+  /** \brief Method that makes path of a file in the data directory.
+   * \param file name of the file
+   *
+   * \return path, nullopt if the name is empty or leads out of the directory.
+   */
+  std::optional<std::filesystem::path> table_file_path(
+      const std::string& file);
 
   /** \brief Method that returns ok string.
    * \param key value of key
@@ -233,13 +720,229 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
    *
    * \note Is VERBOSE flag is set it prints debug messages to stderr.
    */
-  std::string get_okey(size_t key, std::string value, size_t table);
+  std::string get_okey(const std::string& key, std::string value,
+                       size_t table);
+
+  /** \brief Method that evicts records while maxmem is exceeded.
+   *
+   * Samples EVICTION_TABLES valid tables and evicts a record from the largest
+   * of them, so memory pressure is proportional to the table size.
+   *
+   * \warning this finction must be called under exclusive mutex lock
+   * \note Is VERBOSE flag is set it prints debug messages to stderr.
+   */
+  static void evict_global();
+
+  /** \brief Method that prepares tables at startup.
+   * \param count number of tables
+   *
+   * Reserves count slots of tables and builds count empty hash maps with
+   * the segments of a new table, addtable takes them while they last.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  static void preallocate_tables(size_t count);
+
+  /** \brief Method that calls evict_global if maxmem is exceeded.
+   *
+   * Used after a change made under shared lock: takes the exclusive lock.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  static void evict_if_needed();
+
+  /** \brief Method that accounts memory change of a table in used_memory.
+   * \param before memory usage of the hash map before the change
+   * \param after memory usage of the hash map after the change
+   *
+   * Does not evict: the caller calls evict_global (under exclusive lock)
+   * or evict_if_needed (after shared lock is released).
+   */
+  static void update_used_memory(size_t before, size_t after);
 
  private:
+  static const size_t EVICTION_TABLES = 3;
   static const size_t BUFFER_SIZE = 128;  /// fixed size buffer
+  static const size_t MAX_REQUEST_SIZE = 64 * 1024;  /// max line length
+  static const size_t MAX_GATHER = 64;  /// max buffers in one write
+  static const size_t MAX_REPLICA_LAG = 256 * 1024 * 1024;  /// bytes
+  /// pause of a client that ends a one-shot request without EOF
+  static constexpr std::chrono::milliseconds ONE_SHOT_WAIT{50};
+  static constexpr size_t MAX_RANGE_RECORDS = 100000;  /// max rangeval limit
   tcp::socket socket_;
+  boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+  boost::asio::steady_timer timer_;  /// idle and read timeouts
   char in_message[BUFFER_SIZE];
-  std::string out_message;
+  std::string in_buffer;           /// received but not parsed bytes
+  ResponseBuffer out_;             /// responses not written yet
+  size_t out_writing = 0;          /// bytes of out_ in the current write
+  std::vector<boost::asio::const_buffer> write_buffers;  /// reused
+  bool line_mode = false;
+  bool first_read = true;
+  bool reading = false;
+  bool closing = false;  /// no more reads, close after the queue is written
+  bool replica = false;  /// connection of a follower
+  std::atomic<bool> tracking{false};  /// gets invalidations
+  bool track_reads = false;           /// remembers read keys, under mutex_
+  size_t replica_limit = 0;  /// max out_.size() of a follower connection
+  bool sending_snapshot = false;  /// tables of the snapshot are being queued
+  size_t snapshot_next = 0;       /// next table of the snapshot
+  size_t snapshot_tables = 0;     /// tables of the snapshot
+  /// records are held until the snapshot is queued, under notify_mutex
+  bool replica_syncing = false;
+  std::vector<std::string> replica_held;  /// held records, under notify_mutex
+  size_t replica_held_bytes = 0;          /// their size, under notify_mutex
+  std::deque<std::shared_ptr<const std::string>> event_queue;
+  std::vector<std::shared_ptr<const std::string>> event_writing;
+  std::mutex events_mutex;  /// guards the fields below
+  std::vector<std::shared_ptr<const std::string>> events;  /// inbox
+  size_t event_bytes = 0;      /// bytes of posted events not written yet
+  size_t dropped_events = 0;   /// events dropped since the last notice
+  bool drop_events = false;    /// drop events of a slow subscriber or close
+  bool events_overflow = false;  /// closed by overflow of events
+  bool counted = false;  /// connection is counted in connections
+  UserStats* user_stats = nullptr;  /// user of the last request
+
+  /// starts anync_read of the socket if it is not started yet
+  void start_read();
+
+  /// starts gather write of queued responses if no write is in progress
+  void start_write();
+
+  /// View of write_buffers passed to async_write, copied without allocation
+  struct GatherList {
+    using value_type = boost::asio::const_buffer;
+    using const_iterator = const boost::asio::const_buffer*;
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+    const_iterator first;
+    const_iterator last;
+  };
+
+  /// executes the first message as a one-shot request, closes after it
+  void execute_one_shot();
+
+  /// checks rate limits of the user of a request and counts its bytes
+  bool admit(std::string_view request);
+
+  /// checks rate limits of the user, parses a request and counts its bytes
+  std::string process(const std::string& request);
+
+  /// parses a line mode request and queues its response
+  void execute(std::string_view request);
+
+  /** \brief Method that executes a getval request without building strings.
+   * \param request line mode request
+   *
+   * Only "<user> getval key=<key> table=<table>" is executed here, the value
+   * is passed by HashMap::read and the response is formatted straight into
+   * out_, so a hit costs no allocation.
+   *
+   * \return false if the request has another form, it was not executed.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  bool execute_getval(std::string_view request);
+
+  /// queues replication record, closes the connection if follower lags
+  void queue_replica_record(std::string record);
+
+  /// closes the connection of a follower that lags too much
+  void close_lagging_replica();
+
+  /** \brief Method that queues the next table record of the snapshot.
+   *
+   * After the last table it queues held records and ends the snapshot.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  void queue_snapshot_table();
+
+  /// queues invalidation line, closes the connection if client lags
+  void queue_invalidation(std::string message);
+
+  /// moves posted events from the inbox to the output
+  void queue_events();
+
+  /// closes the connection of a subscriber that does not read its events
+  void close_slow_subscriber();
+
+  /** \brief Method that sends a change of a key to followers and trackers.
+   * \param table_num table unique number
+   * \param key changed key
+   *
+   * Does nothing while nobody listens, otherwise locks notify_mutex.
+   *
+   * \warning this finction must be called under exclusive mutex lock or
+   * under the mutex of the segment of the key
+   */
+  void key_changed(size_t table_num, const std::string& key);
+
+  /** \brief Method that remembers a read key if the connection tracks reads.
+   * \param table_num table unique number
+   * \param key read key
+   *
+   * \warning this finction must be called under exclusive mutex lock or
+   * under the mutex of the segment of the key
+   */
+  void track_read(size_t table_num, std::string_view key);
+
+  /** \brief Method that turns tracking on.
+   * \param table_num table to track all keys of, nullopt to track read keys
+   *
+   * \return "ok tracking=on" or "ok tracking=table table=table_num" string.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  std::string start_tracking(std::optional<size_t> table_num);
+
+  /** \brief Method that turns tracking off.
+   *
+   * \return "ok tracking=off" string.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  std::string stop_tracking();
+
+  /** \brief Method that subscribes the connection to changes of a table.
+   * \param table_num table unique number
+   * \param username user of the request, it must own the table
+   * \param drop true to drop events when the subscriber is slow, false to
+   * close the connection
+   *
+   * \return "ok subscribe table=table_num" string.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  std::string start_subscription(size_t table_num, const std::string& username,
+                                 bool drop);
+
+  /** \brief Method that ends a subscription of the connection.
+   * \param table_num table unique number
+   * \param username user of the request, it must own the table
+   *
+   * \return "ok unsubscribe table=table_num" string, table error string if
+   * the connection is not subscribed to it.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  std::string stop_subscription(size_t table_num, const std::string& username);
+
+  /// checks whether a command changes tables (it is rejected by followers)
+  static bool is_write_command(const std::string& command);
+
+  /** \brief Method that makes the connection a follower connection.
+   *
+   * Registers the follower and queues the snapshot record. Table records of
+   * the snapshot are queued one by one, each when the previous one is
+   * mostly written (see queue_snapshot_table), under shared lock, so the
+   * server keeps serving and tables do not wait for the follower.
+   *
+   * \return empty string, the snapshot is queued directly.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  std::string start_replication();
 };
 
 /**
@@ -252,6 +955,8 @@ class con_handler : public boost::enable_shared_from_this<con_handler> {
  * object. After handling in in con_handler class, it invokes handle_accept.
  * This function that checks for errors and reconnects if they are found,
  * otherwise continues accepting.
+ * When max_connections connections are open, new connections are rejected
+ * with "error busy" response instead of being served.
  *
  * \author $Author: Liliya Makhmutova $
  *
@@ -270,14 +975,44 @@ class HashServer {
    * 
    */
   HashServer(boost::asio::io_context& io_context, HashServerConfig config)
-      : acceptor_(
-            io_context,
-            tcp::endpoint(boost::asio::ip::address::from_string(config.ip),
-                          config.port)),
-        io_context_(io_context) {
-    start_accept();
+      : acceptor_(io_context),
+        io_context_(io_context),
+        tracking_timer_(io_context),
+        max_connections_(config.max_connections) {
+    tcp::endpoint endpoint(boost::asio::ip::address::from_string(config.ip),
+                           config.port);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen(config.backlog);
     ntables = config.ntables;
+    maxtblsz = config.maxtblsz;
+    maxmem = config.maxmem;
+    tblmem = config.tblmem;
+    evict_policy = config.evict;
+    compress_threshold = config.compress;
+    table_segments = config.segments;
+    max_auto_segments = 1;  // a segment per worker is enough
+    while (max_auto_segments <
+           std::min(config.workers, TableMap::MAX_SEGMENTS)) {
+      max_auto_segments <<= 1;
+    }
+    data_dir = config.dir;
+    set_cluster(config.cluster, config.node);
+    read_only = !config.replicaof.empty();
+    outq_high = config.outq_high;
+    outq_low = config.outq_low;
+    idle_timeout = config.idle_timeout;
+    read_timeout = config.read_timeout;
+    sub_buffer = config.sub_buffer;
+    user_quotas.set_rates(config.user_ops, config.user_bytes);
+    user_tables = config.user_tables;
+    user_records = config.user_records;
     VERBOSE = config.verbose;
+    configure_table_memory(config.prefault, config.huge_pages);
+    con_handler::preallocate_tables(config.prealloc_tables);
+    start_accept();
+    start_tracking_timer();
   }
 
   /** \brief Method that invokes after connection accepted.
@@ -286,13 +1021,21 @@ class HashServer {
    * \param err stores information on error 
    * 
    * If no error occured (or no EOF in socket) it starts asynchroniously read the socket.
+   * If max_connections is reached, the connection is rejected.
    * Otherwise it starts accept new connection.
    *   
    */
   void handle_accept(con_handler::ptr_to_connection connection,
                      const boost::system::error_code& err) {
     if (!err) {
-      connection->start();
+      if (max_connections_ && connections >= max_connections_) {
+        if (VERBOSE) {
+          cout << "Connection limit exceeded, connection is rejected." << endl;
+        }
+        connection->reject();
+      } else {
+        connection->start();
+      }
     }
     start_accept();
   }
@@ -300,6 +1043,31 @@ class HashServer {
  private:
   tcp::acceptor acceptor_;
   io_context& io_context_;
+  boost::asio::steady_timer tracking_timer_;  /// expires tracked keys
+  size_t max_connections_;
+
+  static const size_t SEGMENT_RECORDS = 1 << 16;  /// records before a split
+
+  /** \brief Method that sends invalidations of expired tracked keys and
+   * events of expired keys of subscribed tables.
+   *
+   * Repeats every TRACKING_INTERVAL seconds. Also counts records of users,
+   * splits tables with automatic segments and finds out whether anybody
+   * listens to changes. Tables are scanned under shared lock, segment by
+   * segment, so requests are not stopped.
+   */
+  void start_tracking_timer();
+
+  /** \brief Method that doubles segments of tables with auto_segments.
+   *
+   * A table is split when it has SEGMENT_RECORDS records per segment, until
+   * it has max_auto_segments segments. Tables are counted under shared
+   * lock, the exclusive lock is taken only if some table is split. Hot keys
+   * of a split table start again, its keys moved between segments.
+   *
+   * \warning this finction uses mutex lock_guard
+   */
+  void split_tables();
 
   /** \brief Method that implements acception of connection.
    *
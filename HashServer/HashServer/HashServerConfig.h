@@ -1,10 +1,46 @@
 #pragma once
+#include <string>
+
+#include "HashMap.h"
+#include "HashMemory.h"
 
 /*
-    dir         - Path to the directory where files will be stored (future)
+    dir         - Path to the directory of dumptable and loadtable files
     ip          - IP address of server listener
     port        - Port of server listener
-    maxtblsz    - Max size of hash table (records)
+    maxtblsz    - Max size of hash table (records), 0 means unlimited
+    maxmem      - Max memory of all hash tables (bytes), 0 means unlimited
+    tblmem      - Max memory of each hash table (bytes), 0 means unlimited
+    evict       - Eviction policy used when a limit is exceeded
+    outq_high   - Output queue size of a connection (bytes) that pauses reading
+    outq_low    - Output queue size of a connection (bytes) that resumes reading
+    max_connections - Max number of open connections, 0 means unlimited
+    idle_timeout    - Seconds without requests before a connection is closed
+    read_timeout    - Seconds to complete a started request
+    backlog         - Size of the queue of pending connections
+    compress        - Min size of a value to compress (bytes), 0 means never
+    segments        - Number of independently locked segments of a new table
+                      (power of two up to 64), 0 means automatic: a table
+                      is split while it grows
+    replicaof       - Address of the primary ("ip:port") if the server is its
+                      read-only follower, empty for a primary
+    cluster         - Addresses of all cluster nodes ("ip:port,ip:port,..."),
+                      empty if cluster mode is off
+    node            - Index of this server in cluster
+    sub_buffer      - Max size of events queued for a subscriber (bytes)
+    user_ops        - Max requests per second of each user, 0 means unlimited
+    user_bytes      - Max request and response bytes per second of each
+                      user, 0 means unlimited
+    user_tables     - Max number of tables of each user, 0 means unlimited
+    user_records    - Max number of records in tables of each user, 0 means
+                      unlimited
+    prealloc_tables - Number of tables prepared at startup: reserved slots
+                      and empty hash maps taken by addtable
+    prefault        - Map bucket arrays of tables with all their pages
+    huge_pages      - Huge pages of big bucket arrays: off, transparent or
+                      explicit (reserved ones)
+    numa            - NUMA placement of threads and memory: NUMA_OFF,
+                      NUMA_INTERLEAVE or a node the server runs on
     ntables     - Max number of available hash tables
     workers     - Number of threads
     verbose     - Flag that indicates that debug messages is printed to stdout
@@ -15,6 +51,29 @@ struct HashServerConfig {
   std::string ip;
   size_t port;
   size_t maxtblsz;
+  size_t maxmem;
+  size_t tblmem;
+  EvictionPolicy evict;
+  size_t outq_high;
+  size_t outq_low;
+  size_t max_connections;
+  size_t idle_timeout;
+  size_t read_timeout;
+  int backlog;
+  size_t compress;
+  size_t segments;
+  std::string replicaof;
+  std::string cluster;
+  size_t node;
+  size_t sub_buffer;
+  size_t user_ops;
+  size_t user_bytes;
+  size_t user_tables;
+  size_t user_records;
+  size_t prealloc_tables;
+  bool prefault;
+  HugePages huge_pages;
+  int numa;
   size_t ntables;
   size_t workers;
   bool verbose;
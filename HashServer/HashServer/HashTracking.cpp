@@ -0,0 +1,170 @@
+#include "HashTracking.h"
+
+#include <mutex>
+#include <optional>
+#include <set>
+#include <tuple>
+
+std::map<std::pair<size_t, std::string>,
+         std::vector<boost::weak_ptr<con_handler>>>
+    tracked_keys;
+std::map<size_t, std::vector<boost::weak_ptr<con_handler>>> table_trackers;
+
+/// Expiration times of tracked keys, by table index and key
+static std::map<std::pair<size_t, std::string>, time_t> tracked_expiring;
+
+/// The same expiration times, the earliest first
+static std::set<std::tuple<time_t, size_t, std::string>> tracked_expirations;
+
+static void forget_expiration(size_t index, const std::string& key) {
+  auto it = tracked_expiring.find({index, key});
+  if (it != tracked_expiring.end()) {
+    tracked_expirations.erase({it->second, index, key});
+    tracked_expiring.erase(it);
+  }
+}
+
+/// Keeps one expiration time per tracked key, the latest one
+static void remember_expiration(size_t index, const std::string& key,
+                                time_t expires) {
+  forget_expiration(index, key);
+  if (expires != TableMap::NEVER) {
+    tracked_expiring.emplace(std::make_pair(index, key), expires);
+    tracked_expirations.emplace(expires, index, key);
+  }
+}
+
+/// Sends a message to live connections, drops closed ones
+static void push(std::vector<boost::weak_ptr<con_handler>>& connections,
+                 const std::string& message) {
+  for (auto it = connections.begin(); it != connections.end();) {
+    if (auto connection = it->lock()) {
+      connection->post_invalidation(message);
+      it++;
+    } else {
+      it = connections.erase(it);
+    }
+  }
+}
+
+static std::string invalidation(size_t index) {
+  return "invalidate table=" + std::to_string(table_number(index));
+}
+
+void track_key(const boost::shared_ptr<con_handler>& connection, size_t index,
+               const std::string& key, time_t expires) {
+  auto tracked = tracked_keys.find({index, key});
+  if (tracked == tracked_keys.end()) {
+    if (tracked_keys.size() >= MAX_TRACKED_KEYS) {
+      auto other = tracked_keys.begin()->first;
+      invalidate_key(other.first, other.second);
+    }
+    tracked = tracked_keys.emplace(std::make_pair(index, key),
+                                   std::vector<boost::weak_ptr<con_handler>>())
+                  .first;
+  }
+  remember_expiration(index, key, expires);
+  for (const auto& tracker : tracked->second) {
+    if (tracker.lock() == connection) {
+      return;  // already tracks it
+    }
+  }
+  tracked->second.push_back(connection);
+}
+
+void track_table(const boost::shared_ptr<con_handler>& connection,
+                 size_t index) {
+  auto& trackers = table_trackers[index];
+  for (const auto& tracker : trackers) {
+    if (tracker.lock() == connection) {
+      return;
+    }
+  }
+  trackers.push_back(connection);
+}
+
+void invalidate_key(size_t index, std::string_view key) {
+  if (tracked_keys.empty() && table_trackers.empty()) {
+    return;  // nobody tracks, the common case
+  }
+  std::string message;
+  auto tracked = tracked_keys.find({index, std::string(key)});
+  if (tracked != tracked_keys.end()) {
+    message = invalidation(index) + " key=" + std::string(key);
+    push(tracked->second, message);
+    tracked_keys.erase(tracked);
+    forget_expiration(index, std::string(key));
+  }
+  auto trackers = table_trackers.find(index);
+  if (trackers != table_trackers.end()) {
+    if (message.empty()) {
+      message = invalidation(index) + " key=" + std::string(key);
+    }
+    push(trackers->second, message);
+  }
+}
+
+void invalidate_table(size_t index, bool removed) {
+  std::string message = invalidation(index);
+  // one message for every connection that tracks any key of the table
+  std::set<con_handler*> notified;
+  auto begin = tracked_keys.lower_bound({index, std::string()});
+  auto end = tracked_keys.lower_bound({index + 1, std::string()});
+  for (auto it = begin; it != end; it++) {
+    for (const auto& tracker : it->second) {
+      auto connection = tracker.lock();
+      if (connection && notified.insert(connection.get()).second) {
+        connection->post_invalidation(message);
+      }
+    }
+  }
+  tracked_keys.erase(begin, end);
+  auto first = tracked_expiring.lower_bound({index, std::string()});
+  auto last = tracked_expiring.lower_bound({index + 1, std::string()});
+  for (auto it = first; it != last; it++) {
+    tracked_expirations.erase({it->second, index, it->first.second});
+  }
+  tracked_expiring.erase(first, last);
+  auto trackers = table_trackers.find(index);
+  if (trackers != table_trackers.end()) {
+    push(trackers->second, message);
+    if (removed) {
+      table_trackers.erase(trackers);
+    }
+  }
+}
+
+void expire_tracked_keys() {
+  time_t now = time(NULL);
+  std::vector<std::pair<size_t, std::string>> expired;
+  {
+    std::lock_guard<std::mutex> nl(notify_mutex);
+    while (!tracked_expirations.empty() &&
+           std::get<0>(*tracked_expirations.begin()) < now) {
+      auto [expires, index, key] = *tracked_expirations.begin();
+      tracked_expirations.erase(tracked_expirations.begin());
+      tracked_expiring.erase({index, key});
+      expired.emplace_back(index, std::move(key));
+    }
+  }
+  for (const auto& [index, key] : expired) {
+    std::optional<std::pair<std::string, time_t>> state;
+    std::unique_lock<std::mutex> sl;
+    if (index < tables.size() && tables[index].valid) {
+      TableMap& hash_map = tables[index].hash_map;
+      SmallKey small_key(key);
+      size_t segment = hash_map.segment_of(small_key);
+      sl = std::unique_lock<std::mutex>(hash_map.mutex(segment));
+      state = hash_map.segment(segment).peek(small_key);
+    }
+    std::lock_guard<std::mutex> nl(notify_mutex);
+    if (!tracked_keys.count({index, key})) {
+      continue;  // invalidated by a change meanwhile
+    }
+    if (state && state->second >= now) {  // expiration was extended
+      remember_expiration(index, key, state->second);
+      continue;
+    }
+    invalidate_key(index, key);
+  }
+}
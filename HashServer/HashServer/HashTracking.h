@@ -0,0 +1,90 @@
+#pragma once
+#include <boost/weak_ptr.hpp>
+#include <ctime>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "HashServer.h"
+
+/*
+    Tracking of keys cached by clients.
+
+    A line mode connection sends "tracking on" and then the server remembers
+    every key it reads with getval, mgetval or gets. When such a key is
+    changed, removed, evicted or expires, the connection gets
+    "invalidate table=<no> key=<key>" line and the key is forgotten until
+    the connection reads it again. "tracking table=<no>" subscribes the
+    connection to every change of a table without remembering keys
+    (broadcast mode). When a whole table is removed or loaded, connections
+    get "invalidate table=<no>" line. Invalidations are pushed between
+    responses, so a client tells them by "invalidate " prefix.
+
+    Tables are identified by their indexes in tables, messages have table
+    numbers. All functions but expire_tracked_keys must be called under
+    exclusive mutex_ lock or under notify_mutex (by a holder of the shared
+    lock).
+*/
+
+static const size_t MAX_TRACKED_KEYS = 1'000'000;
+static const size_t TRACKING_INTERVAL = 1;  /// seconds
+
+/// Connections that track keys, by table index and key
+extern std::map<std::pair<size_t, std::string>,
+                std::vector<boost::weak_ptr<con_handler>>>
+    tracked_keys;
+
+/// Connections that track all keys of a table, by table index
+extern std::map<size_t, std::vector<boost::weak_ptr<con_handler>>>
+    table_trackers;
+
+/** \brief Remembers that a connection has read a key.
+ * \param connection tracking connection
+ * \param index index of the table in tables
+ * \param key read key
+ * \param expires time when the key expires, HashMap::NEVER if it does not
+ *
+ * If MAX_TRACKED_KEYS keys are tracked, another key is invalidated first.
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void track_key(const boost::shared_ptr<con_handler>& connection, size_t index,
+               const std::string& key, time_t expires);
+
+/** \brief Subscribes a connection to all changes of a table.
+ * \param connection tracking connection
+ * \param index index of the table in tables
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void track_table(const boost::shared_ptr<con_handler>& connection,
+                 size_t index);
+
+/** \brief Sends invalidation of a changed key to connections that track it.
+ * \param index index of the table in tables
+ * \param key changed key
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void invalidate_key(size_t index, std::string_view key);
+
+/** \brief Sends invalidation of all keys of a table.
+ * \param index index of the table in tables
+ * \param removed true if the table is removed, then its subscriptions end
+ *
+ * \warning this finction must be called under mutex lock
+ */
+void invalidate_table(size_t index, bool removed);
+
+/** \brief Sends invalidations of tracked keys that have expired.
+ *
+ * Called every TRACKING_INTERVAL seconds, because expired records are
+ * removed lazily. Records are checked under the mutexes of their segments,
+ * then notify_mutex is taken, so writers of other segments are not stopped.
+ *
+ * \warning this finction must be called under shared mutex lock, it locks
+ * notify_mutex itself
+ */
+void expire_tracked_keys();
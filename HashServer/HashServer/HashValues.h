@@ -0,0 +1,318 @@
+#pragma once
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * Functions of LZ4 block format (https://github.com/lz4/lz4): a fast LZ77
+ * compression. Compressor is greedy with one hash table probe per position.
+ */
+namespace lz4 {
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;  /// block ends with literals
+static const size_t MFLIMIT = 12;       /// last match starts before it
+static const size_t MAX_OFFSET = 65'535;
+static const unsigned HASH_LOG = 12;
+
+inline uint32_t read4(const char* p) {
+  uint32_t v;
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+/// Appends length that does not fit into 4 bits of the token
+inline void put_length(std::string& out, size_t length) {
+  for (; length >= 255; length -= 255) {
+    out.push_back(char(255));
+  }
+  out.push_back(char(length));
+}
+
+/// Appends a sequence: literals [from, to) of src and a match
+inline void put_sequence(std::string& out, std::string_view src, size_t from,
+                         size_t to, size_t offset, size_t match) {
+  size_t literals = to - from;
+  size_t match_code = match ? match - MIN_MATCH : 0;
+  out.push_back(char(((literals < 15 ? literals : 15) << 4) |
+                     (match_code < 15 ? match_code : 15)));
+  if (literals >= 15) {
+    put_length(out, literals - 15);
+  }
+  out.append(src.data() + from, literals);
+  if (match) {
+    out.push_back(char(offset & 0xFF));
+    out.push_back(char(offset >> 8));
+    if (match_code >= 15) {
+      put_length(out, match_code - 15);
+    }
+  }
+}
+
+/// Compresses src into LZ4 block
+inline std::string compress(std::string_view src) {
+  std::string out;
+  out.reserve(src.size() + src.size() / 255 + 16);
+  size_t anchor = 0;
+  if (src.size() > MFLIMIT) {
+    std::vector<uint32_t> table(size_t(1) << HASH_LOG, 0);
+    size_t limit = src.size() - MFLIMIT;
+    size_t match_limit = src.size() - LAST_LITERALS;
+    for (size_t i = 0; i < limit;) {
+      uint32_t sequence = read4(src.data() + i);
+      uint32_t h = (sequence * 2654435761u) >> (32 - HASH_LOG);
+      size_t ref = table[h];
+      table[h] = uint32_t(i);
+      if (ref < i && i - ref <= MAX_OFFSET &&
+          read4(src.data() + ref) == sequence) {
+        size_t match = MIN_MATCH;
+        while (i + match < match_limit && src[ref + match] == src[i + match]) {
+          match++;
+        }
+        put_sequence(out, src, anchor, i, i - ref, match);
+        i += match;
+        anchor = i;
+      } else {
+        i++;
+      }
+    }
+  }
+  put_sequence(out, src, anchor, src.size(), 0, 0);
+  return out;
+}
+
+/// Decompresses LZ4 block src which was compressed from raw_size bytes
+inline std::string decompress(std::string_view src, size_t raw_size) {
+  std::string out;
+  out.reserve(raw_size);
+  auto get_length = [&src](size_t& i, size_t length) {
+    uint8_t byte;
+    do {
+      byte = uint8_t(src[i++]);
+      length += byte;
+    } while (byte == 255);
+    return length;
+  };
+  for (size_t i = 0; i < src.size();) {
+    uint8_t token = uint8_t(src[i++]);
+    size_t literals = token >> 4;
+    if (literals == 15) {
+      literals = get_length(i, literals);
+    }
+    out.append(src.data() + i, literals);
+    i += literals;
+    if (i >= src.size()) {
+      break;  // the last sequence has no match
+    }
+    size_t offset = uint8_t(src[i]) | (size_t(uint8_t(src[i + 1])) << 8);
+    i += 2;
+    size_t match = token & 15;
+    if (match == 15) {
+      match = get_length(i, match);
+    }
+    match += MIN_MATCH;
+    size_t from = out.size() - offset;
+    for (size_t k = 0; k < match; k++) {  // match may overlap the output
+      out.push_back(out[from + k]);
+    }
+  }
+  return out;
+}
+}  // namespace lz4
+
+/**
+ * \class CompactValue
+ *
+ *
+ * \brief Value of a record encoded to use less memory.
+ *
+ * Object takes 24 bytes. Depending on the value it keeps:
+ *  - a canonical decimal integer as int64_t (incr does not parse it),
+ *  - a value up to INLINE_SIZE bytes inside of the object,
+ *  - a longer value on the heap, LZ4 compressed if it is not shorter than
+ *    the compression threshold and compression saves memory.
+ * Encoding is transparent: str() always returns the original value.
+ */
+class CompactValue {
+ public:
+  static const size_t INLINE_SIZE = 22;
+
+  /// A constructor. Creates empty value.
+  CompactValue() { set_meta(INLINE, 0); }
+
+  /**
+   * A constructor.
+   * \param value contents of the value
+   * \param compress_threshold min size of a value to compress, 0 means never
+   */
+  CompactValue(std::string_view value, size_t compress_threshold = 0) {
+    if (auto integer = parse_integer(value)) {
+      set_integer(*integer);
+    } else if (value.size() <= INLINE_SIZE) {
+      if (!value.empty()) {
+        std::memcpy(inline_, value.data(), value.size());
+      }
+      set_meta(INLINE, uint8_t(value.size()));
+    } else if (!(compress_threshold && value.size() >= compress_threshold &&
+                 set_compressed(value))) {
+      set_heap(HEAP, value, value.size());
+    }
+  }
+
+  /**
+   * A constructor.
+   * \param value integer value
+   */
+  CompactValue(int64_t value) { set_integer(value); }
+
+  CompactValue(const CompactValue& other) {
+    std::memcpy(inline_, other.inline_, sizeof(inline_));
+    if (other.is_heap()) {
+      set_heap(other.kind(),
+               std::string_view(other.heap_.data, other.heap_.size),
+               other.heap_.raw_size);
+    }
+  }
+
+  CompactValue(CompactValue&& other) noexcept {
+    std::memcpy(inline_, other.inline_, sizeof(inline_));
+    other.set_meta(INLINE, 0);
+  }
+
+  CompactValue& operator=(CompactValue other) noexcept {
+    std::swap(inline_, other.inline_);
+    return *this;
+  }
+
+  /// A destructor. Frees heap part of a long value.
+  ~CompactValue() {
+    if (is_heap()) {
+      delete[] heap_.data;
+    }
+  }
+
+  /// Returns the original value
+  std::string str() const {
+    switch (kind()) {
+      case INTEGER:
+        return std::to_string(integer_);
+      case HEAP:
+        return std::string(heap_.data, heap_.size);
+      case COMPRESSED:
+        return lz4::decompress(std::string_view(heap_.data, heap_.size),
+                               heap_.raw_size);
+      case INLINE:
+      default:
+        return std::string(inline_, uint8_t(inline_[SIZE_BYTE]));
+    }
+  }
+
+  /** \brief Passes the original value to a function without a copy.
+   * \param f function that takes std::string_view
+   *
+   * Integers are printed to the stack, only a compressed value is
+   * decompressed to a temporary string.
+   */
+  template <typename F>
+  void view(F f) const {
+    switch (kind()) {
+      case INTEGER: {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits), integer_).ptr;
+        f(std::string_view(digits, end - digits));
+        break;
+      }
+      case HEAP:
+        f(std::string_view(heap_.data, heap_.size));
+        break;
+      case COMPRESSED:
+        f(lz4::decompress(std::string_view(heap_.data, heap_.size),
+                          heap_.raw_size));
+        break;
+      case INLINE:
+      default:
+        f(std::string_view(inline_, uint8_t(inline_[SIZE_BYTE])));
+    }
+  }
+
+  /// Returns the value as integer, nullopt if it is not a canonical integer
+  std::optional<int64_t> integer() const {
+    if (kind() == INTEGER) {
+      return integer_;
+    }
+    return std::nullopt;
+  }
+
+  /// Returns number of bytes allocated on the heap
+  size_t heap_size() const { return is_heap() ? heap_.size : 0; }
+
+  /// Returns true if the value is stored compressed
+  bool compressed() const { return kind() == COMPRESSED; }
+
+ private:
+  enum Kind : uint8_t { INLINE, INTEGER, HEAP, COMPRESSED };
+  static const size_t KIND_BYTE = INLINE_SIZE;      /// keeps Kind
+  static const size_t SIZE_BYTE = INLINE_SIZE + 1;  /// size of inline value
+
+  union {
+    char inline_[INLINE_SIZE + 2];
+    int64_t integer_;
+    struct {
+      char* data;
+      uint32_t size;      ///< stored bytes
+      uint32_t raw_size;  ///< bytes of the original value
+    } heap_;
+  };
+
+  Kind kind() const { return Kind(inline_[KIND_BYTE]); }
+
+  bool is_heap() const { return kind() == HEAP || kind() == COMPRESSED; }
+
+  void set_meta(Kind kind, uint8_t size) {
+    inline_[KIND_BYTE] = char(kind);
+    inline_[SIZE_BYTE] = char(size);
+  }
+
+  /// Returns value of a canonical decimal integer (as std::to_string prints)
+  static std::optional<int64_t> parse_integer(std::string_view value) {
+    if (value.empty() || value.size() > 20 ||
+        (value[0] == '0' && value.size() > 1) ||
+        (value[0] == '-' && (value.size() == 1 || value[1] == '0'))) {
+      return std::nullopt;
+    }
+    int64_t result;
+    auto [end, error] =
+        std::from_chars(value.data(), value.data() + value.size(), result);
+    if (error != std::errc() || end != value.data() + value.size()) {
+      return std::nullopt;
+    }
+    return result;
+  }
+
+  void set_integer(int64_t value) {
+    integer_ = value;
+    set_meta(INTEGER, 0);
+  }
+
+  void set_heap(Kind kind, std::string_view bytes, size_t raw_size) {
+    heap_.data = new char[bytes.size()];
+    heap_.size = uint32_t(bytes.size());
+    heap_.raw_size = uint32_t(raw_size);
+    std::memcpy(heap_.data, bytes.data(), bytes.size());
+    set_meta(kind, 0);
+  }
+
+  /// Stores compressed value, returns false if compression does not help
+  bool set_compressed(std::string_view value) {
+    std::string compressed = lz4::compress(value);
+    if (compressed.size() >= value.size()) {
+      return false;
+    }
+    set_heap(COMPRESSED, compressed, value.size());
+    return true;
+  }
+};
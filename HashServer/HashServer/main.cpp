@@ -8,6 +8,7 @@
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
 
+#include "HashReplica.h"
 #include "HashServer.h"
 #include "HashServerConfig.h"
 #include "getopt.h" /* getopt_long */
@@ -27,12 +28,53 @@ bool help_opt = false;
  *  -m --maxtblsz=<uint>
  *  -n --ntables=<uint>
  *  -w --workers=<uint>
+ *  -M --maxmem=<uint>
+ *  -t --tblmem=<uint>
+ *  -e --evict=<lru|lfu|ttl>
+ *  -H --outq-high=<uint>
+ *  -L --outq-low=<uint>
+ *  -c --max-connections=<uint>
+ *  -I --idle-timeout=<sec>
+ *  -R --read-timeout=<sec>
+ *  -b --backlog=<uint>
+ *  -z --compress=<bytes>
+ *  -r --replicaof=<ip:port>
+ *  -C --cluster=<ip:port,ip:port,...>
+ *  -N --node=<uint>
+ *  -S --sub-buffer=<bytes>
+ *  -O --user-ops=<uint>
+ *  -B --user-bytes=<bytes>
+ *  -T --user-tables=<uint>
+ *  -Q --user-records=<uint>
+ *  -G --segments=<uint|auto>
+ *  -P --prealloc-tables=<uint>
+ *  -F --prefault
+ *  -g --huge-pages=<off|transparent|explicit>
+ *  -A --numa=<off|interleave|node>
  *  -v --verbose
  *  -h --help
  *
  */
 void parse_console_parameters(int argc, char **argv, HashServerConfig &config);
 
+/// Prints help string
+void print_usage();
+
+/** \brief Parses eviction policy name
+ * \param[in] name policy name: lru, lfu or ttl
+ *
+ * \return parsed policy, throws std::invalid_argument on unknown name
+ */
+EvictionPolicy parse_eviction_policy(const std::string &name);
+
+/** \brief Parses number of segments of new tables
+ * \param[in] value power of two up to 64 or auto
+ *
+ * \return number of segments, 0 for auto, throws std::invalid_argument on
+ * wrong value
+ */
+size_t parse_segments(const std::string &value);
+
 
 int main(int argc, char **argv) {
   HashServerConfig config;
@@ -40,6 +82,28 @@ int main(int argc, char **argv) {
   config.port = 1234;
   config.workers = 8;
   config.ntables = 10000;
+  config.maxtblsz = 0;
+  config.maxmem = 0;
+  config.tblmem = 0;
+  config.evict = EvictionPolicy::LRU;
+  config.outq_high = 1024 * 1024;
+  config.outq_low = 256 * 1024;
+  config.max_connections = 10000;
+  config.idle_timeout = 300;
+  config.read_timeout = 30;
+  config.backlog = boost::asio::socket_base::max_listen_connections;
+  config.compress = 0;
+  config.node = 0;
+  config.sub_buffer = 1024 * 1024;
+  config.user_ops = 0;
+  config.user_bytes = 0;
+  config.user_tables = 0;
+  config.user_records = 0;
+  config.segments = 1;
+  config.prealloc_tables = 0;
+  config.prefault = false;
+  config.huge_pages = HugePages::OFF;
+  config.numa = NUMA_OFF;
   config.verbose = true;
   parse_console_parameters(argc, argv, config);
 
@@ -48,6 +112,7 @@ int main(int argc, char **argv) {
             << " " << config.workers << endl;
   */
   if (!help_opt) {
+    place_process(config.numa);  // workers inherit it
     try {
       boost::thread_group threads_; // thread_pool
       boost::asio::io_context io_context;
@@ -59,6 +124,9 @@ int main(int argc, char **argv) {
             boost::bind(&boost::asio::io_context::run, &io_context));
       } 
       HashServer server(io_context, config); // create server and run it
+      if (!config.replicaof.empty()) {  // follower copies tables of primary
+        ReplicaClient::create(io_context, config.replicaof)->start();
+      }
       io_context.run();
     } catch (std::exception &e) {
       std::cerr << e.what() << endl;
@@ -78,10 +146,33 @@ void parse_console_parameters(int argc, char **argv, HashServerConfig &config) {
       {"workers", required_argument, 0, 'w'},
       {"verbose", no_argument, 0, 'v'},  // 0
       {"help", no_argument, 0, 'h'},
+      {"maxmem", required_argument, 0, 'M'},
+      {"tblmem", required_argument, 0, 't'},
+      {"evict", required_argument, 0, 'e'},
+      {"outq-high", required_argument, 0, 'H'},
+      {"outq-low", required_argument, 0, 'L'},
+      {"max-connections", required_argument, 0, 'c'},
+      {"idle-timeout", required_argument, 0, 'I'},
+      {"read-timeout", required_argument, 0, 'R'},
+      {"backlog", required_argument, 0, 'b'},
+      {"compress", required_argument, 0, 'z'},
+      {"replicaof", required_argument, 0, 'r'},
+      {"cluster", required_argument, 0, 'C'},
+      {"node", required_argument, 0, 'N'},
+      {"sub-buffer", required_argument, 0, 'S'},
+      {"user-ops", required_argument, 0, 'O'},
+      {"user-bytes", required_argument, 0, 'B'},
+      {"user-tables", required_argument, 0, 'T'},
+      {"user-records", required_argument, 0, 'Q'},
+      {"segments", required_argument, 0, 'G'},
+      {"prealloc-tables", required_argument, 0, 'P'},
+      {"prefault", no_argument, 0, 'F'},
+      {"huge-pages", required_argument, 0, 'g'},
+      {"numa", required_argument, 0, 'A'},
       {0, 0, 0, 0}};
 
   int c, option_index = 0;
-  while (-1 != (c = getopt_long(argc, argv, "d:i:p:m:n:w:v:h", long_options,
+  while (-1 != (c = getopt_long(argc, argv, "d:i:p:m:n:w:v:hM:t:e:H:L:c:I:R:b:z:r:C:N:S:O:B:T:Q:G:P:Fg:A:", long_options,
                                 &option_index))) {
     switch (c) {
       case 0:
@@ -112,16 +203,76 @@ void parse_console_parameters(int argc, char **argv, HashServerConfig &config) {
             break;
           case 7:
             help_opt = true;
-            printf(
-                "using:\n\t./exe -d|--dir <dir> -i|--ip <ip> -p|--port <port> "
-                "-m|--maxtblsz <uint> -n|--ntables <uint> -w|--workers <num> "
-                "[-v|--verbose ] [-h|--help <uint>]\n\n");
+            print_usage();
             break;
           case 8:
-            printf(
-                "using:\n\t./exe -d|--dir <dir> -i|--ip <ip> -p|--port <port> "
-                "-m|--maxtblsz <uint> -n|--ntables <uint> -w|--workers <num> "
-                "[-v|--verbose ] [-h|--help <uint>]\n\n");
+            config.maxmem = std::stoull(optarg);
+            break;
+          case 9:
+            config.tblmem = std::stoull(optarg);
+            break;
+          case 10:
+            config.evict = parse_eviction_policy(optarg);
+            break;
+          case 11:
+            config.outq_high = std::stoull(optarg);
+            break;
+          case 12:
+            config.outq_low = std::stoull(optarg);
+            break;
+          case 13:
+            config.max_connections = std::stoull(optarg);
+            break;
+          case 14:
+            config.idle_timeout = std::stoull(optarg);
+            break;
+          case 15:
+            config.read_timeout = std::stoull(optarg);
+            break;
+          case 16:
+            config.backlog = std::stoi(optarg);
+            break;
+          case 17:
+            config.compress = std::stoull(optarg);
+            break;
+          case 18:
+            config.replicaof = optarg;
+            break;
+          case 19:
+            config.cluster = optarg;
+            break;
+          case 20:
+            config.node = std::stoull(optarg);
+            break;
+          case 21:
+            config.sub_buffer = std::stoull(optarg);
+            break;
+          case 22:
+            config.user_ops = std::stoull(optarg);
+            break;
+          case 23:
+            config.user_bytes = std::stoull(optarg);
+            break;
+          case 24:
+            config.user_tables = std::stoull(optarg);
+            break;
+          case 25:
+            config.user_records = std::stoull(optarg);
+            break;
+          case 26:
+            config.segments = parse_segments(optarg);
+            break;
+          case 27:
+            config.prealloc_tables = std::stoull(optarg);
+            break;
+          case 28:
+            config.prefault = true;
+            break;
+          case 29:
+            config.huge_pages = parse_huge_pages(optarg);
+            break;
+          case 30:
+            config.numa = parse_numa(optarg);
             break;
         }
         break;
@@ -147,19 +298,82 @@ void parse_console_parameters(int argc, char **argv, HashServerConfig &config) {
       case 'v':
         config.verbose = std::stoi(optarg);
         break;
+      case 'M':
+        config.maxmem = std::stoull(optarg);
+        break;
+      case 't':
+        config.tblmem = std::stoull(optarg);
+        break;
+      case 'e':
+        config.evict = parse_eviction_policy(optarg);
+        break;
+      case 'H':
+        config.outq_high = std::stoull(optarg);
+        break;
+      case 'L':
+        config.outq_low = std::stoull(optarg);
+        break;
+      case 'c':
+        config.max_connections = std::stoull(optarg);
+        break;
+      case 'I':
+        config.idle_timeout = std::stoull(optarg);
+        break;
+      case 'R':
+        config.read_timeout = std::stoull(optarg);
+        break;
+      case 'b':
+        config.backlog = std::stoi(optarg);
+        break;
+      case 'z':
+        config.compress = std::stoull(optarg);
+        break;
+      case 'r':
+        config.replicaof = optarg;
+        break;
+      case 'C':
+        config.cluster = optarg;
+        break;
+      case 'N':
+        config.node = std::stoull(optarg);
+        break;
+      case 'S':
+        config.sub_buffer = std::stoull(optarg);
+        break;
+      case 'O':
+        config.user_ops = std::stoull(optarg);
+        break;
+      case 'B':
+        config.user_bytes = std::stoull(optarg);
+        break;
+      case 'T':
+        config.user_tables = std::stoull(optarg);
+        break;
+      case 'Q':
+        config.user_records = std::stoull(optarg);
+        break;
+      case 'G':
+        config.segments = parse_segments(optarg);
+        break;
+      case 'P':
+        config.prealloc_tables = std::stoull(optarg);
+        break;
+      case 'F':
+        config.prefault = true;
+        break;
+      case 'g':
+        config.huge_pages = parse_huge_pages(optarg);
+        break;
+      case 'A':
+        config.numa = parse_numa(optarg);
+        break;
       case 'h':
         help_opt = true;
-        printf(
-            "using:\n\t./exe -d|--dir <dir> -i|--ip <ip> -p|--port <port> "
-            "-m|--maxtblsz <uint> -n|--ntables <uint> -w|--workers <num> "
-            "[-v|--verbose <uint>] [-h|--help <uint>]\n\n");
+        print_usage();
         break;
 
       case '?': /* getopt_long already printed an error message. */
-        printf(
-            "using:\n\t./exe -d|--dir <dir> -i|--ip <ip> -p|--port <port> "
-            "-m|--maxtblsz <uint> -n|--ntables <uint> -w|--workers <num> "
-            "[-v|--verbose <uint>] [-h|--help <uint>]\n\n");
+        print_usage();
         break;
 
       default:
@@ -173,3 +387,42 @@ void parse_console_parameters(int argc, char **argv, HashServerConfig &config) {
     printf("\n");
   }
 }
+
+void print_usage() {
+  printf(
+      "using:\n\t./exe -d|--dir <dir> -i|--ip <ip> -p|--port <port> "
+      "-m|--maxtblsz <uint> -n|--ntables <uint> -w|--workers <num> "
+      "-M|--maxmem <bytes> -t|--tblmem <bytes> -e|--evict <lru|lfu|ttl> "
+      "-H|--outq-high <bytes> -L|--outq-low <bytes> "
+      "-c|--max-connections <uint> -I|--idle-timeout <sec> "
+      "-R|--read-timeout <sec> -b|--backlog <uint> -z|--compress <bytes> "
+      "-r|--replicaof <ip:port> -C|--cluster <ip:port,...> -N|--node <uint> "
+      "-S|--sub-buffer <bytes> -O|--user-ops <uint> -B|--user-bytes <bytes> "
+      "-T|--user-tables <uint> -Q|--user-records <uint> "
+      "-G|--segments <uint|auto> -P|--prealloc-tables <uint> "
+      "-F|--prefault -g|--huge-pages <off|transparent|explicit> "
+      "-A|--numa <off|interleave|node> "
+      "[-v|--verbose <uint>] [-h|--help <uint>]\n\n");
+}
+
+EvictionPolicy parse_eviction_policy(const std::string &name) {
+  if (name == "lru") {
+    return EvictionPolicy::LRU;
+  } else if (name == "lfu") {
+    return EvictionPolicy::LFU;
+  } else if (name == "ttl") {
+    return EvictionPolicy::TTL;
+  }
+  throw std::invalid_argument("unknown eviction policy " + name);
+}
+
+size_t parse_segments(const std::string &value) {
+  if (value == "auto") {
+    return 0;
+  }
+  size_t segments = std::stoull(value);
+  if (!TableMap::valid_segments(segments)) {
+    throw std::invalid_argument("segments must be a power of two up to 64");
+  }
+  return segments;
+}
@@ -0,0 +1,565 @@
+#include <boost/asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "../HashServer/HashMap.h"
+#include "../HashServer/HashMap.cpp"
+#include "../HashServer/HashMemory.cpp"
+#include "../HashServer/HashSegments.h"
+
+/**
+ * Stress test of concurrent access with a linearizability check.
+ *
+ * Worker threads run random operations (getval, setval, incr, getset, setnx)
+ * on a few keys, so they collide all the time, and record the history: the
+ * operation, its result, and the logical times of its call and return. Then
+ * the history of every key is checked against a sequential register (keys
+ * are independent, so the history is linearizable if the history of every
+ * key is) by the Wing & Gong search with memoization of Lowe, the algorithm
+ * of Knossos and Porcupine.
+ *
+ * Without an address the operations go to a SegmentedMap locked the same way
+ * as by the server (tables lock shared plus the mutex of the segment of the
+ * key), while another thread splits the map and toggles its index under the
+ * exclusive lock and one more reads it segment by segment. With an address
+ * every worker sends its operations over its own line mode connection to a
+ * running server, and one more connection adds, reads and removes tables.
+ *
+ * Operations of a worker depend only on the seed, so a failed run is repeated
+ * with the same seed (the interleaving is up to the scheduler). Build it with
+ * -fsanitize=thread to find data races as well.
+ *
+ * usage: StressHashMap [-t threads] [-n ops] [-k keys] [-s seed]
+ *                      [-a host:port]
+ */
+
+static const size_t TTL = 100'000;  /// records never expire during a run
+static const size_t MAX_SHOWN = 40;  /// operations printed for a failed key
+
+enum class Kind { GET, SET, INCR, GETSET, SETNX };
+
+/// One operation of the history
+struct Operation {
+  Kind kind;
+  size_t key;
+  int64_t arg;                   /// value to set or increment
+  bool ok = true;                /// setnx stored, no error otherwise
+  std::optional<int64_t> value;  /// value got, new value of incr
+  uint64_t call = 0;
+  uint64_t ret = 0;
+  size_t thread = 0;
+};
+
+/// Value of a key in the sequential model, nullopt if the key is absent
+using State = std::optional<int64_t>;
+
+/// Logical time: every call and every return takes the next tick
+static std::atomic<uint64_t> clock_{0};
+
+/** \brief Applies an operation to the model.
+ * \param op operation with its result
+ * \param state value of the key, changed if the operation is possible
+ *
+ * \return false if the result is impossible in this state.
+ */
+static bool apply(const Operation& op, State& state) {
+  switch (op.kind) {
+    case Kind::GET:
+      return op.value == state;
+    case Kind::SET:
+      if (!op.ok) {
+        return false;
+      }
+      state = op.arg;
+      return true;
+    case Kind::INCR: {
+      int64_t value = state.value_or(0) + op.arg;
+      if (!op.ok || op.value != value) {
+        return false;
+      }
+      state = value;
+      return true;
+    }
+    case Kind::GETSET:
+      if (!op.ok || op.value != state) {
+        return false;
+      }
+      state = op.arg;
+      return true;
+    case Kind::SETNX:
+      if (op.ok != !state) {
+        return false;
+      }
+      if (op.ok) {
+        state = op.arg;
+      }
+      return true;
+  }
+  return false;
+}
+
+/**
+ * \brief Checks that a history of one key is linearizable.
+ *
+ * Calls and returns are kept in a linked list in time order. The search
+ * takes a call from the head of the list, linearizes its operation if the
+ * model allows it and removes the call and its return from the list. A
+ * return at the head means its operation can not be linearized any more, so
+ * the search backtracks. A set of linearized operations together with the
+ * model state already tried is not tried again.
+ */
+static bool linearizable(const std::vector<Operation>& history) {
+  struct Entry {
+    size_t op;
+    bool call;
+    uint64_t time;
+    size_t match;  /// the other entry of the operation
+    size_t prev;
+    size_t next;
+  };
+  struct Tried {
+    std::vector<uint64_t> done;
+    State state;
+    bool operator==(const Tried& other) const {
+      return state == other.state && done == other.done;
+    }
+  };
+  struct TriedHash {
+    size_t operator()(const Tried& tried) const {
+      uint64_t h = tried.state ? uint64_t(*tried.state) * 31 + 1 : 0;
+      for (uint64_t word : tried.done) {
+        h = (h ^ word) * 0x100000001b3ULL;
+      }
+      return size_t(h);
+    }
+  };
+
+  size_t n = history.size();
+  std::vector<Entry> entries(2 * n + 1);  // entries[0] is the head
+  std::vector<size_t> order;
+  for (size_t i = 0; i < n; i++) {
+    entries[2 * i + 1] = {i, true, history[i].call, 2 * i + 2, 0, 0};
+    entries[2 * i + 2] = {i, false, history[i].ret, 2 * i + 1, 0, 0};
+    order.push_back(2 * i + 1);
+    order.push_back(2 * i + 2);
+  }
+  std::sort(order.begin(), order.end(), [&entries](size_t a, size_t b) {
+    return entries[a].time < entries[b].time;
+  });
+  size_t prev = 0;
+  for (size_t entry : order) {
+    entries[prev].next = entry;
+    entries[entry].prev = prev;
+    prev = entry;
+  }
+  entries[prev].next = 0;
+  entries[0].prev = prev;
+
+  auto lift = [&entries](size_t entry) {
+    for (size_t e : {entry, entries[entry].match}) {
+      entries[entries[e].prev].next = entries[e].next;
+      entries[entries[e].next].prev = entries[e].prev;
+    }
+  };
+  auto unlift = [&entries](size_t entry) {
+    for (size_t e : {entries[entry].match, entry}) {
+      entries[entries[e].prev].next = e;
+      entries[entries[e].next].prev = e;
+    }
+  };
+
+  Tried current{std::vector<uint64_t>((n + 63) / 64), std::nullopt};
+  std::unordered_set<Tried, TriedHash> tried;
+  std::vector<std::pair<size_t, State>> stack;  // lifted calls
+  size_t entry = entries[0].next;
+  while (entries[0].next != 0) {
+    if (entries[entry].call) {
+      size_t op = entries[entry].op;
+      State state = current.state;
+      if (apply(history[op], state)) {
+        Tried next = current;
+        next.done[op / 64] |= uint64_t(1) << (op % 64);
+        next.state = state;
+        if (tried.insert(next).second) {
+          stack.emplace_back(entry, current.state);
+          current = std::move(next);
+          lift(entry);
+          entry = entries[0].next;
+          continue;
+        }
+      }
+      entry = entries[entry].next;
+    } else {
+      if (stack.empty()) {
+        return false;
+      }
+      auto [lifted, state] = stack.back();
+      stack.pop_back();
+      size_t op = entries[lifted].op;
+      current.done[op / 64] &= ~(uint64_t(1) << (op % 64));
+      current.state = state;
+      unlift(lifted);
+      entry = entries[lifted].next;
+    }
+  }
+  return true;
+}
+
+/// Random operation of a worker
+static Operation random_operation(std::mt19937_64& generator, size_t keys,
+                                  size_t thread, size_t i) {
+  static const Kind KINDS[] = {Kind::GET,    Kind::GET,   Kind::GET,
+                               Kind::GET,    Kind::SET,   Kind::SET,
+                               Kind::INCR,   Kind::INCR,  Kind::GETSET,
+                               Kind::SETNX};
+  Operation op;
+  op.kind = KINDS[generator() % std::size(KINDS)];
+  op.key = generator() % keys;
+  // values written are unique, increments are small
+  op.arg = op.kind == Kind::INCR ? int64_t(generator() % 10) + 1
+                                 : int64_t(thread * 1'000'000'000 + i);
+  op.thread = thread;
+  return op;
+}
+
+static std::string key_name(size_t key) { return "k" + std::to_string(key); }
+
+/**
+ * Runs workers, each executes its operations by its own executor made by
+ * make_executor(thread), and returns the history.
+ */
+template <typename MakeExecutor>
+std::vector<Operation> run_workers(size_t threads, size_t ops, size_t keys,
+                                   uint64_t seed, MakeExecutor make_executor) {
+  std::vector<std::vector<Operation>> histories(threads);
+  std::vector<std::thread> workers;
+  for (size_t thread = 0; thread < threads; thread++) {
+    workers.emplace_back([&, thread]() {
+      auto execute = make_executor(thread);
+      std::seed_seq seq{seed, uint64_t(thread)};
+      std::mt19937_64 generator(seq);
+      auto& history = histories[thread];
+      history.reserve(ops);
+      for (size_t i = 0; i < ops; i++) {
+        Operation op = random_operation(generator, keys, thread, i);
+        op.call = clock_++;
+        execute(op);
+        op.ret = clock_++;
+        history.push_back(op);
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  std::vector<Operation> history;
+  for (auto& part : histories) {
+    history.insert(history.end(), part.begin(), part.end());
+  }
+  return history;
+}
+
+/// Runs operations on a SegmentedMap together with splits and scans
+static std::vector<Operation> stress_map(size_t threads, size_t ops,
+                                         size_t keys, uint64_t seed) {
+  using Map = SegmentedMap<SmallKey>;
+  Map map;
+  std::shared_mutex tables_mutex;
+  std::atomic<bool> done{false};
+
+  // changes the whole map as addindex and the splits of the timer do
+  std::thread splitter([&]() {
+    while (!done) {
+      {
+        std::lock_guard<std::shared_mutex> lg(tables_mutex);
+        map.split();
+        if (map.has_index()) {
+          map.disable_index();
+        } else {
+          map.enable_index();
+        }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+  // reads the map as gettable does
+  std::thread scanner([&]() {
+    while (!done) {
+      std::shared_lock<std::shared_mutex> lg(tables_mutex);
+      for (size_t segment = 0; segment < map.segments(); segment++) {
+        std::lock_guard<std::mutex> sl(map.mutex(segment));
+        map.segment(segment).get_table();
+      }
+      lg.unlock();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+
+  auto history = run_workers(
+      threads, ops, keys, seed, [&](size_t) {
+        return [&](Operation& op) {
+          SmallKey key(key_name(op.key));
+          std::shared_lock<std::shared_mutex> lg(tables_mutex);
+          std::lock_guard<std::mutex> sl(map.mutex(map.segment_of(key)));
+          Map::Map& segment = map.map_of(key);
+          std::string arg = std::to_string(op.arg);
+          switch (op.kind) {
+            case Kind::GET: {
+              auto value = segment.get(key);
+              if (value) {
+                op.value = std::stoll(*value);
+              }
+              break;
+            }
+            case Kind::SET:
+              op.ok = segment.put(key, arg, TTL);
+              break;
+            case Kind::INCR:
+              op.value = segment.incr(key, op.arg, TTL);
+              op.ok = op.value.has_value();
+              break;
+            case Kind::GETSET: {
+              auto previous = segment.get_and_put(key, arg, TTL, op.ok);
+              if (previous) {
+                op.value = std::stoll(*previous);
+              }
+              break;
+            }
+            case Kind::SETNX:
+              op.ok = segment.put_if_absent(key, arg, TTL);
+              break;
+          }
+        };
+      });
+  done = true;
+  splitter.join();
+  scanner.join();
+  printf("map: %zu segments, %zu records\n", map.segments(), map.records());
+  return history;
+}
+
+/// Line mode connection to a server
+class Connection {
+ public:
+  Connection(boost::asio::io_context& io_context, const std::string& address)
+      : socket_(io_context) {
+    size_t colon = address.rfind(':');
+    socket_.connect(boost::asio::ip::tcp::endpoint(
+        boost::asio::ip::address::from_string(address.substr(0, colon)),
+        uint16_t(std::stoi(address.substr(colon + 1)))));
+  }
+
+  /// Sends a command and returns its response without newline
+  std::string request(const std::string& command) {
+    boost::asio::write(socket_, boost::asio::buffer(command + "\n"));
+    size_t bytes = boost::asio::read_until(socket_, buffer_, '\n');
+    std::string response(
+        boost::asio::buffers_begin(buffer_.data()),
+        boost::asio::buffers_begin(buffer_.data()) + bytes - 1);
+    buffer_.consume(bytes);
+    return response;
+  }
+
+ private:
+  boost::asio::ip::tcp::socket socket_;
+  boost::asio::streambuf buffer_;
+};
+
+/// Value of "ok key=key value=value table=table" response
+static std::optional<int64_t> response_value(const std::string& response) {
+  size_t begin = response.find(" value=");
+  if (response.rfind("ok ", 0) != 0 || begin == std::string::npos) {
+    return std::nullopt;
+  }
+  begin += 7;
+  return std::stoll(response.substr(begin, response.find(' ', begin) - begin));
+}
+
+/// Runs operations on a table of a server together with table changes
+static std::vector<Operation> stress_server(const std::string& address,
+                                            size_t threads, size_t ops,
+                                            size_t keys, uint64_t seed) {
+  const std::string user = "stress";
+  boost::asio::io_context io_context;
+  Connection admin(io_context, address);
+  std::string table = admin.request(user + " addtable segments=4");
+  if (table.empty() || !std::isdigit(table[0])) {
+    fprintf(stderr, "addtable failed: %s\n", table.c_str());
+    exit(EXIT_FAILURE);
+  }
+  std::atomic<bool> done{false};
+  std::atomic<size_t> errors{0};
+
+  // adds and removes tables while the workers use theirs
+  std::thread churn([&]() {
+    Connection connection(io_context, address);
+    while (!done) {
+      std::string other = connection.request(user + " addtable");
+      connection.request(user + " gettable " + table);
+      if (!other.empty() && std::isdigit(other[0])) {
+        connection.request(user + " remtable " + other);
+      }
+    }
+  });
+
+  auto history = run_workers(
+      threads, ops, keys, seed, [&](size_t) {
+        auto connection = std::make_shared<Connection>(io_context, address);
+        return [&, connection](Operation& op) {
+          std::string key = key_name(op.key);
+          std::string arg = std::to_string(op.arg);
+          std::string tail = " table=" + table + " ttl=" + std::to_string(TTL);
+          std::string response;
+          switch (op.kind) {
+            case Kind::GET:
+              response = connection->request(user + " getval key=" + key +
+                                             " table=" + table);
+              op.value = response_value(response);
+              op.ok = op.value || response == "error key=" + key;
+              break;
+            case Kind::SET:
+              response = connection->request(user + " setval key=" + key +
+                                             " val=" + arg + tail);
+              op.ok = response.empty();
+              break;
+            case Kind::INCR:
+              response = connection->request(user + " incr key=" + key +
+                                             " table=" + table + " by=" + arg +
+                                             " ttl=" + std::to_string(TTL));
+              op.value = response_value(response);
+              op.ok = op.value.has_value();
+              break;
+            case Kind::GETSET:
+              response = connection->request(user + " getset key=" + key +
+                                             " val=" + arg + tail);
+              op.value = response_value(response);
+              op.ok = op.value || response.empty();
+              break;
+            case Kind::SETNX:
+              response = connection->request(user + " setnx key=" + key +
+                                             " val=" + arg + tail);
+              op.ok = response.empty();
+              if (!op.ok && response != "error key=" + key) {
+                errors++;
+              }
+              return;
+          }
+          if (!op.ok) {
+            errors++;
+          }
+        };
+      });
+  done = true;
+  churn.join();
+  admin.request(user + " remtable " + table);
+  if (errors) {
+    printf("server: %zu error responses\n", errors.load());
+  }
+  return history;
+}
+
+static const char* kind_name(Kind kind) {
+  static const char* NAMES[] = {"getval", "setval", "incr", "getset", "setnx"};
+  return NAMES[size_t(kind)];
+}
+
+/// Prints the first operations of a key in time order
+static void print_history(std::vector<Operation> history) {
+  std::sort(history.begin(), history.end(),
+            [](const auto& a, const auto& b) { return a.call < b.call; });
+  for (size_t i = 0; i < history.size() && i < MAX_SHOWN; i++) {
+    const Operation& op = history[i];
+    printf("  [%llu, %llu] thread %zu %s %lld -> %s %s\n",
+           (unsigned long long)op.call, (unsigned long long)op.ret, op.thread,
+           kind_name(op.kind), (long long)op.arg, op.ok ? "ok" : "failed",
+           op.value ? std::to_string(*op.value).c_str() : "nil");
+  }
+}
+
+/// Checks the checker on small histories with a known answer
+static bool check_checker() {
+  auto op = [](Kind kind, int64_t arg, State value, uint64_t call,
+               uint64_t ret) {
+    return Operation{kind, 0, arg, true, value, call, ret, 0};
+  };
+  // a read that overlaps a write may see either value
+  std::vector<Operation> overlapping = {op(Kind::SET, 1, std::nullopt, 0, 3),
+                                        op(Kind::GET, 0, std::nullopt, 1, 2),
+                                        op(Kind::GET, 0, 1, 4, 5)};
+  // a read after a completed write must not see the old value
+  std::vector<Operation> stale = {op(Kind::SET, 1, std::nullopt, 0, 1),
+                                  op(Kind::GET, 0, std::nullopt, 2, 3)};
+  // two increments of 0 by 1 can not both return 1
+  std::vector<Operation> lost = {op(Kind::INCR, 1, 1, 0, 3),
+                                 op(Kind::INCR, 1, 1, 1, 2)};
+  return linearizable(overlapping) && !linearizable(stale) &&
+         !linearizable(lost);
+}
+
+int main(int argc, char** argv) {
+  size_t threads = 8;
+  size_t ops = 20'000;
+  size_t keys = 16;
+  uint64_t seed = std::random_device()();
+  std::string address;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string option = argv[i];
+    if (option == "-t") {
+      threads = std::stoul(argv[i + 1]);
+    } else if (option == "-n") {
+      ops = std::stoul(argv[i + 1]);
+    } else if (option == "-k") {
+      keys = std::stoul(argv[i + 1]);
+    } else if (option == "-s") {
+      seed = std::stoull(argv[i + 1]);
+    } else if (option == "-a") {
+      address = argv[i + 1];
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!check_checker()) {
+    printf("checker is broken\n");
+    return EXIT_FAILURE;
+  }
+  printf("seed %llu, %zu threads, %zu operations each, %zu keys\n",
+         (unsigned long long)seed, threads, ops, keys);
+  fflush(stdout);  // the seed is seen even if the run crashes
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<Operation> history =
+      address.empty() ? stress_map(threads, ops, keys, seed)
+                      : stress_server(address, threads, ops, keys, seed);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+  printf("%zu operations in %lld ms\n", history.size(), (long long)ms);
+
+  std::vector<std::vector<Operation>> by_key(keys);
+  for (const auto& op : history) {
+    by_key[op.key].push_back(op);
+  }
+  size_t failed = 0;
+  for (size_t key = 0; key < keys; key++) {
+    if (!linearizable(by_key[key])) {
+      printf("history of %s is not linearizable:\n", key_name(key).c_str());
+      print_history(by_key[key]);
+      failed++;
+    }
+  }
+  printf("%s\n", failed ? "FAILED" : "linearizable");
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,13 +1,29 @@
 #include <optional>
+#include <set>
+#include <sstream>
 #include "pch.h"
 #include "CppUnitTest.h"
 #include "../HashServer/HashMap.h"
 #include "../HashServer/HashMap.cpp"
+#include "../HashServer/HashMemory.cpp"
+#include "../HashServer/HashHotKeys.h"
+#include "../HashServer/HashQuota.h"
+#include "../HashServer/HashQuota.cpp"
+#include "../HashServer/HashResponse.h"
+#include "../HashServer/HashResponse.cpp"
+#include "../HashServer/HashScript.h"
+#include "../HashServer/HashScript.cpp"
+#include "../HashServer/HashSegments.h"
 #include <cstdlib>
 #include "windows.h" 
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
+/// Puts all keys into one bucket, keys with equal key % 3 have equal tags
+struct CollidingHash {
+  uint64_t operator()(uint64_t key) const { return (key % 3) << 24; }
+};
+
 namespace UnitTestHashMap
 {
 	TEST_CLASS(UnitTestHashMap)
@@ -17,7 +33,7 @@ namespace UnitTestHashMap
 		{
 			int key = 1;
 			std::string value = "apple";
-			HashMap hm;
+			HashMap<uint64_t> hm;
             hm.put(key, value, 1000);			
             //Assert::AreNotEqual(std::nullopt, hm.get(key)); // no std::optional in MUTFramework
 			Assert::AreEqual(*hm.get(key), value);
@@ -25,7 +41,7 @@ namespace UnitTestHashMap
 		TEST_METHOD(TestCannotGetAfterRemove) {
             int key = 1;
             std::string value = "apple";
-            HashMap hm;
+            HashMap<uint64_t> hm;
             hm.put(key, value, 1000);
             hm.remove(key);
             Assert::AreNotEqual(*hm.get(key), value);           
@@ -35,7 +51,7 @@ namespace UnitTestHashMap
           int key2 = 2;
           std::string value1 = "apple";
           std::string value2 = "banana";
-          HashMap hm;
+          HashMap<uint64_t> hm;
           hm.put(key1, value1, 1000);
           hm.put(key2, value2, 1000);
           hm.remove(key1);
@@ -46,7 +62,7 @@ namespace UnitTestHashMap
           int key = 1;
           std::string value1 = "apple";
           std::string value2 = "banana";
-          HashMap hm;
+          HashMap<uint64_t> hm;
           hm.put(key, value1, 1000);
           hm.put(key, value2, 1000);
           Assert::AreEqual(*hm.get(key), value2);
@@ -56,7 +72,7 @@ namespace UnitTestHashMap
           int key2 = 2;
           std::string value1 = "apple";
           std::string value2 = "banana";
-          HashMap hm;
+          HashMap<uint64_t> hm;
           hm.put(key1, value1, 1000);
           hm.put(key2, value2, 1000);
           Assert::AreEqual(*hm.get(key1), value1);
@@ -65,10 +81,515 @@ namespace UnitTestHashMap
         TEST_METHOD(TestCannotGetAfterPutAndLongTime) {
           int key = 1;
           std::string value = "apple";
-          HashMap hm;
+          HashMap<uint64_t> hm;
           hm.put(key, value, 1);
           Sleep(5000); // time in milliseconds
           Assert::AreNotEqual(*hm.get(key), value);
         }
+        TEST_METHOD(TestEvictsLeastRecentlyUsed) {
+          HashMap<uint64_t> hm(2, 0, EvictionPolicy::LRU);
+          hm.put(1, "apple", 1000);
+          hm.put(2, "banana", 1000);
+          hm.get(1);
+          hm.put(3, "cherry", 1000);
+          Assert::IsTrue(hm.get(2) == std::nullopt);
+          Assert::AreEqual(*hm.get(1), std::string("apple"));
+          Assert::AreEqual(*hm.get(3), std::string("cherry"));
+          Assert::AreEqual(hm.records(), size_t(2));
+        }
+        TEST_METHOD(TestEvictsNearestToExpiration) {
+          HashMap<uint64_t> hm(2, 0, EvictionPolicy::TTL);
+          hm.put(1, "apple", 1000);
+          hm.put(2, "banana", 10);
+          hm.put(3, "cherry", 1000);
+          Assert::IsTrue(hm.get(2) == std::nullopt);
+          Assert::AreEqual(*hm.get(1), std::string("apple"));
+        }
+        TEST_METHOD(TestPutFailsWhenRecordDoesNotFit) {
+          HashMap<uint64_t> empty;
+          HashMap<uint64_t> hm(0, empty.memory_usage() + 100,
+                               EvictionPolicy::LRU);
+          Assert::IsFalse(hm.put(1, std::string(1000, 'a'), 1000));
+          Assert::IsTrue(hm.get(1) == std::nullopt);
+          Assert::AreEqual(hm.memory_usage(), empty.memory_usage());
+        }
+        TEST_METHOD(TestIncrCreatesAndIncrementsCounter) {
+          HashMap<uint64_t> hm;
+          Assert::AreEqual(*hm.incr(1, 5, 1000), int64_t(5));
+          Assert::AreEqual(*hm.incr(1, -2, 1000), int64_t(3));
+          Assert::AreEqual(*hm.get(1), std::string("3"));
+          hm.put(2, "apple", 1000);
+          Assert::IsTrue(hm.incr(2, 1, 1000) == std::nullopt);
+        }
+        TEST_METHOD(TestCompareAndPutChecksVersion) {
+          HashMap<uint64_t> hm;
+          Assert::IsTrue(hm.put_if_absent(1, "apple", 1000));
+          Assert::IsFalse(hm.put_if_absent(1, "banana", 1000));
+          uint64_t version = hm.get_with_version(1)->second;
+          Assert::IsTrue(hm.compare_and_put(1, "banana", 1000, version + 1) ==
+                         std::nullopt);
+          Assert::IsTrue(hm.compare_and_put(1, "banana", 1000, version) !=
+                         std::nullopt);
+          Assert::AreEqual(*hm.get(1), std::string("banana"));
+        }
+        TEST_METHOD(TestExpireAndPersistChangeTtl) {
+          HashMap<uint64_t> hm;
+          hm.put(1, "apple", 1);
+          Assert::IsTrue(hm.expire(1, 1000));
+          Assert::IsTrue(*hm.ttl(1) > 900);
+          Assert::IsTrue(hm.persist(1));
+          Assert::AreEqual(*hm.ttl(1), int64_t(-1));
+          Assert::AreEqual(*hm.get(1), std::string("apple"));
+          Assert::IsFalse(hm.expire(2, 1000));
+        }
+        TEST_METHOD(TestSmallKeyStoresShortAndLongKeys) {
+          std::string short_key(SmallKey::INLINE_SIZE, 'a');
+          std::string long_key(SmallKey::INLINE_SIZE + 1, 'b');
+          SmallKey key1(short_key), key2(long_key);
+          Assert::IsTrue(key1.view() == short_key);
+          Assert::IsTrue(key2.view() == long_key);
+          Assert::AreEqual(key1.heap_size(), size_t(0));
+          SmallKey copy = key2;
+          SmallKey moved = std::move(key1);
+          Assert::IsTrue(copy == key2);
+          Assert::IsTrue(moved.view() == short_key);
+          Assert::IsTrue(key1.view().empty());
+        }
+        TEST_METHOD(TestStringKeys) {
+          HashMap<SmallKey> hm;
+          std::string long_key(100, 'k');
+          hm.put("apple", "1", 1000);
+          hm.put(long_key, "2", 1000);
+          hm.put("18446744073709551615", "3", 1000);
+          Assert::AreEqual(*hm.get("apple"), std::string("1"));
+          Assert::AreEqual(*hm.get(long_key), std::string("2"));
+          Assert::AreEqual(*hm.get("18446744073709551615"), std::string("3"));
+          Assert::IsTrue(hm.get("banana") == std::nullopt);
+        }
+        TEST_METHOD(TestGetManyFindsKeysInLongChain) {
+          HashMap<uint64_t, CollidingHash> hm;
+          for (uint64_t key = 0; key < 30; key++) {
+            hm.put(key, std::to_string(key), 1000);
+          }
+          hm.remove(4);
+          auto values = hm.get_many({0, 4, 7, 29, 30});
+          Assert::AreEqual(*values[0], std::string("0"));
+          Assert::IsTrue(values[1] == std::nullopt);
+          Assert::AreEqual(*values[2], std::string("7"));
+          Assert::AreEqual(*values[3], std::string("29"));
+          Assert::IsTrue(values[4] == std::nullopt);
+          Assert::AreEqual(*hm.get(5), std::string("5"));
+        }
+        TEST_METHOD(TestCompactValueKeepsOriginalValue) {
+          std::string repeated;
+          for (int i = 0; i < 100; i++) {
+            repeated += "value " + std::to_string(i % 7) + ";";
+          }
+          for (std::string value :
+               {std::string(""), std::string("short"), std::string("42"),
+                std::string("-9223372036854775808"), std::string("007"),
+                std::string("-0"), std::string(40, 'x'), repeated}) {
+            CompactValue compact(value, 64);
+            Assert::AreEqual(compact.str(), value);
+            Assert::AreEqual(CompactValue(compact).str(), value);
+          }
+          Assert::IsTrue(CompactValue("42").integer() == 42);
+          Assert::IsTrue(CompactValue("007").integer() == std::nullopt);
+          Assert::IsTrue(CompactValue(repeated, 64).compressed());
+          Assert::IsTrue(CompactValue(repeated, 64).heap_size() <
+                         repeated.size());
+          Assert::IsFalse(CompactValue(repeated).compressed());
+        }
+        TEST_METHOD(TestIncrWorksOnTextAndIntegerValues) {
+          HashMap<uint64_t> hm(0, 0, EvictionPolicy::LRU, 64);
+          hm.put(1, "007", 1000);
+          hm.put(2, "41", 1000);
+          Assert::IsTrue(hm.incr(1, 1, 1000) == 8);
+          Assert::IsTrue(hm.incr(2, 1, 1000) == 42);
+          Assert::AreEqual(*hm.get(2), std::string("42"));
+        }
+        TEST_METHOD(TestDumpAndLoadRestoreRecords) {
+          HashMap<SmallKey> source;
+          for (int i = 0; i < 1000; i++) {
+            source.put("key" + std::to_string(i), std::to_string(i), 1000);
+          }
+          source.put("persistent", std::string(100, 'p'), 1000);
+          source.persist("persistent");
+          std::stringstream stream;
+          Assert::AreEqual(source.dump(stream), size_t(1001));
+
+          HashMap<SmallKey> target;
+          target.reserve(100'000);
+          target.put("key1", "old", 1000);
+          Assert::IsTrue(target.load(stream) == size_t(1001));
+          Assert::AreEqual(target.records(), size_t(1001));
+          Assert::AreEqual(*target.get("key1"), std::string("1"));
+          Assert::AreEqual(*target.get("key999"), std::string("999"));
+          Assert::IsTrue(target.ttl("persistent") == -1);
+
+          std::stringstream garbage("not a dump");
+          Assert::IsTrue(target.load(garbage) == std::nullopt);
+        }
+        TEST_METHOD(TestEvictionListenerAndPeek) {
+          HashMap<uint64_t> hm(2, 0, EvictionPolicy::LRU);
+          std::vector<uint64_t> evicted;
+          hm.set_eviction_listener(
+              [&evicted](const uint64_t& key) { evicted.push_back(key); });
+          hm.put_until(1, "one", HashMap<uint64_t>::NEVER);
+          hm.put(2, "two", 1000);
+          hm.put(3, "three", 1000);
+          Assert::AreEqual(evicted.size(), size_t(1));
+          Assert::AreEqual(evicted[0], uint64_t(1));
+          auto state = hm.peek(3);
+          Assert::AreEqual(state->first, std::string("three"));
+          Assert::IsTrue(hm.peek(1) == std::nullopt);
+        }
+
+        TEST_METHOD(TestExpiringKeysSkipsPersistentRecords) {
+          HashMap<SmallKey> hm;
+          hm.put(SmallKey("a"), "1", 1000);
+          hm.put_until(SmallKey("b"), "2", HashMap<SmallKey>::NEVER);
+          hm.put_until(SmallKey("c"), "3", time(NULL) - 10);
+          auto keys = hm.expiring_keys();
+          Assert::AreEqual(keys.size(), size_t(1));
+          Assert::AreEqual(keys[0].first, std::string("a"));
+          Assert::IsTrue(keys[0].second >= time(NULL) + 999);
+        }
+
+        TEST_METHOD(TestScriptReadsComputesAndWrites) {
+          HashMap<SmallKey> hm;
+          std::vector<std::string> changed;
+          auto listener = [&changed](const std::string& key) {
+            changed.push_back(key);
+          };
+          Script script(
+              "a = get($1); b = get($2); if a == nil or b == nil then "
+              "return nil end; set($3, a + b, 100); return $3 .. '=' .. "
+              "(a + b)");
+          Assert::IsTrue(script.writes());
+          Assert::IsTrue(script.run(hm, {"x", "y", "sum"}, listener) ==
+                         std::nullopt);
+          hm.put(SmallKey("x"), "40", 100);
+          hm.put(SmallKey("y"), "2", 100);
+          auto result = script.run(hm, {"x", "y", "sum"}, listener);
+          Assert::AreEqual(*result, std::string("sum=42"));
+          Assert::AreEqual(*hm.get(SmallKey("sum")), std::string("42"));
+          Assert::AreEqual(changed.size(), size_t(1));
+          Script counter("n = incr('c', 2) ; if n > 3 and not exists('d') "
+                         "then return 'big' else return n end");
+          Assert::IsFalse(counter.run(hm, {}, listener) == std::nullopt);
+          Assert::AreEqual(*counter.run(hm, {}, listener), std::string("big"));
+          Assert::AreEqual(*hm.ttl(SmallKey("c")), int64_t(-1));
+        }
+
+        TEST_METHOD(TestScriptReportsErrors) {
+          HashMap<SmallKey> hm;
+          const char* wrong[] = {"return x", "set(1)", "if 1 then",
+                                 "return 'a", "foo(1)", "1 +", "x = (1"};
+          for (const char* source : wrong) {
+            bool thrown = false;
+            try {
+              Script script(source);
+            } catch (ScriptError&) {
+              thrown = true;
+            }
+            Assert::IsTrue(thrown);
+          }
+          auto nothing = [](const std::string&) {};
+          bool thrown = false;
+          try {
+            Script("return 1 / (get('k') + 0)").run(hm, {}, nothing);
+          } catch (ScriptError&) {
+            thrown = true;  // nil is not a number
+          }
+          Assert::IsTrue(thrown);
+          Assert::IsFalse(Script("return get($1)").writes());
+          Assert::AreEqual(Script::id("return 1"), Script::id("return 1"));
+        }
+
+        TEST_METHOD(TestOrderedIndexKeepsKeysSorted) {
+          OrderedIndex<uint64_t> index;
+          std::set<uint64_t> expected;
+          srand(7);
+          for (int i = 0; i < 20000; i++) {
+            uint64_t key = rand() % 5000;
+            if (rand() % 3) {
+              index.insert(key);
+              expected.insert(key);
+            } else {
+              index.erase(key);
+              expected.erase(key);
+            }
+          }
+          Assert::AreEqual(index.size(), expected.size());
+          std::vector<uint64_t> keys;
+          index.scan(0, UINT64_MAX, [&keys](uint64_t key) {
+            keys.push_back(key);
+            return true;
+          });
+          Assert::IsTrue(keys == std::vector<uint64_t>(expected.begin(),
+                                                       expected.end()));
+          keys.clear();
+          index.scan(1000, 2000, [&keys](uint64_t key) {
+            keys.push_back(key);
+            return keys.size() < 10;
+          });
+          Assert::IsTrue(keys == std::vector<uint64_t>(
+                                     expected.lower_bound(1000),
+                                     std::next(expected.lower_bound(1000), 10)));
+          for (uint64_t key : expected) {
+            index.erase(key);
+          }
+          Assert::AreEqual(index.size(), size_t(0));
+        }
+
+        TEST_METHOD(TestRangeReturnsKeysInOrder) {
+          HashMap<SmallKey> hm;
+          Assert::IsTrue(hm.range(SmallKey("a"), SmallKey("z"), 10).empty());
+          hm.put(SmallKey("b"), "2", 100);
+          hm.put(SmallKey("a"), "1", 100);
+          hm.enable_index();
+          hm.put(SmallKey("d"), "4", 100);
+          hm.put(SmallKey("c"), "3", 100);
+          hm.put(SmallKey("e"), "5", 100);
+          hm.put_until(SmallKey("ca"), "old", time(NULL) - 10);  // expired
+          hm.remove(SmallKey("d"));
+          auto records = hm.range(SmallKey("b"), SmallKey("d"), 10);
+          Assert::AreEqual(records.size(), size_t(2));
+          Assert::AreEqual(records[0].first, std::string("b"));
+          Assert::AreEqual(records[1].second, std::string("3"));
+          Assert::AreEqual(hm.records(), size_t(4));
+          Assert::AreEqual(hm.range(SmallKey("a"), SmallKey("z"), 3).size(),
+                           size_t(3));
+          size_t indexed = hm.memory_usage();
+          hm.disable_index();
+          Assert::IsTrue(hm.memory_usage() < indexed);
+        }
+
+        TEST_METHOD(TestSegmentedMapSpreadsAndSplitsKeys) {
+          SegmentedMap<SmallKey> sm(0, 0, EvictionPolicy::LRU, 0, 4);
+          Assert::IsFalse(SegmentedMap<SmallKey>::valid_segments(3));
+          Assert::AreEqual(sm.segments(), size_t(4));
+          sm.enable_index();
+          for (int i = 0; i < 1000; i++) {
+            std::string key = "key" + std::to_string(i);
+            sm.put(SmallKey(key), std::to_string(i), 100);
+          }
+          for (size_t i = 0; i < sm.segments(); i++) {
+            Assert::IsTrue(sm.segment(i).records() > 150);  // about 250
+          }
+          Assert::IsTrue(sm.split());
+          Assert::AreEqual(sm.segments(), size_t(8));
+          Assert::AreEqual(sm.records(), size_t(1000));
+          for (int i = 0; i < 1000; i++) {
+            SmallKey key("key" + std::to_string(i));
+            Assert::AreEqual(*sm.get(key), std::to_string(i));
+          }
+          auto records = sm.range(SmallKey("key10"), SmallKey("key19"), 5);
+          Assert::AreEqual(records.size(), size_t(5));
+          Assert::AreEqual(records[0].first, std::string("key10"));
+          Assert::AreEqual(records[1].first, std::string("key100"));
+          Assert::AreEqual(records[4].first, std::string("key103"));
+        }
+
+        TEST_METHOD(TestSegmentedMapDumpLoadsIntoOtherSegments) {
+          SegmentedMap<SmallKey> sm(0, 0, EvictionPolicy::LRU, 0, 8);
+          for (int i = 0; i < 100; i++) {
+            std::string key = "key" + std::to_string(i);
+            sm.put(SmallKey(key), std::to_string(i), 100);
+          }
+          std::stringstream dump;
+          Assert::AreEqual(sm.dump(dump), size_t(100));
+          HashMap<SmallKey> hm;  // one dump format for both maps
+          Assert::AreEqual(*hm.load(dump), size_t(100));
+          Assert::AreEqual(*hm.get(SmallKey("key42")), std::string("42"));
+          std::stringstream again;
+          hm.dump(again);
+          SegmentedMap<SmallKey> other(0, 0, EvictionPolicy::LRU, 0, 2);
+          Assert::AreEqual(*other.load(again), size_t(100));
+          Assert::AreEqual(other.records(), size_t(100));
+          Assert::AreEqual(*other.get(SmallKey("key7")), std::string("7"));
+        }
+
+        TEST_METHOD(TestSegmentedMapEvictsFromNonEmptySegment) {
+          SegmentedMap<SmallKey> sm(0, 0, EvictionPolicy::LRU, 0, 2);
+          std::vector<SmallKey> first, second;
+          for (int i = 0; first.size() < 70000 || second.size() < 100; i++) {
+            SmallKey key("key" + std::to_string(i));
+            if (sm.segment_of(key) == 0 && first.size() < 70000) {
+              first.push_back(key);
+            } else if (sm.segment_of(key) == 1 && second.size() < 100) {
+              second.push_back(key);
+            }
+          }
+          for (const auto& key : first) {
+            sm.put(key, "v", 100);
+          }
+          HashMap<SmallKey> hm;
+          for (const auto& key : second) {
+            hm.put(key, "v", 100);
+          }
+          std::stringstream dump;
+          hm.dump(dump);
+          Assert::AreEqual(*sm.load(dump), size_t(100));
+          // load reserved buckets for the records of segment 0, it keeps
+          // the bigger bucket array without records
+          for (const auto& key : first) {
+            sm.remove(key);
+          }
+          Assert::IsTrue(sm.segment(0).memory_usage() >
+                         sm.segment(1).memory_usage());
+          Assert::AreEqual(sm.records(), size_t(100));
+          Assert::IsTrue(sm.evict());
+          Assert::AreEqual(sm.records(), size_t(99));
+          while (sm.evict()) {
+          }
+          Assert::AreEqual(sm.records(), size_t(0));
+        }
+
+        TEST_METHOD(TestTokenBucketLimitsRate) {
+          TokenBucket bucket;
+          int64_t now = 1'000'000;  // microseconds
+          int admitted = 0;
+          for (int i = 0; i < 100; i++) {
+            if (bucket.admit(10, now)) {
+              bucket.take(1);
+              admitted++;
+            }
+          }
+          Assert::AreEqual(admitted, 10);  // burst of one second
+          Assert::IsFalse(bucket.admit(10, now + 50'000));
+          Assert::IsTrue(bucket.admit(10, now + 100'000));  // one token later
+          bucket.take(15);  // debt of a large request
+          Assert::IsFalse(bucket.admit(10, now + 2'100'000));
+          Assert::IsTrue(bucket.admit(10, now + 3'200'000));
+          Assert::IsTrue(bucket.admit(0, now));  // unlimited
+        }
+
+        TEST_METHOD(TestUserQuotasCountUsers) {
+          UserQuotas quotas;
+          quotas.set_rates(2, 0);
+          UserStats& alice = quotas.find("alice");
+          Assert::IsTrue(&alice == &quotas.find("alice"));
+          Assert::IsTrue(quotas.admit(alice, 10));
+          Assert::IsTrue(quotas.admit(alice, 10));
+          Assert::IsFalse(quotas.admit(alice, 10));
+          Assert::IsTrue(quotas.admit(quotas.find("bob"), 5));  // own bucket
+          quotas.account(alice, 100);
+          quotas.set_owned({{"bob", {2, 40}}});
+          auto usage = quotas.usage();
+          Assert::AreEqual(usage.size(), size_t(2));
+          Assert::AreEqual(usage[0].user, std::string("alice"));
+          Assert::AreEqual(usage[0].ops, uint64_t(2));
+          Assert::AreEqual(usage[0].bytes, uint64_t(120));
+          Assert::AreEqual(usage[0].rejected, uint64_t(1));
+          Assert::AreEqual(usage[1].records, uint64_t(40));
+        }
+
+        TEST_METHOD(TestHotKeysFindsMostUsedKeys)
+        {
+          HotKeys hot_keys;
+          for (int i = 0; i < 100000; i++) {
+            hot_keys.access(i % 2 ? "hot" : std::to_string(i));
+            if (i % 10 == 0) {
+              hot_keys.access("warm");
+            }
+          }
+          auto top = hot_keys.top();
+          Assert::IsTrue(top.size() <= HotKeys::TOP_K);
+          Assert::AreEqual(top[0].first, std::string("hot"));
+          Assert::AreEqual(top[1].first, std::string("warm"));
+          // the sketch never underestimates, sampling error is small
+          Assert::IsTrue(top[0].second > 45000 && top[0].second < 55000);
+          hot_keys.clear();
+          Assert::IsTrue(hot_keys.top().empty());
+        }
+
+        TEST_METHOD(TestReadPassesValueOfEveryKind)
+        {
+          HashMap<uint64_t> hm(0, 0, EvictionPolicy::LRU, 500);
+          std::string heap(100, 'h');
+          std::string compressed(1000, 'c');
+          hm.put(1, "short", 1000);
+          hm.put(2, "-42", 1000);
+          hm.put(3, heap, 1000);
+          hm.put(4, compressed, 1000);
+          std::string value;
+          auto copy = [&value](std::string_view view) { value = view; };
+          Assert::IsTrue(hm.read(1, copy));
+          Assert::AreEqual(value, std::string("short"));
+          Assert::IsTrue(hm.read(2, copy));
+          Assert::AreEqual(value, std::string("-42"));
+          Assert::IsTrue(hm.read(3, copy));
+          Assert::AreEqual(value, heap);
+          Assert::IsTrue(hm.read(4, copy));
+          Assert::AreEqual(value, compressed);
+          Assert::IsFalse(hm.read(5, copy));
+        }
+
+        TEST_METHOD(TestTableMemoryStatsCountBucketArrays)
+        {
+          TableMemoryStats before = table_memory_stats();
+          {
+            HashMap<uint64_t> hm;  // bucket and tag arrays of BASIC_SIZE
+            TableMemoryStats stats = table_memory_stats();
+            Assert::AreEqual(stats.arrays, before.arrays + 2);
+            Assert::IsTrue(stats.bytes >=
+                           before.bytes + HashMap<uint64_t>::BASIC_SIZE * 8);
+          }
+          Assert::AreEqual(table_memory_stats().arrays, before.arrays);
+        }
+
+        TEST_METHOD(TestResponseBufferGathersAndReusesChunks)
+        {
+          ResponseBuffer out;
+          std::string line(ResponseBuffer::CHUNK_SIZE - 10, 'a');
+          out.append(line);
+          out.append("x=");
+          out.append_number(-1234567890123);
+          out.append_line("b\nc\n");
+          std::string table(ResponseBuffer::CHUNK_SIZE * 2, 't');
+          out.append(std::string(table));  // moved in
+          std::string expected =
+              line + "x=-1234567890123" + "b c " + table;
+          Assert::AreEqual(out.size(), expected.size());
+
+          std::string written;
+          auto write = [&written](const char* data, size_t size) {
+            written.append(data, size);
+          };
+          size_t bytes = out.gather(64, write);
+          Assert::AreEqual(bytes, expected.size());
+          Assert::AreEqual(written, expected);
+          out.append("tail");  // appended during the write
+          out.consume(bytes);
+          Assert::AreEqual(out.size(), size_t(4));
+          written.clear();
+          out.consume(out.gather(64, write));
+          Assert::AreEqual(written, std::string("tail"));
+          Assert::IsTrue(out.empty());
+          Assert::AreEqual(out.gather(64, write), size_t(0));
+        }
+
+        TEST_METHOD(TestResponseBufferMovesLongLines)
+        {
+          ResponseBuffer out;
+          std::string table(ResponseBuffer::CHUNK_SIZE * 2, 't');
+          table[10] = '\n';
+          const char* data = table.data();
+          out.append_line(std::move(table));
+          out.append_line(std::string("short\nline"));
+          std::vector<std::pair<const char*, size_t>> pieces;
+          std::string written;
+          out.gather(64, [&](const char* data, size_t size) {
+            pieces.emplace_back(data, size);
+            written.append(data, size);
+          });
+          Assert::AreEqual(pieces.size(), size_t(2));
+          Assert::IsTrue(pieces[0].first == data);  // not copied
+          std::string expected(ResponseBuffer::CHUNK_SIZE * 2, 't');
+          expected[10] = ' ';
+          Assert::AreEqual(written, expected + "short line");
+        }
 	};
 }